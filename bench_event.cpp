@@ -0,0 +1,327 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "event.h"
+#include "util.h"
+#include "writer.h"
+
+
+// Micro-benchmarks for the event loop. Build and run them with
+// "make bench-event". Each result is printed as a single line of JSON, which
+// makes it easy to compare backends, or to keep a history of results and
+// catch regressions. Pass "ppoll" or "epoll" on the command line to only
+// benchmark one of the backends, and "quick" for a shorter run.
+
+// Divides the number of iterations, so that "quick" runs finish in a
+// fraction of a second.
+static unsigned divisor = 1;
+
+// Set, if any of the benchmarks noticed that the code misbehaved.
+static bool failed = false;
+
+static uint64_t nanos() {
+  struct timespec spec;
+  clock_gettime(CLOCK_MONOTONIC, &spec);
+  return (uint64_t)spec.tv_sec*1000000000 + spec.tv_nsec;
+}
+
+static const char *name(Event::Backend backend) {
+  return backend == Event::EPOLL ? "epoll" : "ppoll";
+}
+
+static void throughput(const char *benchmark, Event::Backend backend,
+                       size_t live, uint64_t ops, uint64_t ns) {
+  printf("{\"benchmark\":\"%s\",\"backend\":\"%s\",\"live\":%zu,"
+         "\"ops\":%llu,\"ns_per_op\":%.1f,\"ops_per_sec\":%.0f}\n",
+         benchmark, name(backend), live, (unsigned long long)ops,
+         (double)ns/ops, ops*1e9/(ns ? ns : 1));
+  fflush(stdout);
+}
+
+static void latency(const char *benchmark, Event::Backend backend,
+                    std::vector<uint64_t>& samples) {
+  std::sort(samples.begin(), samples.end());
+  const auto pct = [&](double p) {
+    return (unsigned long long)samples[(size_t)(p*(samples.size() - 1))]; };
+  printf("{\"benchmark\":\"%s\",\"backend\":\"%s\",\"samples\":%zu,"
+         "\"p50_ns\":%llu,\"p90_ns\":%llu,\"p99_ns\":%llu,\"max_ns\":%llu}\n",
+         benchmark, name(backend), samples.size(), pct(0.5), pct(0.9),
+         pct(0.99), (unsigned long long)samples.back());
+  fflush(stdout);
+}
+
+// Small deterministic pseudo-random number generator, so that runs are
+// comparable with each other.
+static uint32_t rnd() {
+  static uint32_t state = 1;
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+// Adds and immediately cancels timeouts, while "live" other timeouts are
+// pending. None of them ever fire.
+static void timerInsertCancel(Event::Backend backend, size_t live) {
+  Event event(backend);
+  std::vector<Event::Handle> handles;
+  for (size_t i = 0; i < live; ++i) {
+    handles.push_back(event.addTimeout(3600000 + rnd() % 3600000, [](){}));
+  }
+  const uint64_t ops = 1000000/divisor;
+  const auto start = nanos();
+  for (uint64_t i = 0; i < ops; ++i) {
+    event.removeTimeout(event.addTimeout(1 + rnd() % 3600000, [](){}));
+  }
+  throughput("timer_insert_cancel", backend, live, ops, nanos() - start);
+  for (const auto& handle : handles) {
+    event.removeTimeout(handle);
+  }
+}
+
+// Keeps "live" timeouts pending at all times. Whenever one of them fires,
+// it gets replaced by a new one. A simulated clock makes the loop skip
+// ahead to the next deadline, which measures the cost of the timer wheel
+// rather than the time spent waiting.
+static void timerFire(Event::Backend backend, size_t live) {
+  Util::SimulatedClock clock;
+  Event event(backend);
+  const uint64_t ops = 500000/divisor + live;
+  uint64_t fired = 0;
+  std::function<void (void)> cb = [&]() {
+    if (++fired + live <= ops) {
+      event.addTimeout(1 + rnd() % 1000, cb);
+    }
+  };
+  for (size_t i = 0; i < live; ++i) {
+    event.addTimeout(1 + rnd() % 1000, cb);
+  }
+  const auto start = nanos();
+  event.loop();
+  throughput("timer_fire", backend, live, fired, nanos() - start);
+}
+
+// This is the pattern that the Lutron client uses to read from its socket.
+// It registers a one-shot callback for POLLIN, reads the data when it
+// arrives, removes the registration, and then registers again for the next
+// read.
+static void fdChurn(Event::Backend backend) {
+  int fds[2];
+  if (pipe2(fds, O_NONBLOCK | O_CLOEXEC)) {
+    return;
+  }
+  Event event(backend);
+  const uint64_t ops = 200000/divisor;
+  uint64_t count = 0;
+  std::function<bool (pollfd *)> cb = [&](auto) {
+    char ch;
+    event.removePollFd(fds[0]);
+    if (read(fds[0], &ch, 1) == 1 && ++count < ops) {
+      if (write(fds[1], "x", 1) != 1) { }
+      event.addPollFd(fds[0], POLLIN, cb);
+    }
+    return false;
+  };
+  if (write(fds[1], "x", 1) != 1) { }
+  event.addPollFd(fds[0], POLLIN, cb);
+  const auto start = nanos();
+  event.loop();
+  throughput("fd_churn", backend, 1, count, nanos() - start);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// Measures runLater() both for long chains of callbacks that each schedule
+// the next one, and for large batches that are scheduled all at once.
+static void runLater(Event::Backend backend) {
+  const uint64_t ops = 1000000/divisor;
+  {
+    Event event(backend);
+    uint64_t count = 0;
+    std::function<void (void)> cb = [&]() {
+      if (++count < ops) {
+        event.runLater(cb);
+      }
+    };
+    event.runLater(cb);
+    const auto start = nanos();
+    event.loop();
+    throughput("run_later_chain", backend, 1, count, nanos() - start);
+  }
+  {
+    Event event(backend);
+    uint64_t count = 0;
+    const auto start = nanos();
+    for (uint64_t i = 0; i < ops; ++i) {
+      event.runLater([&]() { ++count; });
+    }
+    event.loop();
+    throughput("run_later_batch", backend, ops, count, nanos() - start);
+  }
+}
+
+// Another thread makes a file descriptor readable, and we measure how long
+// it takes until the callback runs. The two threads take turns, so that
+// there is only ever one outstanding wakeup.
+static void wakeup(Event::Backend backend, bool useEventFd) {
+  int fds[2];
+  if (useEventFd) {
+    fds[0] = fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fds[0] < 0) {
+      return;
+    }
+  } else if (pipe2(fds, O_NONBLOCK | O_CLOEXEC)) {
+    return;
+  }
+  Event event(backend);
+  const size_t samples = 20000/divisor;
+  std::vector<uint64_t> latencies;
+  latencies.reserve(samples);
+  std::atomic<uint64_t> sent = 0;
+  std::atomic<bool> ack = true;
+  std::thread sender([&]() {
+    for (size_t i = 0; i < samples; ++i) {
+      while (!ack.exchange(false)) {
+        std::this_thread::yield();
+      }
+      // Give the loop a chance to go back to sleep first.
+      const struct timespec pause = { 0, 20000 };
+      nanosleep(&pause, nullptr);
+      const uint64_t one = 1;
+      sent = nanos();
+      if (write(fds[1], &one, useEventFd ? 8 : 1) < 0) { }
+    }
+  });
+  event.addPollFd(fds[0], POLLIN, [&](auto) {
+    const auto now = nanos();
+    uint64_t buf;
+    if (read(fds[0], &buf, sizeof(buf)) > 0) {
+      latencies.push_back(now - sent);
+      ack = true;
+    }
+    return latencies.size() < samples;
+  });
+  event.loop();
+  sender.join();
+  latency(useEventFd ? "wakeup_eventfd" : "wakeup_pipe", backend, latencies);
+  close(fds[0]);
+  if (fds[1] != fds[0]) {
+    close(fds[1]);
+  }
+}
+
+// Same as above, but uses Event::post() to wake up the loop. That's what
+// the thread pool uses to deliver its results.
+static void wakeupPost(Event::Backend backend) {
+  Event event(backend);
+  const size_t samples = 20000/divisor;
+  std::vector<uint64_t> latencies;
+  latencies.reserve(samples);
+  std::atomic<bool> ack = true;
+  event.retain();
+  std::thread sender([&]() {
+    for (size_t i = 0; i < samples; ++i) {
+      while (!ack.exchange(false)) {
+        std::this_thread::yield();
+      }
+      const struct timespec pause = { 0, 20000 };
+      nanosleep(&pause, nullptr);
+      event.post([&, sent = nanos()]() {
+        latencies.push_back(nanos() - sent);
+        if (latencies.size() == samples) {
+          event.release();
+        }
+        ack = true; });
+    }
+  });
+  event.loop();
+  sender.join();
+  latency("wakeup_post", backend, latencies);
+}
+
+// Queues data for one file descriptor, and then switches to another one
+// before the writer had a chance to flush. That's what happens, when a
+// connection drops or gets handed over. Data for the new file descriptor
+// must still go out.
+static void writerReattach(Event::Backend backend) {
+  int a[2], b[2];
+  if (pipe2(a, O_NONBLOCK | O_CLOEXEC)) {
+    return;
+  }
+  if (pipe2(b, O_NONBLOCK | O_CLOEXEC)) {
+    close(a[0]);
+    close(a[1]);
+    return;
+  }
+  Event event(backend);
+  Writer writer(event);
+  const uint64_t ops = 100000/divisor;
+  uint64_t count = 0;
+  const auto start = nanos();
+  for (uint64_t i = 0; i < ops; ++i) {
+    writer.attach(a[1]);
+    writer.write("x");
+    writer.attach(b[1]);
+    writer.write("y");
+    event.loop();
+    char ch;
+    if (read(b[0], &ch, 1) == 1 && ch == 'y') {
+      ++count;
+    }
+  }
+  throughput("writer_reattach", backend, 1, ops, nanos() - start);
+  if (count != ops) {
+    fprintf(stderr, "writer_reattach: lost %llu of %llu writes\n",
+            (unsigned long long)(ops - count), (unsigned long long)ops);
+    failed = true;
+  }
+  writer.detach();
+  for (int fd : { a[0], a[1], b[0], b[1] }) {
+    close(fd);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  std::vector<Event::Backend> backends;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "ppoll")) {
+      backends.push_back(Event::PPOLL);
+    } else if (!strcmp(argv[i], "epoll")) {
+      backends.push_back(Event::EPOLL);
+    } else if (!strcmp(argv[i], "quick")) {
+      divisor = 50;
+    } else {
+      fprintf(stderr, "Usage: %s [ppoll] [epoll] [quick]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (backends.empty()) {
+    backends = { Event::PPOLL, Event::EPOLL };
+  }
+  for (auto backend : backends) {
+    for (size_t live : { 10, 100, 10000 }) {
+      timerInsertCancel(backend, live);
+    }
+    for (size_t live : { 10, 100, 10000 }) {
+      timerFire(backend, live);
+    }
+    fdChurn(backend);
+    runLater(backend);
+    wakeup(backend, true);
+    wakeup(backend, false);
+    wakeupPost(backend);
+    writerReattach(backend);
+  }
+  return failed;
+}
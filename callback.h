@@ -0,0 +1,138 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Callbacks are stored inline, if they fit into this many bytes. Otherwise,
+// they have to be allocated on the heap. The default is large enough for
+// the typical lambda that captures "this", a string, and a couple of
+// std::function objects. It can be overridden at compile time.
+#ifndef CALLBACK_CAPACITY
+#define CALLBACK_CAPACITY 128
+#endif
+
+// Keeps track of how effective the inline storage is. "inlined" counts
+// the heap allocations that we avoided, whereas "allocated" counts the
+// callbacks that were too big and ended up on the heap anyway. Callbacks
+// can be created on worker threads, so the counters have to be atomic.
+struct CallbackStats {
+  static inline std::atomic<size_t> inlined = 0;
+  static inline std::atomic<size_t> allocated = 0;
+};
+
+template <class Sig, size_t Capacity = CALLBACK_CAPACITY>
+class Callback;
+
+// Drop-in replacement for std::function for callbacks that have a single
+// owner, such as the ones registered with the event loop. Unlike
+// std::function, it never has to copy its target. That means it can hold
+// move-only objects, and moving it around never allocates memory. Most
+// targets fit into the inline buffer and don't need any heap allocation
+// in the first place.
+template <class R, class... Args, size_t Capacity>
+class Callback<R (Args...), Capacity> {
+ public:
+  Callback() : ops_(nullptr) { }
+  Callback(std::nullptr_t) : ops_(nullptr) { }
+  template <class F, class T = std::decay_t<F>,
+            class = std::enable_if_t<!std::is_same_v<T, Callback> &&
+                                   std::is_invocable_r_v<R, T&, Args...>>>
+  Callback(F&& f) : ops_(nullptr) {
+    // Empty std::function objects, null function pointers, and empty
+    // callbacks all result in an empty callback. Plain functions can never
+    // be null, and comparing them would only trigger a compiler warning.
+    if constexpr (!std::is_function_v<std::remove_reference_t<F>> &&
+                  requires (const T& t) { t == nullptr; }) {
+      if (f == nullptr) {
+        return;
+      }
+    }
+    if constexpr (isInline<T>()) {
+      new (buf_) T(std::forward<F>(f));
+      ops_ = &inlineOps<T>;
+      CallbackStats::inlined.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      *reinterpret_cast<T **>(buf_) = new T(std::forward<F>(f));
+      ops_ = &heapOps<T>;
+      CallbackStats::allocated.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  Callback(Callback&& o) : ops_(o.ops_) {
+    if (ops_) {
+      ops_->move(buf_, o.buf_);
+      o.ops_ = nullptr;
+    }
+  }
+  Callback(const Callback&) = delete;
+  ~Callback() { reset(); }
+
+  Callback& operator=(Callback&& o) {
+    if (this != &o) {
+      reset();
+      if ((ops_ = o.ops_) != nullptr) {
+        ops_->move(buf_, o.buf_);
+        o.ops_ = nullptr;
+      }
+    }
+    return *this;
+  }
+  Callback& operator=(const Callback&) = delete;
+  Callback& operator=(std::nullptr_t) { reset(); return *this; }
+
+  explicit operator bool() const { return !!ops_; }
+  bool operator==(std::nullptr_t) const { return !ops_; }
+
+  // Just like std::function, invoking the callback doesn't require a
+  // mutable object, even though the target itself might not be const.
+  R operator()(Args... args) const {
+    return ops_->invoke(const_cast<unsigned char *>(buf_),
+                        std::forward<Args>(args)...);
+  }
+
+ private:
+  struct Ops {
+    R    (*invoke)(void *buf, Args&&... args);
+    void (*move)(void *dst, void *src);
+    void (*destroy)(void *buf);
+  };
+
+  template <class T>
+  static constexpr bool isInline() {
+    return sizeof(T) <= Capacity &&
+           alignof(T) <= alignof(std::max_align_t) &&
+           std::is_nothrow_move_constructible_v<T>;
+  }
+
+  template <class T>
+  static constexpr Ops inlineOps = {
+    [](void *buf, Args&&... args) -> R {
+      return (*static_cast<T *>(buf))(std::forward<Args>(args)...); },
+    [](void *dst, void *src) {
+      new (dst) T(std::move(*static_cast<T *>(src)));
+      static_cast<T *>(src)->~T(); },
+    [](void *buf) { static_cast<T *>(buf)->~T(); }
+  };
+
+  template <class T>
+  static constexpr Ops heapOps = {
+    [](void *buf, Args&&... args) -> R {
+      return (**static_cast<T **>(buf))(std::forward<Args>(args)...); },
+    [](void *dst, void *src) {
+      *static_cast<T **>(dst) = *static_cast<T **>(src); },
+    [](void *buf) { delete *static_cast<T **>(buf); }
+  };
+
+  void reset() {
+    if (ops_) {
+      const Ops *ops = ops_;
+      ops_ = nullptr;
+      ops->destroy(buf_);
+    }
+  }
+
+  alignas(std::max_align_t) unsigned char buf_[Capacity];
+  const Ops *ops_;
+};
@@ -57,12 +57,11 @@ int main(int argc, char *argv[]) {
         // Start looping over commands as soon as connection is ready.
         cb(); loop();
       })
-      .oninput([](const std::string& line) {
+      .oninput([](const LutronMessage& msg) {
         // Print all progress messages, but omit login handshake.
-        if (!line.empty() && line.find(':') == std::string::npos) {
-          if (!line.empty()) {
-            std::cout << line << std::endl;
-          }
+        if (msg.kind != LutronMessage::PROMPT && !msg.raw.empty() &&
+            msg.raw.find(':') == std::string_view::npos) {
+          std::cout << msg.raw << std::endl;
         }
       })
       .onclosed([&]() { event.exitLoop(); });
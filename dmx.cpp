@@ -19,7 +19,8 @@ static const char *dmxsrv;
 
 DMX::DMX(Event& event, const std::string& dev)
   : event_(event), dev_(dev.empty() ? "/dev/ttyUSB0" : dev), fd_(-1),
-    adj_(0), fadeTime_(1), refreshTmo_(0) {
+    adj_(0), fadeTime_(1), refreshTmo_(), busy_(false), dirty_(false),
+    lastBreak_(0), drained_(0) {
 #if !defined(NDEBUG)
   // It is easier to develop on a more powerful device. Setting the
   // DMXSERVER environment variable to an empty string enables a server that
@@ -55,6 +56,7 @@ DMX::DMX(Event& event, const std::string& dev)
 }
 
 DMX::~DMX() {
+  event_.cancelIo(io_);
   if (fd_ >= 0) {
     close(fd_);
     fd_ = -1;
@@ -104,7 +106,7 @@ void DMX::set(int idx, int val, bool fade) {
   refresh(updates_[idx]++ ? 0 : 5);
 }
 
-void DMX::refresh(unsigned when) {
+void DMX::refresh(unsigned when, unsigned slack) {
   // Wait until a break of at least 5ms before actually sending an updated
   // package. This allows a sequence of updates to all be made atomically.
   // Afterwards, switch to a regular low-frequency stream of DMX packages to
@@ -113,7 +115,8 @@ void DMX::refresh(unsigned when) {
   if (!when) {
     sendPacket();
   } else {
-    refreshTmo_ = event_.addTimeout(when, [this]() { sendPacket(); });
+    refreshTmo_ = event_.addTimeout(when, slack, [this]() { sendPacket(); });
+    event_.setPriority(refreshTmo_, Event::REALTIME);
   }
 }
 
@@ -163,17 +166,95 @@ void DMX::sendPacket() {
         return;
       }
     }
-    Serial::brk(fd_);
-    if (write(fd_, phys_.data(), phys_.size()) != (ssize_t)phys_.size()) {
-      DBG("Write error on serial port");
-      close(fd_);
-      fd_ = -1;
+    if (event_.hasRing()) {
+      sendFrame();
+    } else {
+      Serial::brk(fd_);
+      if (write(fd_, phys_.data(), phys_.size()) != (ssize_t)phys_.size()) {
+        DBG("Write error on serial port");
+        close(fd_);
+        fd_ = -1;
+      }
     }
   }
 
   // Clear the flags that show which parameters have changed. Then schedule
   // another update in 200ms. This can happen sooner, if there are any new
-  // updates.
+  // updates. The keep-alive packets don't need precise timing, and can share
+  // a wakeup with other timers. But fades must stay smooth.
   updates_.clear();
-  refresh(nextTmo);
+  refresh(nextTmo, adj_ ? 0 : 50);
+}
+
+void DMX::sendFrame() {
+  // With io_uring, we don't need to block the event loop while waiting for
+  // the DMX timing requirements. Instead, each step of sending a frame is
+  // scheduled asynchronously. Only one frame can be in flight at any time.
+  // If more updates arrive in the meantime, we send another frame with the
+  // most recent data once the current one is done.
+  if (busy_) {
+    dirty_ = true;
+    return;
+  }
+  busy_ = true;
+
+  // The break has to wait until the previous frame has been transmitted,
+  // and the minimum interval between breaks has passed.
+  const auto now = Util::micros64();
+  const auto ready = std::max(lastBreak_ + Serial::BREAK_INTERVAL, drained_);
+  if (ready <= now ||
+      !(io_ = event_.submitTimeout(ready - now, [this](int) {
+          io_ = {};
+          startBreak(); }))) {
+    startBreak();
+  } else {
+    event_.setPriority(io_, Event::REALTIME);
+  }
+}
+
+void DMX::startBreak() {
+  // Hold the break for the required time, then release it and write the
+  // frame after the MAB. The kernel links the MAB delay to the write.
+  Serial::setBreak(fd_, true);
+  lastBreak_ = Util::micros64();
+  io_ = event_.submitTimeout(Serial::BREAK_LENGTH, [this](int) {
+    Serial::setBreak(fd_, false);
+    io_ = event_.submitWrite(fd_, std::string(phys_.begin(), phys_.end()),
+                             [this](int rc) {
+      io_ = {};
+      finishFrame(rc); }, Serial::MAB_LENGTH);
+    if (io_) {
+      event_.setPriority(io_, Event::REALTIME);
+    } else {
+      usleep(Serial::MAB_LENGTH);
+      finishFrame(write(fd_, phys_.data(), phys_.size()));
+    } });
+  if (io_) {
+    // Frames have to go out on time. Don't let anything else delay them.
+    event_.setPriority(io_, Event::REALTIME);
+  } else {
+    // The submission queue is full. Fall back to the blocking code path.
+    usleep(Serial::BREAK_LENGTH);
+    Serial::setBreak(fd_, false);
+    usleep(Serial::MAB_LENGTH);
+    finishFrame(write(fd_, phys_.data(), phys_.size()));
+  }
+}
+
+void DMX::finishFrame(int rc) {
+  busy_ = false;
+  if (rc <= 0) {
+    DBG("Write error on serial port");
+    close(fd_);
+    fd_ = -1;
+    dirty_ = false;
+    return;
+  }
+  // The write completes as soon as the data is in the kernel's buffer. It
+  // then takes a while longer to actually go out on the wire.
+  drained_ = Util::micros64() + rc*Serial::BYTE_TIME;
+  if (dirty_ && fd_ >= 0) {
+    dirty_ = false;
+    sendFrame();
+  }
 }
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdint.h>
+
 #include <string>
 #include <vector>
 
@@ -15,13 +17,18 @@ class DMX {
  private:
   static const int FADE_TMO = 2500;
 
-  void refresh(unsigned when = 1);
+  void refresh(unsigned when = 1, unsigned slack = 0);
   void sendPacket();
+  void sendFrame();
+  void startBreak();
+  void finishFrame(int rc);
 
   Event& event_;
   const std::string dev_;
   int fd_;
   std::vector<unsigned char> values_, phys_, updates_, fadeFrom_;
   int adj_, fadeTime_;
-  void *refreshTmo_;
+  Event::Handle refreshTmo_, io_;
+  bool busy_, dirty_;
+  uint64_t lastBreak_, drained_;
 };
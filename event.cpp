@@ -2,100 +2,141 @@
 #define _GNU_SOURCE
 #endif
 
+#include <errno.h>
+#include <limits.h>
 #include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
 
 #include "event.h"
+#include "pool.h"
+#include "ring.h"
 #include "util.h"
 
 
-Event::Event() {
+Event::Event(Backend backend, bool useRing)
+  : backend_(backend), timers_(Util::millis64()), early_(Util::millis64()),
+    useRing_(useRing), rateStart_(Util::millis64()) {
+  if (backend_ == EPOLL) {
+    epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd_ < 0) {
+      DBG("Failed to create epoll() instance; falling back to ppoll()");
+      backend_ = PPOLL;
+    } else {
+      events_.resize(16);
+    }
+  }
+  // Other threads wake us up by writing to an eventfd. This is an internal
+  // file descriptor. It shouldn't keep the loop from exiting, so it doesn't
+  // get counted in "numPollFds_".
+  wakeFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wakeFd_ >= 0) {
+    addPollFd(wakeFd_, POLLIN, [this](auto) { runPosted(); return true; });
+    --numPollFds_;
+  }
 }
 
 Event::~Event() {
-  recomputeTimeoutsAndFds();
-  while (!later_.empty()) {
+  // Wait for all worker threads to finish, then deliver any results that
+  // they posted.
+  pool_.reset();
+  runPosted();
+  syncFds();
+  for (int prio = 0; prio < PRIORITIES; ) {
     // There could be critical clean-up happening as part of the
     // later_ callbacks. Better call these, even though we are in the
     // process of shutting down.
-    const auto later = std::move(later_);
-    for (const auto& cb : later) {
-      if (cb) {
-        cb();
-      }
+    if (later_[prio].empty()) {
+      ++prio;
+      continue;
+    }
+    const auto l = std::move(later_[prio].front());
+    later_[prio].pop_front();
+    if (l.cb) {
+      l.cb();
     }
+    prio = 0;
+  }
+  // The kernel could still be accessing the buffers of I/O operations that
+  // haven't completed yet. Closing the ring cancels these operations, but
+  // that happens asynchronously. Leak the buffers rather than risking
+  // memory corruption. This only ever happens when shutting down.
+  if (ioPending_) {
+    new SlotMap<IoOp>(std::move(ios_));
   }
+  ring_.reset();
+
   // Ideally, the caller should ensure that there are no unresolved
   // pending tasks. But if there are, we'll abandon them. Hopefully, that's
-  // OK and they didn't involve any dangling objects.
-  for (const auto& timeout : timeouts_) {
-    delete timeout;
-  }
-  for (const auto& pollFd : pollFds_) {
-    delete pollFd;
+  // OK and they didn't involve any dangling objects. The slot maps release
+  // all remaining registrations when they get destroyed.
+  if (epollFd_ >= 0) {
+    close(epollFd_);
   }
-  delete[] fds_;
-  for (auto l : loop_) {
-    delete l;
+  if (wakeFd_ >= 0) {
+    close(wakeFd_);
   }
 }
 
 void Event::loop() {
-  recomputeTimeoutsAndFds();
-  while (!done_ && (!pollFds_.empty() || !timeouts_.empty() ||
-                    !later_.empty())) {
-    // Find timeout that will fire next, if any
-    unsigned now = Util::millis();
-    unsigned tmo = later_.empty() ? 0 : now + 1;
-    for (const auto& timeout : timeouts_) {
-      if (timeout && (!tmo || tmo > timeout->tmo)) {
-        tmo = timeout->tmo;
-      }
+  while (!done_ && (numPollFds_ || !timers_.empty() || hasPending() ||
+                    retained_ || ioPending_)) {
+    // If any timeouts have already expired, queue them up. Then run as much
+    // of the pending work as the budgets allow. If some of it had to be
+    // deferred, we still check for new events, but we don't wait for them.
+    collectTimeouts();
+    if (hasPending() && runPending()) {
+      continue;
     }
-    if (tmo) {
-      // If the timeout has already expired, handle it now
-      if (tmo <= now || !later_.empty()) {
-        handleTimeouts(now);
-        continue;
-      } else {
-        tmo -= now;
-      }
+    const bool block = !hasPending();
+
+    // Find timeout that will fire next, if any. A value of zero means
+    // that there is no timeout and we should wait indefinitely.
+    const auto now = Util::millis64();
+    unsigned tmo = 0;
+    if (!timers_.empty()) {
+      const auto next = std::max(timers_.nextDeadline(), now);
+      tmo = (unsigned)std::min(std::max(next - now, (uint64_t)1),
+                               (uint64_t)INT_MAX);
     }
 
     // Some users want to be invoked each time the loop iterates. This
     // would give them the opportunity to adjust the next timeout value
     // right before it normally fires.
     if (loop_.size()) {
-      for (auto l : loop_) {
-        (*l)(tmo);
+      timersChanged_ = false;
+      for (size_t i = 0; i < loop_.size(); ) {
+        const auto handle = loop_[i];
+        auto *l = loops_.get(handle.idx_, handle.gen_);
+        if (!l) {
+          // Removed loop callbacks are cleaned up lazily.
+          loop_.erase(loop_.begin() + i);
+          continue;
+        }
+        // Hold on to the callback while it runs. It might remove itself.
+        const auto site = l->site;
+        auto cb = std::move(l->cb);
+        const auto start = Util::micros64();
+        cb(tmo);
+        account(site, start);
+        if ((l = loops_.get(handle.idx_, handle.gen_)) != nullptr) {
+          l->cb = std::move(cb);
+        }
+        ++i;
       }
-      if (newTimeouts_) {
-        recomputeTimeoutsAndFds();
+      if (timersChanged_) {
         continue;
       }
     }
 
-    // Wait for next event
-    timespec ts = { (long)tmo / 1000L, ((long)(tmo % 1000))*1000000L };
-    int nFds = pollFds_.size();
-    int rc = ppoll(fds_, nFds, tmo ? &ts : nullptr, nullptr);
-    if (!rc) {
-      handleTimeouts(Util::millis());
-    } else if (rc > 0) {
-      int i = 0;
-      for (auto it = pollFds_.begin();
-           rc > 0 && it != pollFds_.end(); it++, i++) {
-        if (fds_[i].revents) {
-          if (*it) {
-            if ((*it)->cb && !(*it)->cb(&fds_[i])) {
-              removePollFd(*it);
-            }
-          }
-          fds_[i].revents = 0;
-          rc--;
-        }
-      }
-    }
-    recomputeTimeoutsAndFds();
+    // Wait for next event. Every iteration starts with a fresh budget.
+    syncFds();
+    waitForEvents(tmo, block);
+    std::fill(spent_, spent_ + PRIORITIES, 0);
   }
 }
 
@@ -103,184 +144,922 @@ void Event::exitLoop() {
   done_ = true;
 }
 
-void *Event::addPollFd(int fd, short events, std::function<bool (pollfd*)> cb) {
-  if (!newFds_) {
-    newFds_ = new std::vector<PollFd *>(pollFds_);
+Event::Handle Event::addPollFd(int fd, short events,
+                              Callback<bool (pollfd*)> cb,
+                              Trigger trigger, std::source_location loc) {
+  if (fd < 0) {
+    return Handle();
+  }
+  if (fd >= (int)fdState_.size()) {
+    fdState_.resize(fd + 1);
   }
-  for (const auto& newFd : *newFds_) {
-    if (newFd->fd == fd && !!(newFd->events & events)) {
+  for (const auto& handle : fdState_[fd].regs) {
+    const auto pollFd = lookup(handle);
+    if (pollFd && !!(pollFd->events & events)) {
       DBG("Internal error; adding duplicate event");
       abort();
     }
   }
-  PollFd *pfd = new PollFd(fd, events, cb);
-  newFds_->push_back(pfd);
-  return pfd;
+  // New registrations don't see any events until the next time we wait for
+  // the kernel. The epoch number helps us with enforcing that rule.
+  const auto idx = pollFds_.alloc(fd, events, trigger, epoch_, siteFor(loc),
+                                  std::move(cb));
+  const auto handle = Handle(KIND_POLLFD, idx, pollFds_.gen(idx));
+  fdState_[fd].regs.push_back(handle);
+  ++fdState_[fd].live;
+  ++numPollFds_;
+  markDirty(fd);
+  return handle;
 }
 
 bool Event::removePollFd(int fd, short events) {
-  bool removed = false;
-
-  // Create vector with future poll information
-  if (!newFds_) {
-    newFds_ = new std::vector<PollFd *>(pollFds_);
+  if (fd < 0 || fd >= (int)fdState_.size()) {
+    return false;
   }
-  // Zero out existing record. This avoids the potential for races
-  for (auto& pollFd : pollFds_) {
-    if (pollFd && fd == pollFd->fd && (!events || events == pollFd->events)) {
-      pollFd = nullptr;
+  bool removed = false;
+  // Stale entries in the list of registrations get cleaned up by syncFds().
+  // Until then, they are skipped as their handles no longer resolve.
+  for (size_t i = 0; i < fdState_[fd].regs.size(); ++i) {
+    const auto handle = fdState_[fd].regs[i];
+    const auto pollFd = lookup(handle);
+    if (pollFd && (!events || events == pollFd->events)) {
+      removeRegistration(handle);
       removed = true;
     }
   }
-  // Remove fd from future list
-  newFds_->erase(std::remove_if(newFds_->begin(), newFds_->end(),
-                                [&](auto e) {
-    if (fd == e->fd && (!events || events == e->events)) {
-      removed = true;
-      // It is common for removePollFd() to be called by the callback.
-      // But that lambda object includes a lot of state that cannot safely
-      // be destroyed while the callback is running. Push the actual
-      // destruction onto the "later_" callback.
-      runLater([=]() { delete e; });
-      return true;
-    }
-    return false;
-  }), newFds_->end());
   return removed;
 }
 
-bool Event::removePollFd(void *handle) {
-  if (!handle) {
+bool Event::removePollFd(Handle handle) {
+  if (!lookup(handle)) {
     return false;
   }
+  removeRegistration(handle);
+  return true;
+}
 
-  bool removed = false;
+Event::Handle Event::addTimeout(unsigned tmo, Callback<void (void)> cb,
+                                std::source_location loc) {
+  const auto idx = timeouts_.alloc(Util::millis64() + tmo, siteFor(loc),
+                                   std::move(cb));
+  Timeout& timeout = timeouts_[idx];
+  timeout.idx = idx;
+  timers_.insert(&timeout);
+  timersChanged_ = true;
+  return Handle(KIND_TIMEOUT, idx, timeouts_.gen(idx));
+}
 
-  // Create vector with future poll information
-  if (!newFds_) {
-    newFds_ = new std::vector<PollFd *>(pollFds_);
+Event::Handle Event::addTimeout(unsigned tmo, unsigned slack,
+                                Callback<void (void)> cb,
+                                std::source_location loc) {
+  // The timeout is filed under the end of its window. But it can also fire
+  // as soon as it reaches the start of its window, if the loop happens to
+  // be awake.
+  const auto handle = addTimeout(tmo + slack, std::move(cb), loc);
+  if (slack) {
+    Timeout& timeout = timeouts_[handle.idx_];
+    timeout.early.deadline = timeout.deadline - slack;
+    timeout.early.owner = &timeout;
+    early_.insert(&timeout.early);
   }
-  // Zero out existing record. This avoids the potential for races
-  for (auto& pollFd : pollFds_) {
-    if (pollFd && pollFd == handle) {
-      pollFd = nullptr;
-      removed = true;
-    }
+  return handle;
+}
+
+bool Event::removeTimeout(Handle handle) {
+  Timeout *timeout = handle.kind_ == KIND_TIMEOUT ?
+    timeouts_.get(handle.idx_, handle.gen_) : nullptr;
+  if (!timeout) {
+    return false;
   }
-  // Remove fd from future list
-  newFds_->erase(std::remove_if(newFds_->begin(), newFds_->end(),
-                                [&](auto e) {
-    if (e == handle) {
-      removed = true;
-      // It is common for removePollFd() to be called by the callback.
-      // But that lambda object includes a lot of state that cannot safely
-      // be destroyed while the callback is running. Push the actual
-      // destruction onto the "later_" callback.
-      runLater([=]() { delete e; });
+  // A timeout that is still registered can't currently be executing its
+  // callback, as runTimeout() unregisters timeouts before firing them.
+  // So, it is safe to release it right away. This also takes it off the
+  // list of expired timeouts, if it is waiting there.
+  timers_.remove(timeout);
+  early_.remove(&timeout->early);
+  timeouts_.free(handle.idx_);
+  return true;
+}
+
+bool Event::setPriority(Handle handle, Priority prio) {
+  if (PollFd *pollFd = lookup(handle)) {
+    pollFd->prio = prio;
+  } else if (Timeout *timeout = handle.kind_ == KIND_TIMEOUT ?
+               timeouts_.get(handle.idx_, handle.gen_) : nullptr) {
+    timeout->prio = prio;
+  } else if (IoOp *op = handle.kind_ == KIND_IO ?
+               ios_.get(handle.idx_, handle.gen_) : nullptr) {
+    op->prio = prio;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+void Event::collectTimeouts() {
+  // Only queue the timeouts that have expired by now. Any timeouts that
+  // get added by the callbacks have to wait until we collect them again,
+  // even if they expire immediately. Otherwise, we could starve the event
+  // loop. We are awake anyway. So, this is also a good time to queue all
+  // timeouts that have a slack and have reached their earliest deadline.
+  const auto now = Util::millis64();
+  timers_.advance(now);
+  early_.advance(now);
+  TimerWheel::List expired;
+  early_.takeExpired(expired);
+  while (!expired.empty()) {
+    auto *early = static_cast<Timeout::Early *>(expired.next);
+    early_.remove(early);
+    timers_.expire(early->owner);
+  }
+  timers_.takeExpired(expired);
+  while (!expired.empty()) {
+    Timeout *timeout = static_cast<Timeout *>(expired.next);
+    timers_.requeue(due_[timeout->prio], timeout);
+  }
+}
+
+bool Event::hasPending() const {
+  for (int prio = 0; prio < PRIORITIES; ++prio) {
+    if (!later_[prio].empty() || !due_[prio].empty() ||
+        !ready_[prio].empty()) {
       return true;
     }
-    return false;
-  }), newFds_->end());
-  return removed;
+  }
+  return false;
 }
 
-void *Event::addTimeout(unsigned tmo, std::function<void (void)> cb) {
-  if (!newTimeouts_) {
-    newTimeouts_ = new std::vector<Timeout *>(timeouts_);
+bool Event::runPending() {
+  // Always pick work from the most urgent class that still has budget
+  // left. Callbacks can queue more urgent work. So, we have to start over
+  // after each one. Returns true, if all pending work has been completed.
+  for (int prio = 0; prio < PRIORITIES; ) {
+    if (spent_[prio] >= budget_[prio] ||
+        (later_[prio].empty() && due_[prio].empty() &&
+         ready_[prio].empty())) {
+      ++prio;
+      continue;
+    }
+    runOne((Priority)prio);
+    prio = 0;
   }
-  newTimeouts_->push_back(new Timeout(tmo + Util::millis(), cb));
-  return newTimeouts_->back();
+  return !hasPending();
 }
 
-bool Event::removeTimeout(void *handle) {
-  if (!handle) {
-    return false;
+void Event::runOne(Priority prio) {
+  // Within a class, deferred callbacks run before timeouts, which run
+  // before file descriptors and I/O completions. That's the same order in
+  // which the loop has always processed them.
+  const auto start = Util::micros64();
+  if (!later_[prio].empty()) {
+    const auto l = std::move(later_[prio].front());
+    later_[prio].pop_front();
+    if (l.cb) {
+      l.cb();
+      account(l.site, start);
+    }
+  } else if (!due_[prio].empty()) {
+    runTimeout(static_cast<Timeout *>(due_[prio].next));
+  } else {
+    const auto handle = ready_[prio].front();
+    ready_[prio].pop_front();
+    runReady(handle);
   }
+  spent_[prio] += Util::micros64() - start;
+}
 
-  bool removed = false;
+void Event::runTimeout(Timeout *timeout) {
+  timers_.remove(timeout);
+  early_.remove(&timeout->early);
+  // Keep track of how late we are in firing timeouts. This is a good
+  // indicator for how busy the event loop is.
+  const auto start = Util::micros64();
+  lag_.add(start - std::min(start, 1000*timeout->deadline));
+  const auto site = timeout->site;
+  const auto cb = std::move(timeout->cb);
+  timeouts_.free(timeout->idx);
+  if (cb) {
+    cb();
+    account(site, start);
+  }
+}
+
+void Event::runLater(Callback<void(void)> cb, std::source_location loc) {
+  runLater(INTERACTIVE, std::move(cb), loc);
+}
+
+void Event::runLater(Priority prio, Callback<void(void)> cb,
+                     std::source_location loc) {
+  later_[prio].push_back(Later{ siteFor(loc), std::move(cb) });
+}
+
+void Event::post(Callback<void(void)> cb, std::source_location loc) {
+  // This can be called from any thread. Push onto the stack of posted
+  // callbacks. Only the first callback pushed onto an empty stack needs to
+  // wake up the event loop. All others will be picked up at the same time.
+  Posted *posted = new Posted{ nullptr, loc, std::move(cb) };
+  Posted *head = posted_.load(std::memory_order_relaxed);
+  do {
+    posted->next = head;
+  } while (!posted_.compare_exchange_weak(head, posted,
+                                          std::memory_order_release,
+                                          std::memory_order_relaxed));
+  if (!head) {
+    const uint64_t one = 1;
+    if (::write(wakeFd_, &one, sizeof(one)) < 0) {
+      DBG("Failed to wake up event loop");
+    }
+  }
+}
 
-  // Create vector with future timeouts
-  if (!newTimeouts_) {
-    newTimeouts_ = new std::vector<Timeout *>(timeouts_);
+void Event::runPosted() {
+  // Reset the eventfd before taking the stack of callbacks. Anything that
+  // gets posted afterwards will trigger another wake up.
+  uint64_t count;
+  if (read(wakeFd_, &count, sizeof(count)) < 0) { }
+  Posted *stack = posted_.exchange(nullptr, std::memory_order_acquire);
+  Posted *fifo = nullptr;
+  while (stack) {
+    Posted *next = stack->next;
+    stack->next = fifo;
+    fifo = stack;
+    stack = next;
   }
-  // Zero out existing record. This avoids the potential for races
-  for (auto& timeout : timeouts_) {
-    if (timeout == handle) {
-      timeout = nullptr;
-      removed = true;
+  while (fifo) {
+    Posted *posted = fifo;
+    fifo = fifo->next;
+    if (posted->cb) {
+      const auto site = siteFor(posted->loc);
+      const auto start = Util::micros64();
+      posted->cb();
+      account(site, start);
     }
+    delete posted;
   }
-  // Remove timeout from future list
-  newTimeouts_->erase(std::remove_if(newTimeouts_->begin(),
-                                     newTimeouts_->end(),
-                                     [&](auto e) {
-    if (e == handle) {
-      removed = true;
-      runLater([=]() { delete e; });
-      return true;
+}
+
+Pool& Event::pool() {
+  if (!pool_) {
+    pool_ = std::make_unique<Pool>(*this);
+  }
+  return *pool_;
+}
+
+bool Event::hasRing() {
+  // Only try to set up io_uring when somebody wants to use it. Completions
+  // make the ring's file descriptor readable. Similar to the eventfd, it is
+  // an internal file descriptor that doesn't keep the loop from exiting.
+  // Reaping is cheap, as it merely queues up the completions. So, it can
+  // run ahead of everything else.
+  if (!ringProbed_) {
+    ringProbed_ = true;
+    if (useRing_ && (ring_ = Ring::create()) != nullptr) {
+      setPriority(addPollFd(ring_->fd(), POLLIN, [this](auto) {
+        reapIo(); return true; }), REALTIME);
+      --numPollFds_;
     }
+  }
+  return !!ring_;
+}
+
+Event::IoOp *Event::addIo(Handle& handle, Callback<void (int)> cb,
+                          unsigned sqes, std::source_location loc) {
+  if (!hasRing() || !ring_->reserve(sqes)) {
+    handle = Handle();
+    return nullptr;
+  }
+  const auto idx = ios_.alloc(siteFor(loc), std::move(cb));
+  handle = Handle(KIND_IO, idx, ios_.gen(idx));
+  ++ioPending_;
+  return &ios_[idx];
+}
+
+// The "user_data" of each submission identifies the operation that it
+// belongs to. Entries that we don't need to see completions for, such as
+// linked timeouts and cancellations, are marked as internal.
+static const uint64_t INTERNAL = ~0ULL;
+
+Event::Handle Event::submitWrite(int fd, std::string data,
+                                 Callback<void (int)> cb, unsigned delay,
+                                 std::source_location loc) {
+  Handle handle;
+  IoOp *op = addIo(handle, std::move(cb), delay ? 2 : 1, loc);
+  if (!op) {
+    return handle;
+  }
+  op->data = std::move(data);
+  if (delay) {
+    // A hard link makes the write wait for the timeout, even though
+    // timeouts complete with an error code.
+    op->ts = { delay / 1000000, (delay % 1000000) * 1000LL };
+    io_uring_sqe *sqe = ring_->get();
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->flags = IOSQE_IO_HARDLINK;
+    sqe->addr = (uintptr_t)&op->ts;
+    sqe->len = 1;
+    sqe->user_data = INTERNAL;
+  }
+  io_uring_sqe *sqe = ring_->get();
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t)op->data.data();
+  sqe->len = op->data.size();
+  sqe->off = (uint64_t)-1;
+  sqe->user_data = (uint64_t)handle.gen_ << 32 | handle.idx_;
+  return handle;
+}
+
+Event::Handle Event::submitTimeout(unsigned us, Callback<void (int)> cb,
+                                   std::source_location loc) {
+  Handle handle;
+  IoOp *op = addIo(handle, std::move(cb), 1, loc);
+  if (!op) {
+    return handle;
+  }
+  op->ts = { us / 1000000, (us % 1000000) * 1000LL };
+  io_uring_sqe *sqe = ring_->get();
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->addr = (uintptr_t)&op->ts;
+  sqe->len = 1;
+  sqe->user_data = (uint64_t)handle.gen_ << 32 | handle.idx_;
+  return handle;
+}
+
+bool Event::cancelIo(Handle handle) {
+  IoOp *op = handle.kind_ == KIND_IO ?
+    ios_.get(handle.idx_, handle.gen_) : nullptr;
+  if (!op || !op->cb) {
     return false;
-  }), newTimeouts_->end());
-  return removed;
+  }
+  // The operation stays registered until the kernel has let go of it. But
+  // its callback won't be invoked anymore. If it has already completed,
+  // it is merely waiting for its callback to run and can go right away.
+  op->cb = nullptr;
+  if (op->done) {
+    ios_.free(handle.idx_);
+    return true;
+  }
+  if (io_uring_sqe *sqe = ring_->get()) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uint64_t)handle.gen_ << 32 | handle.idx_;
+    sqe->user_data = INTERNAL;
+  }
+  return true;
 }
 
-void Event::handleTimeouts(unsigned now) {
-  do {
-    while (!later_.empty()) {
-      const auto later = std::move(later_);
-      for (const auto& cb : later) {
-        if (cb) {
-          cb();
-        }
+void Event::reapIo() {
+  ring_->reap([this](const io_uring_cqe& cqe) {
+    if (cqe.user_data == INTERNAL) {
+      return;
+    }
+    const uint32_t idx = (uint32_t)cqe.user_data;
+    const uint32_t gen = (uint32_t)(cqe.user_data >> 32);
+    IoOp *op = ios_.get(idx, gen);
+    if (!op) {
+      return;
+    }
+    --ioPending_;
+    if (!op->cb) {
+      ios_.free(idx);
+      return;
+    }
+    op->done = true;
+    op->res = cqe.res;
+    ready_[op->prio].push_back(Handle(KIND_IO, idx, gen));
+  });
+}
+
+Event::Handle Event::addLoop(Callback<void (unsigned)> cb,
+                             std::source_location loc) {
+  const auto idx = loops_.alloc(Loop{ siteFor(loc), std::move(cb) });
+  loop_.push_back(Handle(KIND_LOOP, idx, loops_.gen(idx)));
+  return loop_.back();
+}
+
+void Event::removeLoop(Handle handle) {
+  if (handle.kind_ == KIND_LOOP && loops_.get(handle.idx_, handle.gen_)) {
+    loops_.free(handle.idx_);
+  }
+}
+
+void Event::removeRegistration(Handle handle) {
+  // Releasing the slot invalidates the handle. If the callback is currently
+  // running, dispatch() holds on to it until it returns.
+  const int fd = pollFds_[handle.idx_].fd;
+  pollFds_.free(handle.idx_);
+  --numPollFds_;
+  auto& state = fdState_[fd];
+  if (!--state.live) {
+    // If all callbacks have been removed, the caller might be about to close
+    // the file descriptor. And by the time we sync with the kernel, it could
+    // even have been reused for an unrelated file. Make sure that the kernel
+    // state gets refreshed, even if it looks as if nothing had changed.
+    state.reset = true;
+  }
+  markDirty(fd);
+}
+
+void Event::markDirty(int fd) {
+  if (!fdState_[fd].dirty) {
+    fdState_[fd].dirty = true;
+    dirtyFds_.push_back(fd);
+  }
+}
+
+void Event::syncFds() {
+  // Apply all changes to registrations that accumulated since the last time
+  // we waited for events.
+  for (const int fd : dirtyFds_) {
+    auto& state = fdState_[fd];
+    state.dirty = false;
+    uint32_t want = 0;
+    bool edge = true;
+    for (auto it = state.regs.begin(); it != state.regs.end(); ) {
+      const auto pollFd = lookup(*it);
+      if (!pollFd) {
+        it = state.regs.erase(it);
+      } else {
+        want |= (uint16_t)pollFd->events;
+        edge &= pollFd->trigger == EDGE;
+        ++it;
       }
     }
-    for (const auto& timeout : timeouts_) {
-      if (timeout && now >= timeout->tmo) {
-        const auto cb = std::move(timeout->cb);
-        removeTimeout(timeout);
-        if (cb) {
-          cb();
+    if (backend_ == EPOLL) {
+      if (want && edge) {
+        want |= EPOLLET;
+      }
+      if (state.alwaysReady) {
+        // epoll() refuses to work with regular files. These are always
+        // ready though, so we just keep dispatching events.
+        if (!want) {
+          state.alwaysReady = false;
+          alwaysReady_.erase(std::find(alwaysReady_.begin(),
+                                       alwaysReady_.end(), fd));
+        }
+      } else if (!want) {
+        if (state.armed) {
+          // This fails harmlessly, if the file descriptor has been closed.
+          epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, nullptr);
+        }
+      } else if (want != state.armed || state.reset) {
+        struct epoll_event ev = { .events = want, .data = { .fd = fd } };
+        int rc = epoll_ctl(epollFd_, state.armed ? EPOLL_CTL_MOD
+                                                 : EPOLL_CTL_ADD, fd, &ev);
+        if (rc < 0 && errno == ENOENT) {
+          // The file descriptor was closed and then reopened.
+          rc = epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &ev);
+        } else if (rc < 0 && errno == EEXIST) {
+          rc = epoll_ctl(epollFd_, EPOLL_CTL_MOD, fd, &ev);
+        }
+        if (rc < 0 && errno == EPERM) {
+          state.alwaysReady = true;
+          alwaysReady_.push_back(fd);
+        } else if (rc < 0) {
+          DBG("epoll_ctl(" << fd << ") failed: " << errno);
+        }
+      }
+      state.armed = state.alwaysReady ? 0 : want;
+    } else {
+      // The ppoll() backend needs an array with one entry per file
+      // descriptor. Update it in place.
+      if (!want && state.index >= 0) {
+        fds_[state.index] = fds_.back();
+        fdState_[fds_[state.index].fd].index = state.index;
+        fds_.pop_back();
+        state.index = -1;
+      } else if (want) {
+        if (state.index < 0) {
+          state.index = fds_.size();
+          fds_.push_back(pollfd{ .fd = fd });
         }
+        fds_[state.index].events = want;
       }
     }
-  } while (!later_.empty());
-  recomputeTimeoutsAndFds();
+    state.reset = false;
+  }
+  dirtyFds_.clear();
 }
 
-void Event::runLater(std::function<void(void)> cb) {
-  later_.push_back(cb);
+void Event::waitForEvents(unsigned tmo, bool block) {
+  // Registrations that get added from now on will only be considered the
+  // next time that we wait.
+  ++epoch_;
+  int wait = alwaysReady_.size() || !block ? 0 : tmo ? (int)tmo : -1;
+
+  // Hand all I/O operations that were queued by callbacks to the kernel.
+  if (ring_ && ring_->queued()) {
+    if (const int rc = ring_->submit(); rc < 0) {
+      DBG("Failed to submit to io_uring: " << strerror(-rc));
+    }
+  }
+
+  // With a simulated clock, the loop never sleeps. It merely checks whether
+  // any file descriptors are ready, and if not, time jumps ahead to the next
+  // deadline. The exception is work that is still pending on other threads
+  // or in the kernel. Simulated time stands still until it has completed, so
+  // that the outcome doesn't depend on how quickly it gets scheduled.
+  auto *sim = Util::simulatedClock();
+  const bool external = retained_ || ioPending_;
+  if (sim && wait > 0) {
+    wait = external ? -1 : 0;
+  }
+  const auto idle = [&]() {
+    if (sim && !external && block && tmo && alwaysReady_.empty()) {
+      sim->advanceTo(1000*timers_.nextDeadline());
+      countWakeup();
+    }
+  };
+  if (backend_ == EPOLL) {
+    const int rc = epoll_wait(epollFd_, events_.data(), events_.size(), wait);
+    if (wait) {
+      countWakeup();
+    }
+    if (!rc && alwaysReady_.empty()) {
+      idle();
+    }
+    for (const int fd : std::vector<int>(alwaysReady_)) {
+      dispatch(fd, POLLIN | POLLOUT);
+    }
+    for (int i = 0; i < rc; ++i) {
+      dispatch(events_[i].data.fd, (short)events_[i].events);
+    }
+    if (rc == (int)events_.size()) {
+      events_.resize(2*rc);
+    }
+  } else {
+    timespec ts = { (long)wait / 1000L, ((long)(wait % 1000))*1000000L };
+    int rc = ppoll(fds_.data(), fds_.size(), wait >= 0 ? &ts : nullptr,
+                   nullptr);
+    if (wait) {
+      countWakeup();
+    }
+    if (!rc) {
+      idle();
+    }
+    // Changes to registrations are deferred until the next call to syncFds().
+    // So, the array can't change while we are iterating over it.
+    for (size_t i = 0; rc > 0 && i < fds_.size(); ++i) {
+      if (fds_[i].revents) {
+        const short revents = fds_[i].revents;
+        fds_[i].revents = 0;
+        rc--;
+        dispatch(fds_[i].fd, revents);
+      }
+    }
+  }
 }
 
-void *Event::addLoop(std::function<void (unsigned)> cb) {
-  loop_.push_back(new std::function<void (unsigned)>{cb});
-  return loop_.back();
+void Event::countWakeup() {
+  ++wakeups_;
+  const auto now = Util::millis64();
+  if (now - rateStart_ >= RATE_WINDOW) {
+    wakeupRate_ = (wakeups_ - rateMark_)*1000.0/(now - rateStart_);
+    rateMark_ = wakeups_;
+    rateStart_ = now;
+  }
 }
 
-void Event::removeLoop(void *handle) {
-  auto cb = (std::function<void (unsigned)> *)handle;
-  loop_.erase(std::remove(loop_.begin(), loop_.end(), cb));
-  delete cb;
+double Event::wakeupsPerSecond() const {
+  if (wakeupRate_ >= 0) {
+    return wakeupRate_;
+  }
+  const auto elapsed = Util::millis64() - rateStart_;
+  return elapsed ? (wakeups_ - rateMark_)*1000.0/elapsed : 0;
+}
+
+void Event::dispatch(int fd, short revents) {
+  // Queue up all callbacks that are interested in the events that we just
+  // received. If a callback is still waiting from an earlier iteration, the
+  // new events are merged into the ones that it already has pending.
+  for (const auto& handle : fdState_[fd].regs) {
+    PollFd *pollFd = lookup(handle);
+    if (!pollFd || pollFd->epoch >= epoch_) {
+      continue;
+    }
+    const short events = revents & (pollFd->events | POLLERR | POLLHUP |
+                                    POLLNVAL);
+    if (!events) {
+      continue;
+    }
+    if (!pollFd->pending) {
+      ready_[pollFd->prio].push_back(handle);
+    }
+    pollFd->pending |= events;
+  }
+}
+
+void Event::runReady(Handle handle) {
+  if (handle.kind_ == KIND_IO) {
+    IoOp *op = ios_.get(handle.idx_, handle.gen_);
+    if (!op) {
+      return;
+    }
+    const auto site = op->site;
+    const auto res = op->res;
+    const auto cb = std::move(op->cb);
+    ios_.free(handle.idx_);
+    if (cb) {
+      const auto start = Util::micros64();
+      cb(res);
+      account(site, start);
+    }
+    return;
+  }
+  PollFd *pollFd = lookup(handle);
+  if (!pollFd || !pollFd->cb) {
+    return;
+  }
+  pollfd pfd = { .fd = pollFd->fd, .events = pollFd->events,
+                 .revents = pollFd->pending };
+  pollFd->pending = 0;
+
+  // The callback is allowed to remove its own registration, which releases
+  // the slot. Keep the callback object alive until it has returned, and
+  // then put it back if the registration still exists.
+  const auto site = pollFd->site;
+  auto cb = std::move(pollFd->cb);
+  const auto start = Util::micros64();
+  const bool keep = cb(&pfd);
+  account(site, start);
+  if ((pollFd = lookup(handle)) != nullptr) {
+    if (keep) {
+      pollFd->cb = std::move(cb);
+    } else {
+      removeRegistration(handle);
+    }
+  }
+}
+
+uint32_t Event::siteFor(const std::source_location& loc) {
+  // Source locations are unique per call site. So, it is sufficient to
+  // compare the pointer to the file name and the line number.
+  const auto key = std::make_pair(loc.file_name(), (unsigned)loc.line());
+  const auto it = siteIndex_.find(key);
+  if (it != siteIndex_.end()) {
+    return it->second;
+  }
+  sites_.push_back(Site{ loc.file_name(), loc.function_name(), loc.line() });
+  return siteIndex_[key] = sites_.size() - 1;
+}
+
+void Event::account(uint32_t site, uint64_t start) {
+  // Record how long a callback ran. If it took too long, remember it as
+  // the culprit for stalling the event loop.
+  const auto duration = Util::micros64() - start;
+  sites_[site].latency.add(duration);
+  if (duration >= stallThreshold_) {
+    DBG("Event loop stalled for " << duration/1000 << "ms in " <<
+        sites_[site].file << ":" << sites_[site].line);
+    const Stall stall{ site, start/1000, duration };
+    if (stalls_.size() < STALLS) {
+      stalls_.push_back(stall);
+    } else {
+      stalls_[nextStall_] = stall;
+    }
+    nextStall_ = (nextStall_ + 1) % STALLS;
+  }
 }
 
-void Event::recomputeTimeoutsAndFds() {
-  if (newFds_) {
-    delete[] fds_;
-    fds_ = new pollfd[newFds_->size()];
-    int i = 0;
-    for (auto it = newFds_->begin(); it != newFds_->end(); it++, i++) {
-      fds_[i].fd = (*it)->fd;
-      fds_[i].events = (*it)->events;
-      fds_[i].revents = 0;
+std::vector<Event::Stall> Event::stalls() const {
+  // Return the recorded stalls in chronological order.
+  std::vector<Stall> ret;
+  for (size_t i = 0; i < stalls_.size(); ++i) {
+    ret.push_back(stalls_[(nextStall_ + STALLS - stalls_.size() + i)%STALLS]);
+  }
+  return ret;
+}
+
+std::string Event::report() const {
+  const auto fmt = [](const char *name, const Histogram& h) {
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+             "%-40s n=%llu avg=%lluus p50<%lluus p99<%lluus max=%lluus\n",
+             name, (unsigned long long)h.count,
+             (unsigned long long)(h.count ? h.total/h.count : 0),
+             (unsigned long long)h.percentile(0.5),
+             (unsigned long long)h.percentile(0.99),
+             (unsigned long long)h.max);
+    return std::string(buf);
+  };
+  const auto tag = [](const Site& site) {
+    const char *file = strrchr(site.file, '/');
+    return std::string(file ? file + 1 : site.file) + ":" +
+           std::to_string(site.line);
+  };
+
+  // List the callbacks that consumed the most time first.
+  std::string ret = fmt("loop lag", lag_);
+  char buf[80];
+  snprintf(buf, sizeof(buf), "%-40s n=%llu rate=%.2f/s\n", "wakeups",
+           (unsigned long long)wakeups_, wakeupsPerSecond());
+  ret += buf;
+  std::vector<const Site *> sorted;
+  for (const auto& site : sites_) {
+    if (site.latency.count) {
+      sorted.push_back(&site);
     }
-    pollFds_.clear();
-    pollFds_.swap(*newFds_);
-    delete newFds_;
-    newFds_ = nullptr;
   }
-  if (newTimeouts_) {
-    timeouts_.clear();
-    timeouts_.swap(*newTimeouts_);
-    delete newTimeouts_;
-    newTimeouts_ = nullptr;
+  std::sort(sorted.begin(), sorted.end(), [](auto a, auto b) {
+    return a->latency.total > b->latency.total; });
+  for (const auto& site : sorted) {
+    ret += fmt(tag(*site).c_str(), site->latency);
+  }
+  for (const auto& stall : stalls()) {
+    ret += "stalled " + std::to_string(stall.duration/1000) + "ms in " +
+           tag(sites_[stall.site]) + " (" + sites_[stall.site].function +
+           ")\n";
+  }
+  return ret;
+}
+
+void Event::Histogram::add(uint64_t us) {
+  const int bucket = us ? 64 - __builtin_clzll(us) : 0;
+  ++buckets[std::min(bucket, BUCKETS - 1)];
+  ++count;
+  total += us;
+  max = std::max(max, us);
+}
+
+uint64_t Event::Histogram::percentile(double p) const {
+  // Returns the upper bound of the bucket that contains the requested
+  // percentile. That's as accurate as a logarithmic histogram can be.
+  uint64_t seen = 0;
+  for (int i = 0; i < BUCKETS; ++i) {
+    seen += buckets[i];
+    if (seen && seen >= p*count) {
+      return (uint64_t)1 << i;
+    }
+  }
+  return max;
+}
+
+Event::TimerWheel::TimerWheel(uint64_t now) : now_(now) {
+}
+
+void Event::TimerWheel::insert(Node *n) {
+  ++count_;
+  place(n);
+}
+
+void Event::TimerWheel::remove(Node *n) {
+  if (n->next) {
+    unlink(n);
+    --count_;
+  }
+}
+
+void Event::TimerWheel::expire(Node *n) {
+  // Moves a timer to the list of expired timers ahead of its deadline.
+  if (n->next && n->level != EXPIRED_LIST) {
+    unlink(n);
+    link(expired_, n, EXPIRED_LIST, 0);
+  }
+}
+
+void Event::TimerWheel::requeue(List& list, Node *n) {
+  // Moves a timer to one of the caller's lists. It still counts as part of
+  // the wheel, and it can be removed from there by calling remove().
+  unlink(n);
+  link(list, n, EXPIRED_LIST, 0);
+}
+
+void Event::TimerWheel::advance(uint64_t now) {
+  // Step through all the points in time, where one of the wheel's slots
+  // needs attention. Empty slots are skipped by consulting the occupancy
+  // bitmaps. So, this is cheap even if a lot of time has passed.
+  while (now_ < now) {
+    const auto next = nextSlot();
+    if (next > now) {
+      now_ = now;
+      break;
+    }
+    now_ = next;
+    // Timers that were too far out for any of the levels have to be
+    // re-filed, whenever the top-most level wraps around.
+    if (!(now_ & ((1ULL << LEVELS*BITS) - 1))) {
+      cascade(overflow_);
+    }
+    // When a slot's time span starts, its timers get redistributed to the
+    // lower levels. Timers that end up in the lowest level have reached their
+    // deadline and are moved to the list of expired timers.
+    for (int level = LEVELS; level-- > 0; ) {
+      if (now_ & ((1ULL << level*BITS) - 1)) {
+        continue;
+      }
+      const int slot = (now_ >> level*BITS) & (SLOTS - 1);
+      if (occupied_[level] & (1ULL << slot)) {
+        occupied_[level] &= ~(1ULL << slot);
+        cascade(wheel_[level][slot]);
+      }
+    }
+  }
+}
+
+void Event::TimerWheel::takeExpired(List& list) {
+  // Move all expired timers to the caller's list. They can still be removed
+  // from there by calling remove().
+  while (!expired_.empty()) {
+    Node *n = expired_.next;
+    unlink(n);
+    link(list, n, EXPIRED_LIST, 0);
+  }
+}
+
+uint64_t Event::TimerWheel::nextDeadline() const {
+  // Returns the exact deadline of the timer that will fire next. Timers in
+  // the lower levels always expire before the ones in the higher levels. And
+  // within a level, the slots are sorted by time. So, we only ever have to
+  // look at the first occupied slot.
+  if (!expired_.empty()) {
+    return now_;
+  }
+  for (int level = 0; level < LEVELS; ++level) {
+    if (!occupied_[level]) {
+      continue;
+    }
+    const List& list = wheel_[level][__builtin_ctzll(occupied_[level])];
+    uint64_t deadline = UINT64_MAX;
+    for (const Node *n = list.next; n != &list; n = n->next) {
+      deadline = std::min(deadline, n->deadline);
+    }
+    return deadline;
+  }
+  uint64_t deadline = UINT64_MAX;
+  for (const Node *n = overflow_.next; n != &overflow_; n = n->next) {
+    deadline = std::min(deadline, n->deadline);
+  }
+  return deadline;
+}
+
+void Event::TimerWheel::place(Node *n) {
+  if (n->deadline <= now_) {
+    link(expired_, n, EXPIRED_LIST, 0);
+    return;
+  }
+  // File the timer under the most significant digit that differs from the
+  // current time. By construction, this slot is always ahead of the current
+  // position of the wheel at that level.
+  const int level = (63 - __builtin_clzll(n->deadline ^ now_)) / BITS;
+  if (level >= LEVELS) {
+    link(overflow_, n, OVERFLOW_LIST, 0);
+    return;
+  }
+  const int slot = (n->deadline >> level*BITS) & (SLOTS - 1);
+  link(wheel_[level][slot], n, level, slot);
+  occupied_[level] |= 1ULL << slot;
+}
+
+void Event::TimerWheel::link(List& list, Node *n, uint8_t level,
+                             uint8_t slot) {
+  // Append to the end of the list. This preserves the order in which
+  // timers with identical deadlines were added.
+  n->level = level;
+  n->slot = slot;
+  n->next = &list;
+  n->prev = list.prev;
+  list.prev->next = n;
+  list.prev = n;
+}
+
+void Event::TimerWheel::unlink(Node *n) {
+  n->prev->next = n->next;
+  n->next->prev = n->prev;
+  n->prev = n->next = nullptr;
+  if (n->level < LEVELS && wheel_[n->level][n->slot].empty()) {
+    occupied_[n->level] &= ~(1ULL << n->slot);
+  }
+}
+
+void Event::TimerWheel::cascade(List& list) {
+  // Detach all entries from the list and file them again relative to the
+  // current time. Timers in the overflow list can end up in the very same
+  // list again. So, we have to work from a temporary copy.
+  List tmp;
+  while (!list.empty()) {
+    Node *n = list.next;
+    unlink(n);
+    link(tmp, n, EXPIRED_LIST, 0);
+  }
+  while (!tmp.empty()) {
+    Node *n = tmp.next;
+    unlink(n);
+    place(n);
+  }
+}
+
+uint64_t Event::TimerWheel::nextSlot() const {
+  // Find the earliest point in time, when the contents of one of the slots
+  // have to be redistributed.
+  uint64_t next = UINT64_MAX;
+  if (!overflow_.empty()) {
+    next = ((now_ >> LEVELS*BITS) + 1) << LEVELS*BITS;
+  }
+  for (int level = 0; level < LEVELS; ++level) {
+    if (occupied_[level]) {
+      const uint64_t slot = __builtin_ctzll(occupied_[level]);
+      next = std::min(next, ((now_ >> (level + 1)*BITS) << (level + 1)*BITS) |
+                            (slot << level*BITS));
+    }
   }
+  return next;
 }
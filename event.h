@@ -1,48 +1,436 @@
 #pragma once
 
+#include <linux/time_types.h>
 #include <poll.h>
+#include <stdint.h>
+#include <sys/epoll.h>
 
-#include <functional>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
+#include <optional>
+#include <source_location>
+#include <string>
+#include <utility>
 #include <vector>
 
+#include "callback.h"
+
+class Pool;
+class Ring;
+
 class Event {
  public:
-  Event();
+  // The event loop can either use epoll(), which keeps persistent
+  // registrations with the kernel and only ever looks at file descriptors
+  // that are ready, or it can fall back to the more portable ppoll().
+  enum Backend { PPOLL, EPOLL };
+
+  // File descriptors are level-triggered by default. Edge-triggered
+  // callbacks must drain their file descriptor each time they are invoked.
+  // The ppoll() backend treats them as level-triggered, which is compatible.
+  enum Trigger { LEVEL, EDGE };
+
+  // Registrations belong to one of several priority classes. Whenever there
+  // is work to do, the loop runs realtime callbacks first, then interactive
+  // ones, and bulk callbacks only after that. Each class also has a time
+  // budget per iteration of the loop. Once a class has used up its budget,
+  // its remaining callbacks get deferred until the loop has checked for new
+  // events. That way, a long backlog of bulk work can't delay anything that
+  // is latency-sensitive. Registrations default to the interactive class.
+  enum Priority { REALTIME, INTERACTIVE, BULK };
+  static const int PRIORITIES = 3;
+
+  // Registrations are identified by a handle that combines an index into
+  // a slot map with a generation number. Handles stay cheap to copy and are
+  // safe to use even after the registration has gone away. Removing a stale
+  // handle simply does nothing. A default constructed handle is empty.
+  class Handle {
+   public:
+    Handle() : idx_(0), kind_(0), gen_(0) { }
+    explicit operator bool() const { return !!gen_; }
+    bool operator==(const Handle& o) const = default;
+
+   private:
+    friend class Event;
+    Handle(uint32_t kind, uint32_t idx, uint32_t gen)
+      : idx_(idx), kind_(kind), gen_(gen) { }
+    uint32_t idx_ : 30, kind_ : 2;
+    uint32_t gen_;
+  };
+
+  // Latencies are tracked in power-of-two buckets. Bucket "i" counts all
+  // samples that took less than 2^i microseconds, but not less than
+  // 2^(i-1) microseconds.
+  struct Histogram {
+    static const int BUCKETS = 32;
+    void add(uint64_t us);
+    uint64_t percentile(double p) const;
+    uint64_t count = 0, total = 0, max = 0;
+    uint32_t buckets[BUCKETS] = { };
+  };
+
+  // Every callback is tagged with the source location that registered it.
+  // This makes it possible to attribute time spent in the event loop.
+  struct Site {
+    const char *file, *function;
+    unsigned   line;
+    Histogram  latency;
+  };
+
+  // Callbacks that run for longer than the stall threshold are recorded
+  // together with the tag of the culprit, which is an index into sites().
+  struct Stall {
+    uint32_t site;
+    uint64_t when, duration;
+  };
+
+  Event(Backend backend = EPOLL, bool useRing = true);
   ~Event();
+  Backend backend() const { return backend_; }
   void loop();
   void exitLoop();
-  void *addPollFd(int fd, short events, std::function<bool (pollfd *)> cb);
+  Handle addPollFd(int fd, short events, Callback<bool (pollfd *)> cb,
+                   Trigger trigger = LEVEL,
+                   std::source_location loc = std::source_location::current());
   bool removePollFd(int fd, short events = 0);
-  bool removePollFd(void *handle);
-  void *addTimeout(unsigned tmo, std::function<void (void)>);
-  bool removeTimeout(void *handle);
-  void runLater(std::function<void(void)>);
-  void *addLoop(std::function<void (unsigned tmo)> cb);
-  void removeLoop(void *handle);
+  bool removePollFd(Handle handle);
+  Handle addTimeout(unsigned tmo, Callback<void (void)>,
+                   std::source_location loc = std::source_location::current());
+
+  // Timeouts that don't need to be precise can specify a "slack". They then
+  // fire at some point between "tmo" and "tmo + slack" milliseconds. If the
+  // loop wakes up for any other reason within that window, the timeout fires
+  // right away. Otherwise, it fires at the end of the window. So, timeouts
+  // with overlapping windows always share a single wakeup.
+  Handle addTimeout(unsigned tmo, unsigned slack, Callback<void (void)>,
+                   std::source_location loc = std::source_location::current());
+  bool removeTimeout(Handle handle);
+  void runLater(Callback<void(void)>,
+                std::source_location loc = std::source_location::current());
+  void runLater(Priority prio, Callback<void(void)>,
+                std::source_location loc = std::source_location::current());
+
+  // Changes the priority class of a file descriptor, timeout, or I/O
+  // operation. If the registration is already waiting to run, the change
+  // takes effect the next time that it becomes ready. "setBudget()" adjusts
+  // how many microseconds a class can use per iteration of the loop. The
+  // first pending callback always runs, even if it exceeds the budget.
+  bool setPriority(Handle handle, Priority prio);
+  void setBudget(Priority prio, unsigned us) {
+    budget_[prio] = std::max(us, 1u); }
+  Handle addLoop(Callback<void (unsigned tmo)> cb,
+                 std::source_location loc = std::source_location::current());
+  void removeLoop(Handle handle);
+
+  // post() is the only method that is safe to call from other threads. It
+  // queues the callback to run on the event loop's thread and wakes up the
+  // loop, if necessary. Threads that expect to post a result later should
+  // have the loop thread call retain() beforehand and release() once the
+  // result has been delivered. That keeps the loop from exiting early.
+  void post(Callback<void(void)>,
+            std::source_location loc = std::source_location::current());
+  void retain() { ++retained_; }
+  void release() { --retained_; }
+
+  // Shared pool of worker threads for blocking operations. It is created
+  // on first use.
+  Pool& pool();
+
+  // Optional io_uring submission path. "hasRing()" reports whether the
+  // kernel supports it. If it doesn't, callers have to use regular
+  // non-blocking I/O instead. All operations that are queued while the loop
+  // runs callbacks go to the kernel with a single system call, right before
+  // the loop waits for the next event. "submitWrite()" takes ownership of
+  // the data, and it can optionally wait for "delay" microseconds before
+  // writing. The callback receives the result of the write(), or a negative
+  // error number. "submitTimeout()" is a timeout with microsecond
+  // resolution. "cancelIo()" guarantees that a callback won't be invoked
+  // anymore. A failed submission returns an empty handle.
+  bool hasRing();
+  Handle submitWrite(int fd, std::string data, Callback<void (int)> cb,
+                    unsigned delay = 0,
+                   std::source_location loc = std::source_location::current());
+  Handle submitTimeout(unsigned us, Callback<void (int)> cb,
+                   std::source_location loc = std::source_location::current());
+  bool cancelIo(Handle handle);
+
+  // Awaitables for coroutines. They are defined in "task.h", which needs to
+  // be included by any code that wants to "co_await" them. "sleep()" resumes
+  // the coroutine after a delay. "readable()" and "writable()" resume it
+  // once the file descriptor is ready and return its "revents". If the
+  // optional timeout expires first, they return zero instead. Buffered
+  // output is handled by the "Writer" class instead.
+  class Sleep;
+  class Ready;
+  Sleep sleep(unsigned ms,
+              std::source_location loc = std::source_location::current());
+  Ready readable(int fd, int tmo = -1,
+                 std::source_location loc = std::source_location::current());
+  Ready writable(int fd, int tmo = -1,
+                 std::source_location loc = std::source_location::current());
+
+  // Instrumentation of the event loop. "loopLag()" measures how late timeouts
+  // fire compared to their scheduled deadline. "sites()" has per-callback
+  // latencies, and "stalls()" lists the most recent callbacks that blocked
+  // the loop for longer than the stall threshold. "report()" formats all of
+  // this information into a human-readable dump.
+  const Histogram& loopLag() const { return lag_; }
+  const std::vector<Site>& sites() const { return sites_; }
+  std::vector<Stall> stalls() const;
+  void setStallThreshold(unsigned ms) { stallThreshold_ = 1000*(uint64_t)ms; }
+  std::string report() const;
+
+  // Counts how often the loop had to wake up after waiting for events. This
+  // is a good proxy for how much power an idle process consumes. The rate is
+  // averaged over the last full minute, or over the time since the loop
+  // started, if it hasn't been running that long.
+  uint64_t wakeups() const { return wakeups_; }
+  double wakeupsPerSecond() const;
 
  private:
+  enum Kind { KIND_POLLFD, KIND_TIMEOUT, KIND_LOOP, KIND_IO };
+
+  // Storage for registrations. Slots are allocated in fixed-size chunks that
+  // never move. That keeps pointers into the slot map valid, and it means
+  // that adding or removing a registration doesn't need to allocate memory
+  // once the slot map has grown to its working size. Freed slots go onto a
+  // free list, and their generation number gets bumped so that any
+  // outstanding handles become stale.
+  template <class T>
+  class SlotMap {
+   public:
+    template <class... Args>
+    uint32_t alloc(Args&&... args) {
+      if (free_.empty()) {
+        chunks_.push_back(std::make_unique<Slot[]>(CHUNK));
+        for (uint32_t i = CHUNK; i-- > 0; ) {
+          free_.push_back((chunks_.size() - 1)*CHUNK + i);
+        }
+      }
+      const uint32_t idx = free_.back();
+      free_.pop_back();
+      slot(idx).value.emplace(std::forward<Args>(args)...);
+      return idx;
+    }
+    void free(uint32_t idx) {
+      Slot& s = slot(idx);
+      s.value.reset();
+      if (!++s.gen) {
+        s.gen = 1;
+      }
+      free_.push_back(idx);
+    }
+    T *get(uint32_t idx, uint32_t gen) {
+      if (idx >= chunks_.size()*CHUNK) {
+        return nullptr;
+      }
+      Slot& s = slot(idx);
+      return s.gen == gen && s.value ? &*s.value : nullptr;
+    }
+    T& operator[](uint32_t idx) { return *slot(idx).value; }
+    uint32_t gen(uint32_t idx) { return slot(idx).gen; }
+
+   private:
+    static const uint32_t CHUNK = 64;
+    struct Slot {
+      uint32_t         gen = 1;
+      std::optional<T> value;
+    };
+    Slot& slot(uint32_t idx) { return chunks_[idx/CHUNK][idx%CHUNK]; }
+
+    std::vector<std::unique_ptr<Slot[]>> chunks_;
+    std::vector<uint32_t> free_;
+  };
+
   struct PollFd {
-    PollFd(int fd, short events, std::function<bool (pollfd *)> cb)
-      : fd(fd), events(events), cb(cb) { }
-    int   fd;
-    short events;
-    std::function<bool (pollfd *)> cb;
+    PollFd(int fd, short events, Trigger trigger, uint64_t epoch,
+           uint32_t site, Callback<bool (pollfd *)> cb)
+      : fd(fd), events(events), trigger(trigger), epoch(epoch), site(site),
+        cb(std::move(cb)) { }
+    int      fd;
+    short    events, pending = 0;
+    Trigger  trigger;
+    Priority prio = INTERACTIVE;
+    uint64_t epoch;
+    uint32_t site;
+    Callback<bool (pollfd *)> cb;
+  };
+
+  // All registrations for the same file descriptor are combined, as both
+  // epoll() and ppoll() want to see each descriptor only once. Changes are
+  // recorded lazily and only get sent to the kernel right before we wait
+  // for the next event. That way, removing and immediately re-adding a
+  // callback doesn't cost any system calls.
+  struct FdState {
+    std::vector<Handle> regs;
+    size_t   live = 0;
+    uint32_t armed = 0;
+    int      index = -1;
+    bool     dirty = false;
+    bool     reset = false;
+    bool     alwaysReady = false;
+  };
+
+  // Hierarchical timer wheel. Timers are kept in intrusive lists, so that
+  // inserting and cancelling are O(1) operations. Each level of the wheel
+  // has 64 slots and covers a 64 times larger time span than the level
+  // below it. A timer is always filed under the most significant digit in
+  // which its deadline differs from the wheel's notion of the current time.
+  // As time advances, timers cascade down into the lower levels until they
+  // eventually expire. This means that only expired timers ever need to be
+  // touched when dispatching.
+  class TimerWheel {
+   public:
+    struct Node {
+      uint64_t deadline;
+      Node     *prev = nullptr, *next = nullptr;
+      uint8_t  level = 0, slot = 0;
+    };
+
+    struct List : Node {
+      List() { prev = next = this; }
+      bool empty() const { return next == this; }
+    };
+
+    explicit TimerWheel(uint64_t now);
+    bool empty() const { return !count_; }
+    void insert(Node *n);
+    void remove(Node *n);
+    void expire(Node *n);
+    void requeue(List& list, Node *n);
+    void advance(uint64_t now);
+    void takeExpired(List& list);
+    uint64_t nextDeadline() const;
+
+   private:
+    static const int BITS = 6, SLOTS = 1 << BITS, LEVELS = 4;
+    static const uint8_t EXPIRED_LIST = 0xFE, OVERFLOW_LIST = 0xFF;
+
+    void place(Node *n);
+    void link(List& list, Node *n, uint8_t level, uint8_t slot);
+    void unlink(Node *n);
+    void cascade(List& list);
+    uint64_t nextSlot() const;
+
+    uint64_t now_;
+    size_t   count_ = 0;
+    uint64_t occupied_[LEVELS] = { };
+    List     wheel_[LEVELS][SLOTS], overflow_, expired_;
+  };
+
+  // Timeouts with a slack are also filed in a second timer wheel by the
+  // earliest time that they are allowed to fire.
+  struct Timeout : TimerWheel::Node {
+    Timeout(uint64_t tmo, uint32_t site, Callback<void (void)> cb)
+      : site(site), cb(std::move(cb)) { deadline = tmo; }
+    uint32_t idx, site;
+    Priority prio = INTERACTIVE;
+    Callback<void (void)> cb;
+    struct Early : TimerWheel::Node {
+      Timeout *owner;
+    } early;
+  };
+
+  struct Later {
+    uint32_t site;
+    Callback<void (void)> cb;
   };
 
-  struct Timeout {
-    Timeout(unsigned tmo, std::function<void (void)> cb)
-      : tmo(tmo), cb(cb) { }
-    unsigned tmo;
-    std::function<void (void)> cb;
+  struct Loop {
+    uint32_t site;
+    Callback<void (unsigned)> cb;
   };
 
-  void handleTimeouts(unsigned now);
-  void recomputeTimeoutsAndFds();
+  // Operations that have been submitted to io_uring keep their buffers and
+  // timeouts here, until the kernel reports their completion. That's true
+  // even if they have been cancelled in the meantime. Completed operations
+  // hold on to their result until their callback gets to run.
+  struct IoOp {
+    IoOp(uint32_t site, Callback<void (int)> cb)
+      : site(site), cb(std::move(cb)) { }
+    uint32_t site;
+    Priority prio = INTERACTIVE;
+    bool     done = false;
+    int      res = 0;
+    Callback<void (int)> cb;
+    std::string data;
+    __kernel_timespec ts;
+  };
+
+  // Callbacks from other threads are pushed onto a lock-free stack. The
+  // loop thread takes the entire stack at once and reverses it, so that
+  // callbacks run in the order in which they were posted.
+  struct Posted {
+    Posted *next;
+    std::source_location loc;
+    Callback<void (void)> cb;
+  };
+
+  void collectTimeouts();
+  bool hasPending() const;
+  bool runPending();
+  void runOne(Priority prio);
+  void runTimeout(Timeout *timeout);
+  void runReady(Handle handle);
+  void countWakeup();
+  IoOp *addIo(Handle& handle, Callback<void (int)> cb, unsigned sqes,
+              std::source_location loc);
+  void reapIo();
+  void runPosted();
+  uint32_t siteFor(const std::source_location& loc);
+  void account(uint32_t site, uint64_t start);
+  PollFd *lookup(Handle handle) {
+    return handle.kind_ == KIND_POLLFD ?
+      pollFds_.get(handle.idx_, handle.gen_) : nullptr; }
+  void removeRegistration(Handle handle);
+  void markDirty(int fd);
+  void syncFds();
+  void waitForEvents(unsigned tmo, bool block);
+  void dispatch(int fd, short revents);
+
+  Backend backend_;
+  int epollFd_ = -1;
+  uint64_t epoch_ = 0;
+  size_t numPollFds_ = 0;
+  std::vector<FdState> fdState_;
+  std::vector<int> dirtyFds_, alwaysReady_;
+  std::vector<pollfd> fds_;
+  std::vector<struct epoll_event> events_;
+  SlotMap<PollFd> pollFds_;
+  TimerWheel timers_, early_;
+  SlotMap<Timeout> timeouts_;
+  bool timersChanged_ = false;
 
-  std::vector<PollFd *> pollFds_, *newFds_ = nullptr;
-  std::vector<Timeout *> timeouts_, *newTimeouts_ = nullptr;
-  std::vector<std::function<void ()>> later_;
-  std::vector<std::function<void (unsigned)> *> loop_;
-  pollfd *fds_ = nullptr;
+  // Work that is ready to run is queued by priority class. File descriptors
+  // and I/O completions are queued by their handles, and expired timeouts
+  // are moved to per-class lists.
+  std::deque<Later> later_[PRIORITIES];
+  std::deque<Handle> ready_[PRIORITIES];
+  TimerWheel::List due_[PRIORITIES];
+  uint64_t budget_[PRIORITIES] = { 10000, 20000, 5000 };
+  uint64_t spent_[PRIORITIES] = { };
+  SlotMap<Loop> loops_;
+  std::vector<Handle> loop_;
   bool done_ = false;
+  size_t retained_ = 0;
+  int wakeFd_ = -1;
+  std::atomic<Posted *> posted_ = nullptr;
+  std::unique_ptr<Pool> pool_;
+  std::unique_ptr<Ring> ring_;
+  bool useRing_, ringProbed_ = false;
+  SlotMap<IoOp> ios_;
+  size_t ioPending_ = 0;
+  std::vector<Site> sites_;
+  std::map<std::pair<const char *, unsigned>, uint32_t> siteIndex_;
+  Histogram lag_;
+  static const size_t STALLS = 16;
+  uint64_t stallThreshold_ = 100*1000;
+  std::vector<Stall> stalls_;
+  size_t nextStall_ = 0;
+  static const uint64_t RATE_WINDOW = 60*1000;
+  uint64_t wakeups_ = 0, rateMark_ = 0, rateStart_;
+  double wakeupRate_ = -1;
 };
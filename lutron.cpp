@@ -1,5 +1,6 @@
 #include <algorithm>
 #include <iostream>
+#include <memory>
 
 #include <arpa/inet.h>
 #include <errno.h>
@@ -10,6 +11,7 @@
 #include <unistd.h>
 
 #include "lutron.h"
+#include "pool.h"
 #include "util.h"
 
 
@@ -17,13 +19,19 @@ Lutron::Lutron(Event& event,
                const std::string& gateway,
                const std::string& username,
                const std::string& passwd)
-  : timeout_(event), event_(event), input_(nullptr),
+  : event_(event), input_(nullptr),
     init_([](auto cb) { cb(); }), closed_(nullptr),
     gateway_(gateway), username_(username.empty() ? "lutron" : username),
     passwd_(passwd.empty() ? "integration" : passwd),
-    sock_(-1), msock_(-1), dontfinalize_(false), isConnected_(false),
-    inCommand_(false), inCallback_(false), atPrompt_(false), keepAlive_(0) {
+    sock_(-1), msock_(-1), isConnected_(false), inCommand_(false),
+    inCallback_(false), initIsBusy_(false), initDone_(false),
+    atPrompt_(false), scheduled_(false), generation_(0),
+    keepAlive_(), watchdog_(), writer_(event) {
   DBG("Lutron(\"" << gateway << "\", \"" << username <<"\", \""<<passwd<<"\")");
+  writer_.onerror([this]() {
+    DBG("Failed to write to the repeater");
+    closeSock();
+  });
 }
 
 Lutron::~Lutron() {
@@ -35,162 +43,320 @@ Lutron::~Lutron() {
   // won't happen until after all connections have closed. So, this is all
   // just extra careful code.
   isConnected_ = false;
+  for (auto& lane : later_[0]) {
+    lane.clear();
+  }
+  targets_[0].clear();
   closeSock();
 }
 
-// We only support a single command at a time. But there are a few situations,
-// when new commands get triggered while execution of another command is still
-// pending:
-//  - if "command()" gets called while "atPrompt_" is false, we first invoke
-//    "waitForPrompt()" and then restart "command()" later. This recursive
-//    call is valid and shouldn't trip an error. Setting the "recurs" parameter
-//    skips some of the initialization and error checking steps that have
-//    already happened earlier. This is an internal API. External callers
-//    should not set "recurs".
+// All commands are queued up and then executed in order by the "session()"
+// coroutine. Unless pipelining has been enabled, only a single command is
+// in flight at any given time. The session opens the connection when
+// necessary, and it keeps running for as long as the connection stays open.
+// There are two queues:
 //  - connections can close unexpectedly (e.g. because of networking problems).
 //    When the connection is re-opened, it probably needs to be initialized.
 //    For example, the gateway has to be informed of the events that we want to
-//    monitor. This initialization happens from within the "init_" callback.
-//    But that means, we want to be able to recursively submit commands from
-//    within the callback and before the outer command completes. This can be
-//    allowed by setting the "inCallback_" and temporarily clearing the
-//    "inCommand_" flag.
-//  - any other concurrently submitted commands will be delayed until they
-//    can be executed at a later point in time. There are two queues of
-//    commands that will eventually be processed by "scheduleDelayedCommands()"
-void Lutron::command(const std::string& cmd,
+//    monitor. This initialization happens from within the "init_" callback,
+//    and it needs to submit commands before the outer command that triggered
+//    opening the connection can complete. While "inCallback_" is set, new
+//    commands go into the second queue, which takes precedence.
+//  - all other commands go into the first queue, and wait until they can be
+//    executed.
+// Each queue is further split into priority lanes, so that commands
+// issued in response to user input don't have to wait for bulk updates.
+void Lutron::command(Priority prio, const std::string& cmd,
                      std::function<void (const std::string& res)> cb,
-                     std::function<void (void)> err, bool recurs) {
+                     std::function<void (void)> err) {
   // "command()" is the main high-level API for interacting with the Lutron
-  // gateway. It implements timeouts and enforces that only a single
-  // command can be in-flight at any given time.
-  if (!recurs) {
-    if (commandPending()) {
-      later_[inCallback_].push_back(Command{cmd, cb, err});
+  // gateway. It implements timeouts and limits how many commands can be
+  // in flight at any given time.
+  // Commands that set the level of an output or the state of an LED
+  // supersede any earlier command for the same target that is still
+  // waiting in the queue. The earlier command takes on the new value, and
+  // it keeps its place in the queue. Both sets of callbacks get invoked.
+  // If the new command was submitted in a more urgent lane, the earlier
+  // command instead moves to the end of that lane.
+  auto key = target(cmd);
+  auto& targets = targets_[inCallback_];
+  if (const auto it = targets.find(key); it != targets.end()) {
+    Command& pending = *it->second;
+    DBGc(1, "Coalescing \"" << pending.cmd << "\" -> \"" << cmd << "\"");
+    if (cb && pending.cb) {
+      cb = [a = std::move(pending.cb), b = std::move(cb)](
+        const std::string& res) { a(res); b(res); };
+    } else if (!cb) {
+      cb = std::move(pending.cb);
+    }
+    if (err && pending.err) {
+      err = [a = std::move(pending.err), b = std::move(err)]() {
+        a(); b(); };
+    } else if (!err) {
+      err = std::move(pending.err);
+    }
+    if (pending.prio <= prio) {
+      pending.cmd = cmd;
+      pending.cb = std::move(cb);
+      pending.err = std::move(err);
       return;
-    } else {
-      inCommand_ = true;
-      if (!inCallback_) {
-        // Set a timeout for the overall execution of the command. This
-        // timeout does not need to be set again for any inferior commands
-        // that execute as part of initializing the connection. It should be
-        // long enough to cover all of that.
-        // But there are situations when initialization can take a really
-        // long time. In particular, the Lutron gateway is surprisingly slow
-        // in returning the XML schema. So, if we know that we are still
-        // positively making progress, extend the timeout. This is signaled by
-        // the initIsBusy_ flag.
-        initIsBusy_ = false;
-        const auto setTmo = Util::rec([=, this](auto&& setTmo) -> void {
-          timeout_.set(TMO, [=, this]() {
-            if (initIsBusy_) {
-              initIsBusy_ = false;
-              setTmo();
-            } else {
-              closeSock();
-              if (err) {
-                err();
-              }
-            }
-          });
-        });
-        setTmo();
-      }
-      // Remove the "readLine()" event that collects unsolicited messages.
-      event_.removePollFd(sock_);
     }
+    // Removing an entry from the middle of a deque would move its
+    // neighbors. Leave it in place, and skip it when it gets dequeued.
+    pending = Command{ .superseded = true };
+    targets.erase(it);
   }
-  if (Util::starts_with(cmd, "?")) {
-    pending_[inCallback_].push_back(Command{cmd, cb, err});
-  } else {
-    if (cb) {
-      onPrompt_.push_back([cb]() { cb(""); });
+  // Adding to the end of a deque doesn't move any of the existing entries.
+  // So, it is safe to keep pointers to them.
+  auto& later = later_[inCallback_][prio];
+  later.push_back(Command{cmd, std::move(cb), std::move(err)});
+  later.back().prio = prio;
+  later.back().queued = Util::micros64();
+  maxQueued_[prio] = std::max(maxQueued_[prio], later.size());
+  if (!key.empty()) {
+    later.back().target = key;
+    targets.emplace(std::move(key), &later.back());
+  }
+  wakeUp();
+}
+
+std::string Lutron::target(const std::string& cmd) {
+  // Returns the output or LED that a command changes, if it only sets its
+  // state. Other commands, such as button presses or raising and lowering
+  // outputs, have to execute exactly as they were issued.
+  //   #OUTPUT,<id>,1,<level>[,<fade>[,<delay>]]
+  //   #DEVICE,<id>,<component>,9,<state>
+  const auto field = [&](size_t n) {
+    size_t pos = 0;
+    while (n-- && pos != std::string::npos) {
+      pos = cmd.find(',', pos);
+      pos += pos != std::string::npos;
+    }
+    return pos;
+  };
+  if (Util::starts_with(cmd, "#OUTPUT,")) {
+    const auto action = field(2);
+    if (action != std::string::npos && !cmd.compare(action, 2, "1,")) {
+      return cmd.substr(0, action + 1);
+    }
+  } else if (Util::starts_with(cmd, "#DEVICE,")) {
+    const auto action = field(3);
+    if (action != std::string::npos && !cmd.compare(action, 2, "9,")) {
+      return cmd.substr(0, action + 1);
+    }
+  }
+  return "";
+}
+
+bool Lutron::hasQueued(int queue) {
+  // Drop any superseded commands from the front of the lanes, and check
+  // whether there is anything left to do.
+  bool queued = false;
+  for (auto& lane : later_[queue]) {
+    while (!lane.empty() && lane.front().superseded) {
+      lane.pop_front();
+    }
+    queued |= !lane.empty();
+  }
+  return queued;
+}
+
+Lutron::Command Lutron::dequeue(int queue) {
+  // Take the oldest command off the most urgent lane that has any work.
+  // Once it is no longer waiting, later commands for the same target can't
+  // be merged into it anymore. The caller must have checked "hasQueued()".
+  auto& lane = *std::find_if(std::begin(later_[queue]),
+                             std::end(later_[queue]),
+                             [](auto& l) { return !l.empty(); });
+  Command cmd = std::move(lane.front());
+  lane.pop_front();
+  cmd.dequeued = Util::micros64();
+  if (!cmd.target.empty()) {
+    targets_[queue].erase(cmd.target);
+  }
+  return cmd;
+}
+
+void Lutron::wakeUp() {
+  // Invoking the session from Event::runLater() makes sure any global
+  // state that our callers are about to modify will have settled. It also
+  // coalesces many commands that are submitted in a row.
+  if (!scheduled_) {
+    scheduled_ = true;
+    event_.runLater([this]() {
+      scheduled_ = false;
+      checkDelayed();
+    });
+  }
+}
+
+void Lutron::checkDelayed() {
+  // If the session is still running, it might be waiting for new commands.
+  // Otherwise, start a new session, if there is any work to be done. This
+  // could quite possibly re-open the connection.
+  if (!session_.done()) {
+    wake_.notify();
+  } else if (hasQueued(0)) {
+    session_ = session();
+    session_.start();
+  }
+}
+
+void Lutron::armWatchdog() {
+  // Set a timeout for the overall execution of the command. This timeout
+  // also covers any inferior commands that execute as part of initializing
+  // the connection. It should be long enough to cover all of that.
+  // But there are situations when initialization can take a really long
+  // time. In particular, the Lutron gateway is surprisingly slow in
+  // returning the XML schema. So, if we know that we are still positively
+  // making progress, extend the timeout. This is signaled by the
+  // "initIsBusy_" flag.
+  initIsBusy_ = false;
+  event_.removeTimeout(watchdog_);
+  watchdog_ = event_.addTimeout(TMO, [this]() {
+    watchdog_ = {};
+    if (initIsBusy_) {
+      armWatchdog();
+    } else {
+      DBG("Command timed out");
+      closeSock();
     }
+  });
+}
+
+void Lutron::fail(Command& cmd) {
+  // Error handlers always run from the event loop, so that they can't
+  // interfere with our own state. It is safe to fail the same command
+  // more than once.
+  if (cmd.err) {
+    DBG("Failing pending command \"" << cmd.cmd << "\"");
+    event_.runLater(std::move(cmd.err));
   }
-  sendData(
-    cmd + "\r\n",
-    [this]() { readLine(); },
-    [](){},
-    PROMPT,
-    /* login = */ !inCallback_);
+  cmd = Command();
 }
 
 // It is safe to call this function multiple times.
 void Lutron::closeSock() {
-  DBG("Lutron::closeSock(" << (dontfinalize_ ? "dontfinalize" : "") << ")");
-  // Closing the connection runs finalizers for all the timeouts and various
-  // callbacks that might be pending. This is normally the correct course of
-  // action. But if we immediately reopen the socket, trying a different
-  // server, then we don't want overall state to be modified. The
-  // "dontfinalize_" flag suppresses this behavior.
-  onPrompt_.clear();
-  bool closing = !dontfinalize_ && isConnected_;
-  isConnected_ = false;
-  if (!dontfinalize_) {
-    inCommand_ = false;
-    if (inCallback_) {
-      // Only clear delayed commands that accumulated during initialization.
-      // Other commands will execute once the connection is re-opened.
-      const auto later = std::move(later_[inCallback_]);
-      for (const auto& cmd : later) {
-        if (cmd.err) {
-          event_.runLater(cmd.err);
-        }
-      }
-    }
-    // None of the already submitted commands will ever see their
-    // exit status, as the connection is now closed. Call their error
-    // handlers.
-    for (const auto& inCallback : { inCallback_, false }) {
-      const auto pending = std::move(pending_[inCallback]);
-      for (auto it = pending.rbegin(); it != pending.rend(); ++it) {
-        DBG("Failing pending command \"" << it->cmd << "\"");
-        if (it->err) {
-          event_.runLater(it->err);
-        }
+  DBG("Lutron::closeSock()");
+  // Cancelling the session destroys its coroutine frames. This unwinds all
+  // the operations that are currently in progress, and removes any timeouts
+  // and file descriptors that they were waiting for. If we are called from
+  // within the session, this has to wait until the session suspends.
+  session_.cancel();
+  shutdown();
+}
+
+void Lutron::shutdown() {
+  const bool closing = isConnected_;
+  // None of the commands that are currently executing will ever see their
+  // exit status, as the connection is now closed. Call their error handlers.
+  // Of the delayed commands, only fail the ones that accumulated during
+  // initialization. Other commands will execute once the connection is
+  // re-opened.
+  std::deque<Command> later[LANES];
+  for (int i = 0; i < LANES; ++i) {
+    later[i].swap(later_[1][i]);
+  }
+  targets_[1].clear();
+  auto inflight = std::move(inflight_);
+  for (auto& cmd : current_) {
+    fail(cmd);
+  }
+  for (auto& cmd : inflight) {
+    fail(cmd);
+  }
+  for (auto& lane : later) {
+    for (auto& cmd : lane) {
+      if (!cmd.superseded) {
+        fail(cmd);
       }
     }
-    inCallback_ = false;
-    timeout_.clear();
   }
+  inCommand_ = inCallback_ = false;
+  if (watchdog_) {
+    event_.removeTimeout(watchdog_);
+    watchdog_ = {};
+  }
+  disconnect();
+  stopDiscovery();
+  // Notify the caller that our socket is now closed.
+  if (closing && closed_) {
+    event_.runLater(closed_);
+  }
+
+  // Attempt to run delayed commands. This could quite possibly re-open the
+  // connection.
+  if (hasQueued(0)) {
+    wakeUp();
+  }
+}
+
+void Lutron::disconnect() {
+  // Stop reading from the socket, and ignore any callbacks that might still
+  // refer to the old connection.
+  ++generation_;
+  reader_.cancel();
   // If the underlying file descriptor was still open, close it now and
   // remove it from the event handler.
+  writer_.detach();
   if (sock_ >= 0) {
     event_.removePollFd(sock_);
     close(sock_);
     sock_ = -1;
   }
-  if (msock_ >= 0) {
-    event_.removePollFd(msock_);
-    close(msock_);
-    msock_ = -1;
+  if (adopted_ >= 0) {
+    close(adopted_);
+    adopted_ = -1;
   }
+  failover_.reset();
   addrLen_ = 0;
   // If there is a periodic timeout scheduled with the event loop, remove it
   // now. No need to send keep-alive heartbeats, if the connection no longer
   // exists. The higher-level heartbeat will eventually reopen the connection.
   if (keepAlive_) {
     event_.removeTimeout(keepAlive_);
-    keepAlive_ = 0;
+    keepAlive_ = {};
   }
-  // Clear out some of the other state to reset the object, then notify the
-  // caller that our socket is now closed.
+  // Clear out some of the other state to reset the object.
+  isConnected_ = false;
   atPrompt_ = false;
-  ahead_.clear();
-  if (closing && closed_) {
-    event_.runLater(closed_);
-  }
-
-  // Attempt to run delayed commands. This could quite possibly re-open the
-  // connection.
-  if (!dontfinalize_) {
-    checkDelayed();
-  }
+  head_ = tail_ = 0;
+  expect_.clear();
 }
 
 void Lutron::initStillWorking() {
   initIsBusy_ = true;
-  if (input_) input_("");
+  if (input_) input_(LutronMessage());
+}
+
+bool Lutron::handOver(Lutron& to, std::optional<std::vector<int>> failover) {
+  // If there was anything in flight, its response would end up with the
+  // wrong object. The same is true for any commands that are still waiting
+  // to execute. They would have to be failed.
+  if (sock_ < 0 || !isConnected_ || commandPending() || inCallback_ ||
+      hasQueued(0) || to.sock_ >= 0 || to.adopted_ >= 0) {
+    return false;
+  }
+  DBG("Handing over connection");
+  to.adopted_ = sock_;
+  to.atPrompt_ = atPrompt_;
+  to.addr_ = addr_;
+  to.addrLen_ = addrLen_;
+  // Data that we already read, but haven't processed yet, belongs to the
+  // connection. Most likely, these are status updates that arrived together
+  // with the last prompt. Losing them would leave us with stale state.
+  to.tail_ = tail_ - head_;
+  to.head_ = 0;
+  memcpy(to.in_.data(), in_.data() + head_, to.tail_);
+  to.expect_ = expect_;
+  to.failover_ = std::move(failover);
+  // Stop reading and writing, but don't close the file descriptor. Then
+  // shut down as usual. That notifies our owner that we are now closed.
+  event_.removePollFd(sock_);
+  writer_.detach();
+  sock_ = -1;
+  closeSock();
+  return true;
 }
 
 bool Lutron::getConnectedAddr(struct sockaddr& addr, socklen_t& len) {
@@ -205,679 +371,912 @@ bool Lutron::getConnectedAddr(struct sockaddr& addr, socklen_t& len) {
   return true;
 }
 
-void Lutron::checkDelayed(std::function<void ()> next) {
-  // Any command() that arrives when we are not ready to execute it will be
-  // delayed until "inCommand_" becomes false. Try to reschedule when
-  // possible.
-  // There are two separate queues. Commands that were scheduled from the
-  // "init_" callback can only execute right after the connection has been
-  // opened.
-  while (later_[inCallback_].size()) {
-    const auto cmd = *later_[inCallback_].begin();
-    later_[inCallback_].erase(later_[inCallback_].begin());
-    if (!cmd.cmd.size()) {
-      // Sometimes, we want to push a callback to the end of the queue, so
-      // that it only ever gets executed after all other pending commands
-      // have completed. This is done by pushing an empty command string.
-      cmd.cb("");
-      if (inCommand_) {
-        break;
+Task<> Lutron::session() {
+  // The session works through the queue of commands in order. If
+  // necessary, it opens the connection first. Once the queue is empty, the
+  // session stays around and waits for more commands, for as long as the
+  // connection remains open. Closing the connection cancels the session.
+  for (;;) {
+    if (!hasQueued(0)) {
+      if (sock_ < 0) {
+        co_return;
       }
-    } else {
-      // Invoking the callback from Event::runLater() makes sure any global
-      // state that our callers are about to modify will have settled.
-      event_.runLater([=, this]() {
-        command(cmd.cmd, cmd.cb, cmd.err); });
-      break;
+      co_await wake_;
+      continue;
+    }
+    Command& cmd = current_[0] = dequeue(0);
+    inCommand_ = true;
+    armWatchdog();
+    // If the connection is not open yet, go ahead and establish a new
+    // connection.
+    if (sock_ < 0 && !co_await login()) {
+      shutdown();
+      continue;
+    }
+    co_await execute(cmd);
+    inCommand_ = false;
+    // In pipelined mode, the command could still be in flight. Once it
+    // completes, Lutron::complete() takes care of the watchdog.
+    if (inflight_.empty() && watchdog_) {
+      event_.removeTimeout(watchdog_);
+      watchdog_ = {};
     }
   }
-  if (next) {
-    if (inCommand_ || later_[inCallback_].size()) {
-      // If there still is work to be done, don't invoke our callback
-      // just yet.
-      later_[inCallback_].push_back(
-        Command{std::string(),
-                [=](const std::string& line) { next(); },
-                (std::function<void ()>)nullptr});
-    } else {
-      // All delayed tasks have now completed.
-      next();
+}
+
+Task<> Lutron::execute(Command& cmd) {
+  // Wait until there is room in the pipeline. Commands that can't be
+  // pipelined wait until the pipeline is empty. The same is true for empty
+  // commands. They push a callback to the end of the queue, so that it only
+  // ever gets executed after all other pending commands have completed.
+  const bool pipelined = canPipeline(cmd.cmd);
+  while (inflight_.size() >= (pipelined ? depth_ : 1)) {
+    co_await prompt_;
+  }
+  if (cmd.cmd.empty()) {
+    report(cmd);
+    co_return;
+  }
+  // We might have to wait for the prompt, before we can send the first
+  // command.
+  if (inflight_.empty() && !atPrompt_ && !co_await waitForPrompt(PROMPT)) {
+    shutdown();
+    co_return;
+  }
+  // From now on, Lutron::readLines() keeps processing the responses, until
+  // it sees the prompt that completes the command. If that never happens,
+  // the watchdog closes the connection and fails the command.
+  std::string data = cmd.cmd + "\r\n";
+  cmd.written = Util::micros64();
+  inflight_.push_back(std::move(cmd));
+  maxInflight_ = std::max(maxInflight_, inflight_.size());
+  cmd = Command();
+  if (!co_await sendData(std::move(data))) {
+    shutdown();
+    co_return;
+  }
+  if (!pipelined) {
+    while (!inflight_.empty()) {
+      co_await prompt_;
     }
   }
 }
 
-void Lutron::waitForPrompt(const std::string& prompt,
-                           std::function<void (void)> cb,
-                           std::function<void (void)> err,
-                           bool login,
-                           std::string::size_type partial) {
-  if (atPrompt_ && prompt == PROMPT) {
-    // If we already are at the prompt, there is nothing else to do.
-    if (cb) {
-      cb();
+void Lutron::report(Command& cmd) {
+  // Report the result from the event loop, which makes sure that our caller
+  // can't interfere with our own state.
+  if (cmd.failed) {
+    if (cmd.err) {
+      event_.runLater(std::move(cmd.err));
     }
-    return;
+  } else if (cmd.cb) {
+    event_.runLater([cb = std::move(cmd.cb), res = std::move(cmd.result)]() {
+      cb(res); });
   }
-  // Set up a timeout that fires if we never see a prompt when we
-  // expected one.
-  void *tmo = event_.addTimeout(TMO/2, [=, this]() {
-    DBG("Timing out on waitForPrompt()");
-    for (auto it = pending_[inCallback_].rbegin();
-         it != pending_[inCallback_].rend();
-         ++it) {
-      if (it->cmd == prompt) {
-        pending_[inCallback_].erase(std::next(it).base());
-        break;
-      }
+  cmd = Command();
+}
+
+void Lutron::complete() {
+  // The repeater handles commands strictly in order. So, each prompt
+  // completes the oldest command that is still in flight. As long as there
+  // is more work to do, completing a command counts as progress and pushes
+  // out the watchdog.
+  Command cmd = std::move(inflight_.front());
+  inflight_.pop_front();
+  account(cmd);
+  report(cmd);
+  if (!inflight_.empty() || inCommand_) {
+    armWatchdog();
+  } else if (watchdog_) {
+    event_.removeTimeout(watchdog_);
+    watchdog_ = {};
+  }
+}
+
+void Lutron::account(const Command& cmd) {
+  // Commands are grouped by their keyword, which includes the leading "?"
+  // or "#" character. Once the current window is full, it becomes the
+  // previous window, and older data is discarded.
+  const auto now = Util::micros64();
+  if (now - statsSince_ >= STATS_WINDOW) {
+    stats_[1] = std::move(stats_[0]);
+    stats_[0].clear();
+    statsSince_ = now;
+  }
+  auto& stats = stats_[0][cmd.cmd.substr(0, cmd.cmd.find(','))];
+  stats.queued.add(cmd.dequeued - cmd.queued);
+  stats.sent.add(cmd.written - cmd.dequeued);
+  if (cmd.responded) {
+    stats.response.add(cmd.responded - cmd.written);
+  }
+  stats.done.add(now - cmd.written);
+  stats.total.add(now - cmd.queued);
+}
+
+std::map<std::string, Lutron::Stats> Lutron::stats() const {
+  // Merge the current and the previous window.
+  const auto merge = [](Event::Histogram& a, const Event::Histogram& b) {
+    for (int i = 0; i < Event::Histogram::BUCKETS; ++i) {
+      a.buckets[i] += b.buckets[i];
     }
-    if (err) { err(); } });
-  // Remember the callback. It will be invoked when Lutron::processLine()
-  // sees the prompt that we are waiting for.
-  pending_[inCallback_].push_back(Command{
-    prompt,
-    [=, this](auto) {
-      event_.removeTimeout(tmo);
-      if (cb) {
-        cb();
-      }
-    }, [=, this]() {
-      DBG("Failed to find prompt; removing timeout");
-      event_.removeTimeout(tmo);
-      if (err) {
-        err();
-      }
-    }});
-  // If the connection is not open yet, go ahead and establish a new
-  // connection. This can optionally be suppressed to avoid infinite loops
-  // (e.g. when the server isn't available at all).
-  if (login) {
-    Lutron::login([this]() { readLine(); }, err);
-  } else {
-    readLine();
-  }
-}
-
-void Lutron::sendData(const std::string& data,
-                      std::function<void (void)> cb,
-                      std::function<void (void)> err,
-                      const std::string& prompt,
-                      bool login) {
-  const auto doit = [=, this]() {
-    if (!prompt.empty() && (prompt != PROMPT || !atPrompt_)) {
-      // We might have to wait for a prompt. This code handles both the
-      // regular "GNET> " prompt, but can also deal with the "login: " and
-      // "password: " prompts. The latter behave mostly like a normal prompt,
-      // with a few minor differences that will be handled by processLine().
-      waitForPrompt(prompt, [=, this]() { sendData(data, cb, err, "", false); },
-                    err, false);
-    } else {
-      if (data.empty()) {
-        // If there is no data to write then we can return immediately.
-        if (cb) {
-          cb();
-        }
-      } else {
-        // Only write data once the socket is ready for writing.
-        if (sock_ < 0) {
-          if (err) {
-            err();
-          }
-          return;
-        }
-        // We can be called from all sorts of different contexts. Some of these
-        // contexts subsequently make global changes such as setting up a
-        // POLLIN handler. That's going to confuse our code. So, push onto
-        // the Event::runLater() handler to avoid any unexpected state changes.
-        event_.runLater([=, this]() {
-          event_.removePollFd(sock_);
-          event_.addPollFd(sock_, POLLOUT, [=, this](auto) {
-            event_.removePollFd(sock_);
-            atPrompt_ = false;
-            DBGc(1, "write(\"" << Util::trim(data) << "\")");
-            const auto rc = write(sock_, data.c_str(), data.size());
-            if (rc <= 0) {
-              // Failed to write any data.
-              closeSock();
-              if (err) {
-                err();
-              }
-            } else if (rc < (decltype(rc))data.size()) {
-              // Incomplete write. Keep going.
-              sendData(data.substr(rc), cb, err, "", false);
-            } else {
-              // All done. We have written all data.
-              if (cb) {
-                cb();
-              }
-            }
-            return true;
-          });
-        });
-      }
+    a.count += b.count;
+    a.total += b.total;
+    a.max = std::max(a.max, b.max);
+  };
+  auto ret = stats_[0];
+  for (const auto& [ cls, s ] : stats_[1]) {
+    auto& r = ret[cls];
+    merge(r.queued, s.queued);
+    merge(r.sent, s.sent);
+    merge(r.response, s.response);
+    merge(r.done, s.done);
+    merge(r.total, s.total);
+  }
+  return ret;
+}
+
+std::string Lutron::report() const {
+  const auto fmt = [](const std::string& name, const char *stage,
+                      const Event::Histogram& h) {
+    char buf[256];
+    if (!h.count) {
+      return std::string();
     }
+    snprintf(buf, sizeof(buf),
+             "%-30s %-9s n=%llu avg=%lluus p50<%lluus p99<%lluus max=%lluus\n",
+             name.c_str(), stage, (unsigned long long)h.count,
+             (unsigned long long)(h.total/h.count),
+             (unsigned long long)h.percentile(0.5),
+             (unsigned long long)h.percentile(0.99),
+             (unsigned long long)h.max);
+    return std::string(buf);
   };
-  // If the connection is not open yet, go ahead and establish a new
-  // connection. This can optionally be suppressed to avoid infinite loops
-  // (e.g. when the server isn't available at all).
-  if (login && !inCallback_) {
-    Lutron::login(doit, err);
-  } else {
-    doit();
+  char buf[128];
+  snprintf(buf, sizeof(buf),
+           "%-40s interactive=%zu normal=%zu background=%zu inflight=%zu\n",
+           "lutron max queue depth", maxQueued_[INTERACTIVE],
+           maxQueued_[NORMAL], maxQueued_[BACKGROUND], maxInflight_);
+  std::string ret = buf;
+  for (const auto& [ cls, s ] : stats()) {
+    const auto name = "lutron " + cls;
+    ret += fmt(name, "queued", s.queued) + fmt(name, "sent", s.sent) +
+           fmt(name, "response", s.response) + fmt(name, "done", s.done) +
+           fmt(name, "total", s.total);
   }
+  return ret;
 }
 
-void Lutron::login(std::function<void (void)> cb,
-                   std::function<void (void)> err) {
-  // If connection is already established, continue using it until it
-  // gets closed (e.g. because of an error condition).
-  if (sock_ >= 0) {
-    if (cb) {
-      cb();
+bool Lutron::canPipeline(const std::string& cmd) {
+  // Regular commands start with "?" or "#", followed by an upper case
+  // keyword and a list of arguments. We know how the repeater responds to
+  // these commands. Anything else could behave unexpectedly.
+  if (cmd.size() < 3 || (cmd[0] != '?' && cmd[0] != '#') ||
+      cmd.find_first_of("\r\n") != std::string::npos) {
+    return false;
+  }
+  const auto comma = cmd.find(',');
+  if (comma == std::string::npos || comma < 2) {
+    return false;
+  }
+  return std::all_of(cmd.begin() + 1, cmd.begin() + comma,
+                     [](char ch) { return ch >= 'A' && ch <= 'Z'; });
+}
+
+Task<bool> Lutron::sendData(std::string data) {
+  // Commands are queued in the writer, which sends everything that
+  // accumulated during the same iteration of the event loop with a single
+  // system call. In pipelined mode, that is usually an entire burst of
+  // commands. Only wait, if the repeater has fallen too far behind.
+  if (sock_ < 0) {
+    co_return false;
+  }
+  atPrompt_ = false;
+  DBGc(1, "write(\"" << Util::trim(data) << "\")");
+  writer_.write(std::move(data));
+  const bool ok = co_await writer_.room();
+  co_return ok;
+}
+
+Task<bool> Lutron::waitForPrompt(const char *prompt) {
+  // This code handles both the regular "GNET> " prompt, but can also deal
+  // with the "login: " and "password: " prompts. The latter behave mostly
+  // like a normal prompt, but Lutron::nextLine() only recognizes them when
+  // we tell it to look for them.
+  if (prompt != PROMPT) {
+    // The prompt could have arrived while we were still busy sending our
+    // previous response. As it isn't terminated by a newline, it then sits
+    // in the buffer, and Lutron::readLines() won't look at it again.
+    const std::string_view buffered(in_.data() + head_, tail_ - head_);
+    if (const auto pos = buffered.find(prompt); pos != buffered.npos) {
+      head_ += pos + strlen(prompt);
+      co_return true;
     }
-    return;
+    expect_ = prompt;
   }
-  DBG("Lutron::login()");
-  if (inCallback_) {
-    // We are already in the process of handling a login(). Can't be
-    // called recursively.
-    if (err) {
-      err();
+  // Time out, if we never see a prompt when we expected one.
+  const auto deadline = Util::millis() + TMO/2;
+  while (prompt == PROMPT ? !atPrompt_ : !expect_.empty()) {
+    const int tmo = deadline - Util::millis();
+    if (tmo <= 0 || !co_await prompt_.wait(event_, tmo)) {
+      DBG("Timing out on waitForPrompt()");
+      expect_.clear();
+      co_return false;
     }
-    return;
   }
+  co_return true;
+}
+
+Task<bool> Lutron::login() {
+  DBG("Lutron::login()");
   initStillWorking();
-  const auto lookupAddress = [=, this](const std::string& gateway) {
-    // Look up network address (i.e. resolve DNS names, convert numeric
-    // IP addresses to binary representation).
-    struct addrinfo hints = { .ai_family = AF_UNSPEC,
-                              .ai_socktype = SOCK_STREAM };
-    struct addrinfo *result = 0;
-    if (getaddrinfo(gateway.c_str(), "23", &hints, &result) || !result) {
+
+  // If we found the repeater by multicast discovery before, try its last
+  // known address right away. Discovery still starts in the background, but
+  // we only wait for its answer, if the old address no longer works.
+  const bool autodetect = gateway_.empty() || gateway_ == "auto";
+  bool connected = false;
+  if (adopted_ >= 0) {
+    // Another object handed us a connection that is already logged in.
+    // Any buffered data was passed along with the connection.
+    DBG("Taking over existing connection");
+    sock_ = std::exchange(adopted_, -1);
+    isConnected_ = true;
+    writer_.attach(sock_);
+    reader_ = readLines();
+    reader_.start();
+    connected = true;
+  } else {
+    // Information about a failover only applies to an adopted connection.
+    failover_.reset();
+  }
+  if (!connected && autodetect) {
+    const std::string last = lastGateway();
+    if (!last.empty()) {
+      DBG("Trying last known gateway at " << last);
+      probe();
+      connected = co_await connectTo(last);
+    }
+  }
+  if (!connected) {
+    const std::string gateway = co_await discover();
+    if (gateway.empty()) {
+      co_return false;
+    }
+    connected = co_await connectTo(gateway);
+    if (connected && autodetect) {
+      saveGateway(gateway);
+    }
+  }
+  stopDiscovery();
+  if (!connected) {
+    co_return false;
+  }
+
+  // Let our owner initialize the connection. Commands that it submits
+  // take precedence over all other commands. We are done, once the
+  // "init_" callback has signaled completion, and all of its commands
+  // have executed.
+  inCallback_ = true;
+  initDone_ = false;
+  event_.runLater([this, generation = generation_]() {
+    if (generation != generation_) {
+      return;
+    }
+    const auto doneInitializing = [this, generation]() {
+      if (generation == generation_) {
+        // Unless there still are commands left to execute, any new
+        // commands no longer count as part of the initialization.
+        initDone_ = true;
+        if (!hasQueued(1) && inflight_.empty()) {
+          inCallback_ = false;
+        }
+        wakeUp();
+      }
+    };
+    if (init_) {
+      init_(doneInitializing);
+    } else {
+      doneInitializing();
+    }
+  });
+  while (!initDone_ || hasQueued(1)) {
+    if (!hasQueued(1)) {
+      co_await wake_;
+      continue;
+    }
+    Command& cmd = current_[1] = dequeue(1);
+    co_await execute(cmd);
+    if (sock_ < 0) {
+      co_return false;
+    }
+  }
+  DBG("Finished initializing");
+  inCallback_ = false;
+  co_return true;
+}
+
+Task<bool> Lutron::connectTo(const std::string& gateway) {
+  // Look up network address (i.e. resolve DNS names, convert numeric
+  // IP addresses to binary representation). This can block for a long
+  // time, so it happens on a worker thread. If we give up in the meantime
+  // (e.g. because of a timeout), the result is discarded.
+  // "getaddrinfo()" doesn't tell us the TTL of the DNS records. So, keep
+  // the result for a fixed amount of time. Routine reconnects then don't
+  // have to wait for the resolver at all.
+  if (resolvedName_ != gateway || !resolved_ ||
+      Util::millis() - resolvedAt_ >= DNS_TTL) {
+    using AddrInfo = std::unique_ptr<struct addrinfo, void (*)(addrinfo *)>;
+    auto lookup = [gateway]() {
+      struct addrinfo hints = { .ai_family = AF_UNSPEC,
+                                .ai_socktype = SOCK_STREAM };
+      struct addrinfo *result = 0;
+      if (getaddrinfo(gateway.c_str(), "23", &hints, &result)) {
+        result = 0;
+      }
+      return AddrInfo(result, freeaddrinfo);
+    };
+    auto result = co_await event_.pool().async(std::move(lookup));
+    if (!result) {
       DBG("getaddrinfo() failed (\"" << gateway << "\")");
-      closeSock();
-      if (err) {
-        event_.runLater(err);
+      co_return false;
+    }
+    resolved_ = std::move(result);
+    resolvedName_ = gateway;
+    resolvedAt_ = Util::millis();
+  }
+  // Hold on to the addresses, even if the cache gets replaced while we
+  // are still connecting.
+  const auto result = resolved_;
+
+  // Alternate between address families. If one of them is broken, we still
+  // get to try the other one early on.
+  std::vector<const addrinfo *> candidates, other;
+  for (auto rp = result.get(); rp; rp = rp->ai_next) {
+    (rp->ai_family == result->ai_family ? candidates : other).push_back(rp);
+  }
+  for (size_t i = 0; i < other.size(); ++i) {
+    candidates.insert(candidates.begin() +
+                      std::min(2*i + 1, candidates.size()), other[i]);
+  }
+
+  // Race connections to all addresses, then try to log in. If that fails,
+  // race the remaining addresses.
+  while (!candidates.empty()) {
+    initStillWorking();
+    const auto [ fd, rp ] = co_await race(candidates);
+    if (fd < 0) {
+      break;
+    }
+    candidates.erase(std::find(candidates.begin(), candidates.end(), rp));
+    head_ = tail_ = 0;
+    sock_ = fd;
+    isConnected_ = true;
+    writer_.attach(sock_);
+    // Keep reading lines from the socket for as long as it is open. Then
+    // try to log in. If that fails, try the next address.
+    reader_ = readLines();
+    reader_.start();
+    const bool fast = fastLogin_;
+    if (!co_await enterPassword()) {
+      DBG("Failed to enter password");
+      disconnect();
+      // If fast login just failed, try the same address again in strict
+      // mode.
+      if (fast && !fastLogin_) {
+        candidates.insert(candidates.begin(), rp);
       }
-      return;
+      continue;
     }
-    dontfinalize_ = true;
-    const auto freeaddrHandler = timeout_.push([this, result]() {
-      freeaddrinfo(result);
-      dontfinalize_ = false;
-    });
+    addrLen_ = rp->ai_addrlen;
+    memcpy(&addr_, rp->ai_addr, std::min((socklen_t)sizeof(addr_), addrLen_));
+    co_return true;
+  }
+  // End of list was reached and none of the servers responded. Maybe, the
+  // DNS records have changed. Look them up again next time.
+  DBG("No addresses found");
+  resolved_.reset();
+  co_return false;
+}
 
-    // Iterate over all addresses returned by the resolver and try to connect
-    // to the server. This can take a while, so do it asynchronously on the
-    // event loop.
-    const auto openSocket = Util::rec([=, this](auto&& openSocket,
-                                                struct addrinfo *rp) -> void {
-      initStillWorking();
-      const auto doLogin = [=, this]() {
-        inCallback_ = true;
-        enterPassword([=, this]() {
-          // Pop both tmoHandler and freeaddrHandler.
-          addrLen_ = rp->ai_addrlen;
-          memcpy(&addr_, rp->ai_addr,
-                 std::min((socklen_t)sizeof(addr_), addrLen_));
-          timeout_.pop(freeaddrHandler);
-          bool oldCommand = inCommand_;
-          inCommand_ = false;
-          const auto doneInitializing = [=, this]() {
-            checkDelayed([=, this]() {
-              DBG("Finished initializing");
-              inCallback_ = false;
-              inCommand_ = oldCommand && isConnected_;
-              if (cb) { cb(); } });};
-          if (init_) {
-            init_(doneInitializing);
-          } else {
-            doneInitializing();
-          } },
-        [=, this]() {
-          // Pop only tmoHandler (already done), then try next address.
-          DBG("Failed to enter password");
-          closeSock();
-          openSocket(rp->ai_next); });
-      };
-
-      // Iterate over all addresses until either we are blocked on I/O or
-      // we have reached the end of the list.
-      for (;;) {
-        // End of list was reached and none of the servers responded. Return
-        // error.
-        if (!rp) {
-          DBG("No addresses found");
-          timeout_.pop(freeaddrHandler);
-          if (err) {
-            err();
-          }
-          return;
-        }
-        // Create a non-blocking networking socket.
-        ahead_.clear();
-        sock_ = socket(rp->ai_family,
-                       rp->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
-                       rp->ai_protocol);
-        isConnected_ = sock_ >= 0;
-        if (isConnected_) {
-          // If things take too long, abort the operation.
-          const auto tmo = event_.addTimeout(TMO/3,
-            [=, this, tmoHandler = timeout_.next()]() {
-            DBG("Timeout trying to connect");
-            timeout_.pop(tmoHandler);
-            closeSock();
-            openSocket(rp->ai_next);
-          });
-          const auto tmoHandler = timeout_.push([event = &event_, tmo]() {
-            event->removeTimeout(tmo);
-          });
-          // Try to open connection to server.
-          if (connect(sock_, rp->ai_addr, rp->ai_addrlen) >= 0) {
-            // That worked on the first try. Try to log in.
-            DBG("Synchronous success");
-            timeout_.pop(tmoHandler);
-            doLogin();
-            return;
-          }
-          // The connection wasn't immediately available. Wait until the
-          // socket becomes writable then check whether the connection has
-          // been established asynchronously.
-          if (errno == EINPROGRESS || errno == EWOULDBLOCK) {
-            event_.addPollFd(sock_, POLLOUT, [=, this](auto) {
-              event_.removePollFd(sock_);
-              socklen_t addrlen = 0;
-              if (getpeername(sock_, (struct sockaddr *)"", &addrlen) < 0) {
-                // Unable to open connection to this address. Keep trying with
-                // the next address.
-                DBG("Asynchronous failure");
-                timeout_.pop(tmoHandler);
-                closeSock();
-                openSocket(rp->ai_next);
-              } else {
-                // Try to log in. That could take a while. So, again, let's
-                // run this operation asynchronously. If everything worked, we
-                // are done. But if we fail to log in then try the next address.
-                timeout_.pop(tmoHandler);
-                doLogin();
-              }
-              return true;
-            });
-            return;
-          } else {
-            DBG("Unexpected I/O error: " << errno);
-            timeout_.pop(tmoHandler);
-            closeSock();
-          }
+Task<std::pair<int, const addrinfo *>> Lutron::race(
+  const std::vector<const addrinfo *>& candidates) {
+  // Start connecting to the first address. If that doesn't succeed within
+  // a short amount of time, start connecting to the next address without
+  // giving up on the first one (c.f. "Happy Eyeballs", RFC 8305). Whichever
+  // connection completes first wins. All others get closed. A dead address
+  // no longer holds us up for the entire timeout.
+  struct Attempt {
+    int fd;
+    const addrinfo *rp;
+    bool ready;
+  };
+  struct Attempts {
+    Event& event;
+    std::vector<Attempt> list;
+    ~Attempts() {
+      for (const auto& a : list) {
+        event.removePollFd(a.fd);
+        close(a.fd);
+      }
+    }
+  } attempts{event_};
+  // Waking up the coroutine can make it return, before "notify()" does.
+  // The callback holds on to the signal, until it is safe to release it.
+  const auto ready = std::make_shared<Signal>();
+  for (size_t next = 0;;) {
+    if (next < candidates.size()) {
+      const auto rp = candidates[next++];
+      const int fd = socket(rp->ai_family,
+                            rp->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                            rp->ai_protocol);
+      if (fd < 0) {
+        continue;
+      } else if (connect(fd, rp->ai_addr, rp->ai_addrlen) >= 0) {
+        DBG("Synchronous success");
+        co_return std::make_pair(fd, rp);
+      } else if (errno != EINPROGRESS && errno != EWOULDBLOCK) {
+        DBG("Unexpected I/O error: " << errno);
+        close(fd);
+        continue;
+      }
+      attempts.list.push_back(Attempt{fd, rp, false});
+      event_.addPollFd(fd, POLLOUT, [&attempts, ready, fd](auto) {
+        for (auto& a : attempts.list) {
+          a.ready |= a.fd == fd;
         }
-        // Synchronously iterate to the next address. This is an unlikely
-        // code path, as we won't get here if any of the I/O operations
-        // blocked.
-        rp = rp->ai_next;
+        ready->notify();
+        return false;
+      });
+    }
+
+    // The socket becomes writable, when the connection attempt has
+    // finished. That could mean that it was successful, or that it failed.
+    for (auto it = attempts.list.begin(); it != attempts.list.end(); ) {
+      int err = 0;
+      socklen_t len = sizeof(err);
+      if (!it->ready) {
+        ++it;
+        continue;
+      } else if (!getsockopt(it->fd, SOL_SOCKET, SO_ERROR, &err, &len) &&
+                 !err) {
+        const auto winner = *it;
+        attempts.list.erase(it);
+        co_return std::make_pair(winner.fd, winner.rp);
       }
-    });
-    openSocket(result);
-  };
+      DBG("Asynchronous failure");
+      close(it->fd);
+      it = attempts.list.erase(it);
+    }
+
+    // Wait for one of the attempts to finish. If that takes too long,
+    // start another attempt in parallel. Once there are no more addresses
+    // left, give the remaining attempts a little more time.
+    const bool more = next < candidates.size();
+    if (attempts.list.empty()) {
+      if (!more) {
+        co_return std::make_pair(-1, (const addrinfo *)nullptr);
+      }
+      continue;
+    }
+    const unsigned tmo = more ? STAGGER : TMO/3;
+    if (!co_await ready->wait(event_, tmo) && !more) {
+      DBG("Timeout trying to connect");
+      co_return std::make_pair(-1, (const addrinfo *)nullptr);
+    }
+  }
+}
+
+std::string Lutron::lastGateway() {
+  // The address of the repeater that we found most recently. It is kept
+  // next to the cached copy of the schema.
+  char buf[64] = { };
+  const auto fp = std::unique_ptr<FILE, int (*)(FILE *)>(
+    fopen(GATEWAY_CACHE, "r"), fclose);
+  if (!fp || !fgets(buf, sizeof(buf), fp.get())) {
+    return "";
+  }
+  return Util::trim(buf);
+}
+
+void Lutron::saveGateway(const std::string& gateway) {
+  if (gateway == lastGateway()) {
+    return;
+  }
+  const auto fp = std::unique_ptr<FILE, int (*)(FILE *)>(
+    fopen(GATEWAY_CACHE, "w"), fclose);
+  if (fp) {
+    fprintf(fp.get(), "%s\n", gateway.c_str());
+  }
+}
 
+Task<std::string> Lutron::discover() {
   if (gateway_.empty() || gateway_ == "auto") {
     // If the user didn't configure a particular IP address for the main
     // repeater, search for it by sending a request to the multicast address
-    // 224.0.37.42:2647
+    // 224.0.37.42:2647. The request might already have gone out, while we
+    // were trying the last known address. In that case, any replies are
+    // waiting for us on the open socket.
+    if (msock_ < 0) {
+      probe();
+    }
     if (msock_ >= 0) {
-      // If we already have an open multicast socket, close it now. It might
-      // still hang around briefly after a timeout has expired.
-      event_.removePollFd(msock_);
-      close(msock_);
-    }
-    const auto mcast=(const sockaddr_in){AF_INET,htons(2647),htonl(0xE000252A)};
-    const auto membr=(const ip_mreq){htonl(0xE000252A)};
-    const char req[] = "<LUTRON=1>";
-    if ((msock_ = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) >= 0 &&
-        !setsockopt(msock_, SOL_SOCKET, SO_REUSEADDR,
-                    (const int[]){1}, sizeof(int)) &&
-        !bind(msock_, (const sockaddr *)&mcast, sizeof(mcast)) &&
-        !setsockopt(msock_, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membr,
-                    sizeof(membr)) &&
-        sendto(msock_, req, sizeof(req)-1, 0, (const sockaddr *)&mcast,
-               sizeof(mcast)) == sizeof(req)-1) {
-      // We need to parse the reponse from the main repeater (or any other
-      // device that is using this multicast address and sent us a reply). The
-      // response looks similar'ish to XML, but isn't well-formed. So, we can't
-      // use a proper XML parser and have to use an ad hoc parser instead.
-      event_.addPollFd(msock_, POLLIN, [=, this](auto) {
+      // Keep reading responses until we find the main repeater. If that
+      // never happens, the watchdog eventually cancels us.
+      for (;;) {
+        co_await event_.readable(msock_);
         char buf[1500] = { '>' };
         const auto rc = read(msock_, buf + 1, sizeof(buf) - 2);
         if (rc > 0) {
-          const std::string resp(buf);
-          bool type = false, prod = false;
-          in_addr addr{0};
-          // There doesn't seem to be any extraneous white space separating
-          // entries, but there also notably aren't any quotes, no escaping,
-          // no closing tags, and tags are always just a single KEY=VALUE pair
-          // with the exception of the overall enclosing <LUTRON=2>...</LUTRON>
-          // marker. Break at "><" positions throughout the received data.
-          for (auto pos = resp.find("><"); pos != std::string::npos; ) {
-            auto eq = pos + 1;
-            // Try to find the position of the equals character, or
-            // alternatively the close of the tag or the end of the buffer.
-            for (;;) {
-              eq = resp.find_first_of("=>", eq + 1);
-              // We got all the way to the end of the buffer. We're done here.
-              if (eq == std::string::npos ||
-                  (resp[eq] == '>' && eq+1 == std::string::npos))
-                goto end;
-              // This is the end of the tag. We never found an equals
-              // character. Skip this tag altogether.
-              if (resp[eq] == '>' && resp[eq+1] == '<') {
-                pos = eq;
-                goto next;
-              }
-              // Found it! Good, now we can parse key and value.
-              if (resp[eq] == '=') {
-                break;
-              }
-            }
-            // Find the close of the tag.
-            { auto cls = eq;
-            for (;;) {
-              cls = resp.find('>', cls + 1);
-              // The tag is incomplete.
-              if (cls == std::string::npos)
-                goto end;
-              // Reached end of buffer.
-              if (cls+1 == std::string::npos)
-                break;
-              // We found a closing tag, but it's not followed by an
-              // expected opening tag nor at the end of the buffer either.
-              // Keep reading. This might just be a closing ">" embedded
-              // in a value.
-              if (resp[cls+1] == '<')
-                break;
-            }
-            // Extract key and value into individual strings.
-            const auto k = std::string(resp, pos + 2, eq - pos - 2);
-            const auto v = std::string(resp, eq + 1, cls - eq - 1);
-            // We expect a response that starts with "<LUTRON=2>".
-            if (k == "LUTRON") {
-              if (v != "2") {
-                goto end;
-              }
-              type = true;
-            } else if (k == "PRODTYPE") {
-              // We only ever want to talk to the RadioRA2 Main Repeater.
-              // We don't know what to do with any other devices that could
-              // conceivably live in the same multicast domain. So, we
-              // disregard any responses that don't match.
-              if (v != "MainRepeater") {
-                goto end;
-              }
-              prod = true;
-            } else if (k == "IPADDR") {
-              // The IPv4 address is a four-tuple with leading zeros. Better
-              // parse it ourselves than rely on library functions that could
-              // get thrown off by this slightly unusual format.
-              uint32_t a = 0;
-              for (auto ptr = v.c_str();;) {
-                a = (a << 8) + strtoul(ptr, (char **)&ptr, 10);
-                if (!*ptr++) break;
-              }
-              addr.s_addr = htonl(a);
-            }
-            pos = cls; }
-          next:;
-          }
-        end:
-          if (type && prod && addr.s_addr) {
-            // This is a little silly. We keep converting back and forth
-            // between "struct in_addr" and "std::string". But by doing so,
-            // can make sure the string is well-formed.
-            close(msock_);
-            msock_ = -1;
-            this->g_ = std::string(inet_ntoa(addr));
-            DBG("Found gateway at " << this->g_);
-            lookupAddress(this->g_);
-            return false;
+          g_ = parseDiscovery(buf);
+          if (!g_.empty()) {
+            stopDiscovery();
+            DBG("Found gateway at " << g_);
+            co_return g_;
           }
         }
-        return true;
-      });
+      }
     } else {
       DBG("Failed to find Lutron main repeater using multicast discovery");
-      if (msock_ >= 0) {
-        close(msock_);
-        msock_ = -1;
-      }
+      co_return "";
     }
   } else if (gateway_ != "find-radiora2") {
     // If the caller provided the address or name of the server, we can
     // connect directly.
-    lookupAddress(gateway_);
+    co_return gateway_;
   } else {
     // If the address isn't known, use a helper script to scan the network.
     // This operation can take a while, so perform it asynchronously.
-    FILE *fp = popen("./find-radiora2", "r");
-    const auto pcloseHandler = timeout_.push([event = &event_, fp]() {
-      event->removePollFd(fileno(fp));
-      pclose(fp);
-    });
+    const auto fp = std::unique_ptr<FILE, int (*)(FILE *)>(
+      popen("./find-radiora2", "r"), pclose);
     g_ = "";
-    event_.addPollFd(fileno(fp), POLLIN, [=, this, &gateway = this->g_](auto) {
+    if (!fp) {
+      co_return g_;
+    }
+    for (;;) {
+      co_await event_.readable(fileno(fp.get()));
       char buf[64];
-      const auto rc = read(fileno(fp), buf, sizeof(buf));
+      const auto rc = read(fileno(fp.get()), buf, sizeof(buf));
       // If we reached the end of the file, use this as the server to
       // connect to.
       if (rc <= 0) {
-        timeout_.pop(pcloseHandler);
-        lookupAddress(gateway = Util::trim(gateway));
-        return false;
+        co_return g_ = Util::trim(g_);
       } else {
-        gateway = gateway + std::string(buf, rc);
+        g_ = g_ + std::string(buf, rc);
       }
-      return true;
-    });
+    }
+  }
+}
+
+void Lutron::probe() {
+  // Send a discovery request to the multicast group. Replies arrive on
+  // "msock_", and "discover()" reads them, when it needs them. If we
+  // already have an open multicast socket, close it now. It might still
+  // hang around briefly after a timeout has expired.
+  stopDiscovery();
+  const auto mcast=(const sockaddr_in){AF_INET,htons(2647),htonl(0xE000252A)};
+  const auto membr=(const ip_mreq){htonl(0xE000252A)};
+  const char req[] = "<LUTRON=1>";
+  if ((msock_ = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP)) < 0 ||
+      setsockopt(msock_, SOL_SOCKET, SO_REUSEADDR,
+                 (const int[]){1}, sizeof(int)) ||
+      bind(msock_, (const sockaddr *)&mcast, sizeof(mcast)) ||
+      setsockopt(msock_, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membr,
+                 sizeof(membr)) ||
+      sendto(msock_, req, sizeof(req)-1, 0, (const sockaddr *)&mcast,
+             sizeof(mcast)) != sizeof(req)-1) {
+    stopDiscovery();
+  }
+}
+
+void Lutron::stopDiscovery() {
+  if (msock_ >= 0) {
+    event_.removePollFd(msock_);
+    close(msock_);
+    msock_ = -1;
+  }
+}
+
+std::string Lutron::parseDiscovery(const std::string& resp) {
+  // We need to parse the reponse from the main repeater (or any other
+  // device that is using this multicast address and sent us a reply). The
+  // response looks similar'ish to XML, but isn't well-formed. So, we can't
+  // use a proper XML parser and have to use an ad hoc parser instead.
+  bool type = false, prod = false;
+  in_addr addr{0};
+  // There doesn't seem to be any extraneous white space separating
+  // entries, but there also notably aren't any quotes, no escaping,
+  // no closing tags, and tags are always just a single KEY=VALUE pair
+  // with the exception of the overall enclosing <LUTRON=2>...</LUTRON>
+  // marker. Break at "><" positions throughout the received data.
+  for (auto pos = resp.find("><"); pos != std::string::npos; ) {
+    auto eq = pos + 1;
+    // Try to find the position of the equals character, or
+    // alternatively the close of the tag or the end of the buffer.
+    for (;;) {
+      eq = resp.find_first_of("=>", eq + 1);
+      // We got all the way to the end of the buffer. We're done here.
+      if (eq == std::string::npos ||
+          (resp[eq] == '>' && eq+1 == std::string::npos))
+        goto end;
+      // This is the end of the tag. We never found an equals
+      // character. Skip this tag altogether.
+      if (resp[eq] == '>' && resp[eq+1] == '<') {
+        pos = eq;
+        goto next;
+      }
+      // Found it! Good, now we can parse key and value.
+      if (resp[eq] == '=') {
+        break;
+      }
+    }
+    // Find the close of the tag.
+    { auto cls = eq;
+    for (;;) {
+      cls = resp.find('>', cls + 1);
+      // The tag is incomplete.
+      if (cls == std::string::npos)
+        goto end;
+      // Reached end of buffer.
+      if (cls+1 == std::string::npos)
+        break;
+      // We found a closing tag, but it's not followed by an
+      // expected opening tag nor at the end of the buffer either.
+      // Keep reading. This might just be a closing ">" embedded
+      // in a value.
+      if (resp[cls+1] == '<')
+        break;
+    }
+    // Extract key and value into individual strings.
+    const auto k = std::string(resp, pos + 2, eq - pos - 2);
+    const auto v = std::string(resp, eq + 1, cls - eq - 1);
+    // We expect a response that starts with "<LUTRON=2>".
+    if (k == "LUTRON") {
+      if (v != "2") {
+        goto end;
+      }
+      type = true;
+    } else if (k == "PRODTYPE") {
+      // We only ever want to talk to the RadioRA2 Main Repeater.
+      // We don't know what to do with any other devices that could
+      // conceivably live in the same multicast domain. So, we
+      // disregard any responses that don't match.
+      if (v != "MainRepeater") {
+        goto end;
+      }
+      prod = true;
+    } else if (k == "IPADDR") {
+      // The IPv4 address is a four-tuple with leading zeros. Better
+      // parse it ourselves than rely on library functions that could
+      // get thrown off by this slightly unusual format.
+      uint32_t a = 0;
+      for (auto ptr = v.c_str();;) {
+        a = (a << 8) + strtoul(ptr, (char **)&ptr, 10);
+        if (!*ptr++) break;
+      }
+      addr.s_addr = htonl(a);
+    }
+    pos = cls; }
+  next:;
+  }end:
+  if (type && prod && addr.s_addr) {
+    // This is a little silly. We keep converting back and forth
+    // between "struct in_addr" and "std::string". But by doing so,
+    // can make sure the string is well-formed.
+    return std::string(inet_ntoa(addr));
   }
+  return "";
 }
 
-void Lutron::enterPassword(std::function<void (void)> cb,
-                           std::function<void (void)> err) {
+Task<bool> Lutron::enterPassword() {
   if (atPrompt_) {
     // Something is horribly wrong. We should never try to enter
     // credentials when we are already at the "GNET> " prompt.
-    closeSock();
-    if (err) {
-      err();
-    }
-    return;
+    co_return false;
   }
   // Enter credentials when prompted, then wait for the normal
-  // "GNET> " prompt.
-  sendData(username_ + "\r\n", [=, this]() {
-  sendData(passwd_ + "\r\n", [=, this]() {
-  waitForPrompt(PROMPT, cb, err, false); },
-           err, "password: ", false); },
-           err, "login: ", false);
+  // "GNET> " prompt. In fast mode, the credentials have already been sent
+  // by the time that the prompts arrive. The repeater reads them, once it
+  // is ready. That saves a round trip for each prompt.
+  const bool fast = fastLogin_;
+  if (fast && !co_await sendData(username_ + "\r\n" + passwd_ + "\r\n")) {
+    co_return false;
+  }
+  if (!co_await waitForPrompt("login: ") ||
+      (!fast && !co_await sendData(username_ + "\r\n"))) {
+    co_return false;
+  }
+  bool ok = co_await waitForPrompt("password: ");
+  if (ok && !fast) {
+    ok = co_await sendData(passwd_ + "\r\n");
+  }
+  if (ok) {
+    ok = co_await waitForPrompt(PROMPT);
+  }
+  if (!ok && fast) {
+    // If the repeater discarded any of our input, it never shows the next
+    // prompt. Don't try to be clever again.
+    DBG("Fast login failed; falling back to strict login");
+    fastLogin_ = false;
+  }
+  co_return ok;
 }
 
-void Lutron::processLine(const std::string& line) {
+void Lutron::processLine(const LutronMessage& msg) {
   // This method does the heavy lifting. The Lutron wire protocol has a
   // few warts, especially with regards to error handling. All read lines
   // and prompts will be forwarded to this method and it looks at our
-  // current state to decide which callbacks to invoke.
-  //  - "later_" is a vector of commands that were submitted while there
-  //    already was another command pending. We should work through this
-  //    list as we finish other commands. Lutron::checkDelayed() does this
-  //    for us.
-  //  - "pending_" is a vector of commands that have already been submitted
-  //    but not completed. It shouldn't have more than at most one entry.
-  //  - "onPrompt_" is a vector of callbacks that should run when we see the
-  //    "GNET> " prompt. This allows us to deal with commands that might or
-  //    might not have a status code (i.e. ERROR or returned value from query).
-  if (line == PROMPT) {
-    // We saw the "GNET> " prompt. All pending commands are now done. A command
-    // might have completed earlier, if it received a non-void return code.
-    // These commands will push their callback onto the "onPrompt_" vector.
-    atPrompt_ = true;
-    if (!inCallback_) {
-      timeout_.clear();
-    }
-    // Any previous commands that were waiting for a new command prompt are
-    // now done.
-    const auto onPrompt = std::move(onPrompt_);
-    for (const auto& completion : onPrompt) {
-      if (completion) {
-        event_.runLater(completion);
-      }
+  // current state to decide how to update the command that is currently
+  // executing. The coroutine that executes the command waits for the
+  // "prompt_" signal, and then reports the result.
+  const auto line = msg.raw;
+  if (!inflight_.empty() && !inflight_.front().responded &&
+      line.starts_with("~")) {
+    // Note when the repeater first reported on the command's target. That's
+    // the keyword and the integration id, e.g. "~OUTPUT,<id>,...".
+    const auto& cmd = inflight_.front().cmd;
+    auto len = cmd.find(',', cmd.find(',') + 1);
+    len = std::min(len, cmd.size()) - 1;
+    if (!line.compare(1, len, cmd, 1, len) &&
+        (line.size() == len + 1 || line[len + 1] == ',')) {
+      inflight_.front().responded = Util::micros64();
     }
-    // If we are still in the process of executing a query command, but now
-    // saw a prompt command instead, assume that there won't be a result code.
-    while (inCommand_ && pending_[inCallback_].size()) {
-      const auto cmd = *pending_[inCallback_].begin();
-      pending_[inCallback_].erase(pending_[inCallback_].begin());
-      if (cmd.cb) {
-        event_.runLater([cb = cmd.cb]() { cb(""); });
-      }
-    }
-    inCommand_ = false;
-    checkDelayed();
-    readLine();
-  } else if (pending_[inCallback_].size() &&
-             line == pending_[inCallback_].rbegin()->cmd) {
-    // Other than the "GNET> " prompt, there also are "login: " and
-    // "password: " prompts. They only require calling the callback.
-    const auto cb = pending_[inCallback_].rbegin()->cb;
-    pending_[inCallback_].pop_back();
-    if (cb) {
-      event_.runLater([=]() { cb(line); });
+  }
+  if (msg.kind == LutronMessage::PROMPT) {
+    // We saw the "GNET> " prompt. The oldest pending command is now done.
+    // It might or might not have received a result code (i.e. ERROR or
+    // returned value from query).
+    if (!inflight_.empty()) {
+      complete();
     }
-  } else if (Util::starts_with(line, "~ERROR") ||
-             line == "is an unknown command") {
+    atPrompt_ = inflight_.empty();
     if (!inCallback_) {
-      timeout_.clear();
+      // As long as we regularly see data, we assume that our connection
+      // is still alive.
+      advanceKeepAliveMonitor();
     }
+    prompt_.notify();
+  } else if (!expect_.empty() && line == expect_) {
+    // Other than the "GNET> " prompt, there also are "login: " and
+    // "password: " prompts.
+    expect_.clear();
+    prompt_.notify();
+  } else if (inflight_.empty() ||
+             !Util::starts_with(inflight_.front().cmd, "?")) {
+    // Only queries can have a result. Everything else is either an
+    // unsolicited update, or an echo of the command that we sent. All
+    // output up to the next prompt belongs to the oldest command in flight.
+  } else if (msg.kind == LutronMessage::ERROR ||
+             line == "is an unknown command") {
     // Lutron doesn't always send an error message, when things go wrong.
     // And it also has two different formats for error messages. We do our
     // best to line up error messages with the command that triggered them.
-    if (inCommand_ && pending_[inCallback_].size()) {
-      const auto cmd = *pending_[inCallback_].begin();
-      pending_[inCallback_].erase(pending_[inCallback_].begin());
-      DBG("Found error message; command \"" << cmd.cmd << "\"");
-      onPrompt_.push_back(cmd.err);
-    }
-  } else if (Util::starts_with(line, "~")) {
+    DBG("Found error message; command \"" << inflight_.front().cmd << "\"");
+    inflight_.front().failed = true;
+  } else if (line.starts_with("~") && inflight_.front().result.empty()) {
     // Command starting with "~" character signal a status change. This could
     // be the response to a query "?" command, or it could be an unsolicted
-    // update. We make a best effort to find the matching command, if there is
-    // one.
-    for (auto it = pending_[inCallback_].begin();
-         it != pending_[inCallback_].end();) {
-      const auto& pending = it->cmd;
-      if (pending.size() > 1 &&
-          Util::starts_with(line, "~" +
-                            pending.substr(1, pending.find_last_of(',')-1))) {
-        if (!inCallback_) {
-          timeout_.clear();
-        }
-        if (it->cb) {
-          onPrompt_.push_back([cb = it->cb, line]() { cb(line); });
-        }
-        it = pending_[inCallback_].erase(it);
-        break;
-      } else {
-        ++it;
-      }
+    // update. We make a best effort to find out whether it matches our
+    // query.
+    // The response has to repeat all of the query's arguments, except for
+    // the last one.
+    const auto& query = inflight_.front().cmd;
+    auto len = query.find_last_of(',');
+    if (len == std::string::npos) {
+      len = query.size() - 1;
+    }
+    if (!line.compare(1, len, query, 1, len)) {
+      inflight_.front().result = line;
     }
   }
 }
 
-// Lutron::readLine() is event driven and listens for full lines of
-// data from the socket. It then calls Lutron::processLine() to determine
-// what the data means, and executes the different types of delayed
-// operations (i.e. later_, pending_, or onPrompt_).
-void Lutron::readLine() {
-  // If we read an entire line earlier, return it now. Trim all newline
-  // characters at front and back of string. As a special case, we also
-  // recognize the command prompt and always return that as if it was
+// Lutron::nextLine() looks for full lines of data in the buffer that
+// Lutron::readLines() has filled from the socket.
+bool Lutron::nextLine(std::string_view& line) {
+  // Skip all newline characters at the front of the buffer. Then find the
+  // end of the line. memchr() is vectorized by the C library, which makes
+  // it the fastest way to scan for the separators. As a special case, we
+  // also recognize the command prompt and always return that as if it was
   // a complete line. For the purposes of this discussion "login: " and
-  // "password: " are also treated as prompts.
-  const std::string user =
-    pending_[inCallback_].size() ?
-    pending_[inCallback_].rbegin()->cmd : "";
-  const std::string SEP("\r\n", 3);
-  const auto skip = std::min(ahead_.size(), ahead_.find_first_not_of(SEP));
-  const auto gnet = ahead_.find(PROMPT, skip);
-  if (gnet < ahead_.find_first_of(SEP, skip)) {
-    if (!inCallback_) {
-      // As long as we regularly see data, we assume that our connection
-      // is still alive.
-      advanceKeepAliveMonitor();
-    }
-  }
-  // In the case of "login: " and "password: ", these special prompts are
-  // stored in "user". If the variable is non-empty, scan the socket for
-  // those strings.
-  auto ws = std::min(gnet == std::string::npos ? gnet : gnet + 6,
-                     ahead_.find_first_of(SEP, skip));
-  if (!user.empty()) {
-    const auto prompt = ahead_.find(user, skip);
-    if (prompt != std::string::npos && prompt+user.size() < ws) {
-      ws = prompt + user.size();
-    }
-  }
-  if (ws != std::string::npos) {
-    // Found a complete line in our buffer. Return it now and keep the
-    // remainder of the buffered data, if any.
-    std::string ret = ahead_.substr(skip, ws - skip);
-    ahead_ = ahead_.substr(std::min(ahead_.size(),
-                                    ahead_.find_first_not_of(SEP, ws)));
-    if (input_) input_(ret != PROMPT ? ret : "");
-    processLine(ret);
-    readLine();
-    return;
+  // "password: " are also treated as prompts, if we expect them.
+  const char *buf = in_.data();
+  while (head_ < tail_ &&
+         (buf[head_] == '\r' || buf[head_] == '\n' || !buf[head_])) {
+    ++head_;
   }
-  if (sock_ < 0) {
-    // If the stream was closed already, return any buffered characters. No
-    // need to scan for newline. But if there is no more unbuffered data,
-    // return an error instead.
-    if (skip >= ahead_.size()) {
-      DBG("Lutron::readLine() -> ERROR");
-      closeSock();
-    } else {
-      std::string ret = ahead_.substr(skip);
-      ahead_.clear();
-      if (input_) input_(ret != PROMPT ? ret : "");
-      processLine(ret);
-      readLine();
+  const std::string_view data(buf + head_, tail_ - head_);
+  size_t len = data.size();
+  for (const char sep : { '\r', '\n', '\0' }) {
+    if (const void *p = memchr(data.data(), sep, len)) {
+      len = (const char *)p - data.data();
     }
-    return;
   }
-  // If we don't have enough data for a full line just yet, read more bytes
-  // from the stream and then try again.
-  event_.removePollFd(sock_);
-  event_.addPollFd(sock_, POLLIN, [=, this](auto) {
-    event_.removePollFd(sock_);
-    char buf[64];
-    const auto rc = read(sock_, buf, sizeof(buf));
-    if (rc <= 0) {
-      // Either end of stream or any other error makes us close the socket.
-      // Please note the "isConnected_" does not yet get reset here.
-      close(sock_);
-      sock_ = -1;
-    } else {
-      ahead_ = ahead_ + std::string(buf, rc);
+  bool found = len < data.size();
+  for (const std::string_view prompt : { std::string_view(PROMPT),
+                                         std::string_view(expect_) }) {
+    if (prompt.empty()) {
+      continue;
     }
-    readLine();
-    return true;
-  });
+    const auto pos = data.substr(0, len).find(prompt);
+    if (pos != data.npos) {
+      len = pos + prompt.size();
+      found = true;
+    }
+  }
+  // A line that doesn't fit into the buffer is returned in pieces, so that
+  // we can keep making progress.
+  if (!found && (data.empty() || data.size() < in_.size())) {
+    return false;
+  }
+  // Found a complete line in our buffer. The view remains valid until we
+  // read more data.
+  line = data.substr(0, len);
+  head_ += len;
+  return true;
 }
 
-void Lutron::pollIn(std::function<bool (pollfd *)> cb) {
-  // If we already have buffered data, we can invoke the callback directly.
-  // Otherwise inform the event loop. No need evaluate the return code from
-  // the callback. Our code always returns false, indicating that the event
-  // was a one-shot and should unregister itself.
-  if (ahead_.empty() && sock_ >= 0) {
-    event_.addPollFd(sock_, POLLIN, cb);
-  } else {
-    cb(nullptr);
+// Lutron::readLines() is event driven and listens for full lines of
+// data from the socket. It then calls Lutron::processLine() to determine
+// what the data means. It runs for as long as the connection is open.
+Task<> Lutron::readLines() {
+  const int fd = sock_;
+  const unsigned generation = generation_;
+
+  // The registration for the socket stays in place for as long as the
+  // connection is open. We always read until the socket has been drained,
+  // which makes it possible to use edge-triggered notifications.
+  event_.addPollFd(fd, POLLIN, [this](auto) {
+    readable_.notify();
+    return true; }, Event::EDGE);
+  std::string_view line;
+  for (;;) {
+    // Dispatch every complete line that we have. Any of our callbacks could
+    // close the connection. If that happens, we have to return right away.
+    while (nextLine(line)) {
+      const auto msg = LutronMessage::parse(line);
+      if (input_) input_(msg);
+      if (generation != generation_) {
+        co_return;
+      }
+      processLine(msg);
+      if (generation != generation_) {
+        co_return;
+      }
+    }
+    // If we don't have enough data for a full line just yet, move the
+    // partial line to the front of the buffer, and read as many bytes as
+    // will fit.
+    if (head_) {
+      memmove(in_.data(), in_.data() + head_, tail_ - head_);
+      tail_ -= head_;
+      head_ = 0;
+    }
+    const auto rc = read(fd, in_.data() + tail_, in_.size() - tail_);
+    if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      co_await readable_;
+      continue;
+    } else if (rc <= 0) {
+      // Either end of stream or any other error makes us close the socket.
+      // But first, return any buffered characters. No need scan for
+      // newline.
+      line = std::string_view(in_.data() + head_, tail_ - head_);
+      if (!line.empty()) {
+        head_ = tail_;
+        const auto msg = LutronMessage::parse(line);
+        if (input_) input_(msg);
+        if (generation != generation_) {
+          co_return;
+        }
+        processLine(msg);
+        if (generation != generation_) {
+          co_return;
+        }
+      }
+      DBG("Lutron::readLines() -> ERROR");
+      closeSock();
+      co_return;
+    }
+    tail_ += rc;
   }
 }
 
@@ -887,16 +1286,24 @@ void Lutron::advanceKeepAliveMonitor() {
   // reopened until someone submits another command.
   if (keepAlive_) {
     event_.removeTimeout(keepAlive_);
-    keepAlive_ = 0;
+    keepAlive_ = {};
   }
   if (sock_ >= 0) {
-    keepAlive_ = event_.addTimeout(KEEPALIVE, [this]() {
-      keepAlive_ = 0;
+    // The probe may go out a little early, when the loop is awake anyway.
+    // It never goes out late, so that the protocol timings don't change.
+    keepAlive_ = event_.addTimeout(KEEPALIVE - KEEPALIVE/5, KEEPALIVE/5,
+                                   [this]() {
+      keepAlive_ = {};
       if (!commandPending()) {
-        if (write(sock_, "\r\n", 2) != 2) {
-          DBG("This is weird. Kernel started throttling TCP packages");
+        // Go through the writer, so that the newline can't end up in the
+        // middle of a command that hasn't been sent in full yet.
+        if (!writer_.write("\r\n")) {
+          DBG("Cannot send keep-alive, connection has failed");
           advanceKeepAliveMonitor();
         } else {
+          // The next command has to wait for our prompt. Otherwise, it
+          // could mistake it for its own.
+          atPrompt_ = false;
           keepAlive_ = event_.addTimeout(KEEPALIVE, [this]() {
             DBG("Keep-alive expired");
             closeSock();
@@ -908,57 +1315,3 @@ void Lutron::advanceKeepAliveMonitor() {
     });
   }
 }
-
-void Lutron::Timeout::set(unsigned tmo, std::function<void (void)> cb) {
-  // Sets up a new timeout handler for running commands. This also allows us
-  // to keep track of finalizers that have to execute when unwinding the
-  // callstack. We can't do this using normal C++ destructors, as a chain
-  // of event-driven callbacks isn't the same as a sequence of nest block
-  // scopes.
-  handle_ = event_.addTimeout(tmo, [=, this]() {
-    clear();
-    if (cb) {
-      cb();
-    }
-  });
-}
-
-void Lutron::Timeout::clear() {
-  // Upon timeout, this method gets called twice. First we get called
-  // before invoking the callback associated with the timeout. This is
-  // necessary, as we want finalizers to execute before the callback.
-  // But then the callback closes the socket, and the closeSock() calls
-  // us a second time. That's fine. The code is deliberately written so
-  // that it is safe to call clear() as many times as desired.
-  if (handle_) {
-    event_.removeTimeout(handle_);
-  }
-  // Execute all finalizers. They have to run before the timeout handling
-  // can do its thing.
-  pop();
-  // Reset state. This makes sure we don't run any timeout related code
-  // multiple times. It also ensures that isArmed() returns the correct
-  // value.
-  self_ = 0;
-  handle_ = 0;
-}
-
-unsigned Lutron::Timeout::push(std::function<void (void)> cb) {
-  // Adds a new finalizer and returns a unique identifier. The stack of
-  // finalizers runs in LIFO order before the timeout handler does its
-  // thing or whenever one or more entries are popped from the stack of
-  // finalizers.
-  finalizers_.push_back(std::make_pair(self_ = next(), cb));
-  return self_;
-}
-
-void Lutron::Timeout::pop(unsigned id) {
-  // Removes entries from the stack of finalizers until we encounter the
-  // one that is specified by the "id". All popped finalizers will get
-  // executed.
-  for (bool done = false; !done && !finalizers_.empty(); ) {
-    finalizers_.back().second();
-    done = finalizers_.back().first == id;
-    finalizers_.pop_back();
-  }
-}
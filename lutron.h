@@ -1,13 +1,26 @@
 #pragma once
 
+#include <netdb.h>
 #include <sys/socket.h>
 
+#include <algorithm>
+#include <array>
+#include <deque>
 #include <functional>
+#include <map>
+#include <memory>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
+#include "callback.h"
 #include "event.h"
+#include "lutronmessage.h"
+#include "task.h"
+#include "writer.h"
 
 
 class Lutron {
@@ -17,89 +30,175 @@ class Lutron {
          const std::string& username = "",
          const std::string& passwd = "");
   ~Lutron();
-  Lutron& oninit(std::function<void (std::function<void ()> cb)> init) {
-    init_ = init; return *this; }
-  Lutron& oninput(std::function<void (const std::string& line)> input) {
-    input_ = input; return *this; }
+  Lutron& oninit(Callback<void (std::function<void ()> cb)> init) {
+    init_ = std::move(init); return *this; }
+  Lutron& oninput(Callback<void (const LutronMessage& msg)> input) {
+    input_ = std::move(input); return *this; }
   Lutron& onclosed(std::function<void ()> closed) {
     closed_ = closed; return *this; }
 
+  // By default, each command waits for the previous one to complete. In
+  // pipelined mode, up to "depth" commands can be in flight at the same
+  // time. The repeater handles them in order, and it terminates each
+  // response with a prompt. That's how responses are matched up with
+  // their commands. Commands that don't follow the regular syntax, or that
+  // don't take any arguments, could confuse this logic. They always wait
+  // until all other commands have completed.
+  Lutron& pipeline(unsigned depth) {
+    depth_ = std::max(depth, 1u); return *this; }
+
+  // Normally, we wait for the "login: " and "password: " prompts before
+  // sending each of the credentials. In fast mode, both go out as soon as
+  // the connection has been established, and we then check that the
+  // repeater still showed all the prompts in the expected order. If it
+  // didn't, we reconnect and permanently fall back to the strict mode.
+  Lutron& fastLogin(bool on) {
+    fastLogin_ = on; return *this; }
+
+  // Commands wait in one of several lanes. Interactive commands always go
+  // out ahead of normal ones, and background commands only go out when
+  // nothing else is waiting. Commands in the same lane execute in order,
+  // but there is no ordering between lanes. An empty command acts as a
+  // barrier for its own lane and for all lanes that are more urgent.
+  enum Priority { INTERACTIVE, NORMAL, BACKGROUND };
+  static const int LANES = 3;
+
   void command(const std::string& cmd,
                std::function<void (const std::string& res)> cb = [](auto){},
-               std::function<void (void)> err = nullptr,
-               bool recurs = false);
+               std::function<void (void)> err = nullptr) {
+    command(NORMAL, cmd, std::move(cb), std::move(err)); }
+  void command(Priority prio, const std::string& cmd,
+               std::function<void (const std::string& res)> cb = [](auto){},
+               std::function<void (void)> err = nullptr);
   void ping(std::function<void (void)> cb = nullptr) {
     command("?SYSTEM,1", cb ? [=](auto) { cb(); }
             : (std::function<void (const std::string&)>)nullptr); }
   void closeSock();
+
+  // Moves an open connection that has already logged in over to another
+  // object, which must not be connected at the time. This only works, if
+  // we are idle. The other object picks up the connection the next time
+  // that it has a command to execute. It skips the login, but it still
+  // runs its "oninit()" callback. Afterwards, this object is closed.
+  // Optionally, the list of outputs that might have changed unnoticed goes
+  // along with the connection. Only the object that actually adopts the
+  // connection can retrieve it with "takeFailover()", and only until the
+  // connection closes.
+  bool handOver(Lutron& to,
+                std::optional<std::vector<int>> failover = std::nullopt);
+  std::optional<std::vector<int>> takeFailover() {
+    return std::exchange(failover_, std::nullopt); }
   bool getConnectedAddr(struct sockaddr& addr, socklen_t& len);
   bool isConnected() { return isConnected_; }
-  bool commandPending() { return inCommand_; }
+  bool commandPending() { return inCommand_ || !inflight_.empty(); }
   void initStillWorking();
 
+  // Every command is timestamped as it moves through the session. Latencies
+  // are kept per class of command (e.g. "?OUTPUT" or "#DEVICE"):
+  //  - "queued" from "command()" until the session picks up the command,
+  //  - "sent" from then until the command has been handed to the socket,
+  //  - "response" from then until the first matching "~" line, if any,
+  //  - "done" from then until the prompt that completes the command,
+  //  - "total" from "command()" until the prompt.
+  // Histograms cover the last one to two STATS_WINDOW periods. The queue
+  // depths are the most commands that were ever waiting in each lane, or
+  // that were in flight at the same time.
+  struct Stats {
+    Event::Histogram queued, sent, response, done, total;
+  };
+  std::map<std::string, Stats> stats() const;
+  size_t maxQueued(Priority prio) const { return maxQueued_[prio]; }
+  size_t maxInflight() const { return maxInflight_; }
+  std::string report() const;
+
  private:
   const char *PROMPT = "GNET> ";
   const int KEEPALIVE = 5*1000;
   const int TMO = 10*1000;
-
-  void checkDelayed(std::function<void ()> next = nullptr);
-  void waitForPrompt(const std::string& prompt,
-                     std::function<void (void)> cb,
-                     std::function<void (void)> err,
-                     bool login = true,
-                     std::string::size_type partial = 0);
-  void sendData(const std::string& data,
-                std::function<void (void)> cb,
-                std::function<void (void)> err,
-                const std::string& prompt = "GNET> ",
-                bool login = true);
-  void login(std::function<void (void)> cb,
-             std::function<void (void)> err);
-  void enterPassword(std::function<void (void)> cb,
-                     std::function<void (void)> err);
-  void processLine(const std::string& line);
-  void readLine();
-  void pollIn(std::function<bool (pollfd *)> cb);
-  void advanceKeepAliveMonitor();
+  const int STAGGER = 250;
+  const unsigned DNS_TTL = 5*60*1000;
+  const uint64_t STATS_WINDOW = 15*60*1000000ull;
+  const char *GATEWAY_CACHE = ".lutron.gateway";
 
   struct Command {
     std::string cmd;
     std::function<void (const std::string&)> cb;
     std::function<void ()> err;
+    std::string result = "";
+    bool failed = false;
+    std::string target = "";
+    Priority prio = NORMAL;
+    bool superseded = false;
+    uint64_t queued = 0, dequeued = 0, written = 0, responded = 0;
   };
 
-  class Timeout {
-  public:
-    Timeout(Event& event) : event_(event), self_(0), handle_(0) { }
-    bool isArmed() { return !!handle_; }
-    unsigned next() { return self_ + 1; }
-    void set(unsigned tmo, std::function<void (void)> cb);
-    void clear();
-    unsigned push(std::function<void (void)> cb);
-    void pop(unsigned id = 0);
-  private:
-    Event& event_;
-    unsigned self_;
-    void *handle_;
-    std::vector<std::pair<unsigned, std::function<void (void)>>> finalizers_;
-  } timeout_;
+  void wakeUp();
+  void checkDelayed();
+  void armWatchdog();
+  void fail(Command& cmd);
+  void report(Command& cmd);
+  void complete();
+  void account(const Command& cmd);
+  static bool canPipeline(const std::string& cmd);
+  static std::string target(const std::string& cmd);
+  bool hasQueued(int queue);
+  Command dequeue(int queue);
+  void shutdown();
+  void disconnect();
+  Task<> session();
+  Task<bool> login();
+  Task<bool> connectTo(const std::string& gateway);
+  Task<std::pair<int, const addrinfo *>> race(
+    const std::vector<const addrinfo *>& candidates);
+  Task<std::string> discover();
+  void probe();
+  void stopDiscovery();
+  std::string lastGateway();
+  void saveGateway(const std::string& gateway);
+  static std::string parseDiscovery(const std::string& resp);
+  Task<bool> enterPassword();
+  Task<bool> waitForPrompt(const char *prompt);
+  Task<bool> sendData(std::string data);
+  Task<> execute(Command& cmd);
+  Task<> readLines();
+  bool nextLine(std::string_view& line);
+  void processLine(const LutronMessage& msg);
+  void advanceKeepAliveMonitor();
 
   Event& event_;
-  std::function<void (const std::string& line)> input_;
-  std::function<void (std::function<void ()> cb)> init_;
+  Callback<void (const LutronMessage& msg)> input_;
+  Callback<void (std::function<void ()> cb)> init_;
   std::function<void (void)> closed_;
   std::string gateway_, g_, username_, passwd_;
-  int sock_, msock_;
-  bool dontfinalize_;
+  int sock_, msock_, adopted_ = -1;
+  std::optional<std::vector<int>> failover_;
   bool isConnected_;
   bool inCommand_;
   bool inCallback_;
   bool initIsBusy_;
+  bool initDone_;
   bool atPrompt_;
-  std::string ahead_;
-  void *keepAlive_;
-  std::vector<Command> later_[2], pending_[2];
-  std::vector<std::function<void ()>> onPrompt_;
+  bool scheduled_;
+  unsigned generation_;
+  std::string expect_;
+  std::array<char, 8192> in_;
+  size_t head_ = 0, tail_ = 0;
+  Event::Handle keepAlive_, watchdog_;
+  std::deque<Command> later_[2][LANES];
+  std::unordered_map<std::string, Command *> targets_[2];
+  Command current_[2];
+  std::deque<Command> inflight_;
+  unsigned depth_ = 1;
+  bool fastLogin_ = false;
+  Signal wake_, prompt_, readable_;
+  Writer writer_;
+  Task<> session_, reader_;
   struct sockaddr_storage addr_;
   socklen_t addrLen_ = 0;
+  std::shared_ptr<addrinfo> resolved_;
+  std::string resolvedName_;
+  unsigned resolvedAt_ = 0;
+  std::map<std::string, Stats> stats_[2];
+  uint64_t statsSince_ = 0;
+  size_t maxQueued_[LANES] = { }, maxInflight_ = 0;
 };
@@ -0,0 +1,85 @@
+#include <algorithm>
+#include <charconv>
+#include <utility>
+
+#include "lutronmessage.h"
+
+
+LutronMessage LutronMessage::parse(std::string_view line) {
+  LutronMessage msg;
+  msg.raw = line;
+  if (line.empty()) {
+    return msg;
+  } else if (line == "GNET> ") {  // Lutron::PROMPT
+    msg.kind = PROMPT;
+    return msg;
+  }
+  msg.kind = OTHER;
+  const auto comma = line.find(',');
+  if (line[0] != '~' || comma == std::string_view::npos) {
+    return msg;
+  }
+  static const std::pair<std::string_view, Kind> kinds[] = {
+    { "OUTPUT", OUTPUT }, { "DEVICE", DEVICE }, { "TIMECLOCK", TIMECLOCK },
+    { "SYSTEM", SYSTEM }, { "ERROR", ERROR } };
+  const auto name = line.substr(1, comma - 1);
+  for (const auto& [ n, k ] : kinds) {
+    if (n == name) {
+      msg.kind = k;
+    }
+  }
+  msg.args = line.substr(comma + 1);
+
+  // Consume one comma-separated field at a time, and convert it to an
+  // integer. Whatever is left over at the end is the value.
+  auto rest = msg.args;
+  const auto field = [&]() {
+    const auto end = rest.find(',');
+    const auto f = rest.substr(0, end);
+    rest = end == std::string_view::npos ? std::string_view()
+                                         : rest.substr(end + 1);
+    int n;
+    const auto [ ptr, ec ] = std::from_chars(f.data(), f.data() + f.size(), n);
+    return ec == std::errc() && ptr == f.data() + f.size() ? n : -1;
+  };
+  switch (msg.kind) {
+  case OUTPUT:
+  case TIMECLOCK:
+    msg.id = field();
+    msg.action = field();
+    break;
+  case DEVICE:
+    msg.id = field();
+    msg.component = field();
+    msg.action = field();
+    break;
+  case SYSTEM:
+  case ERROR:
+    msg.action = field();
+    break;
+  default:
+    return msg;
+  }
+  msg.value = rest;
+  if (!rest.empty() && (msg.kind == OUTPUT || msg.kind == DEVICE)) {
+    msg.level = toLevel(rest);
+  }
+  return msg;
+}
+
+int LutronMessage::toLevel(std::string_view s) {
+  // Levels are usually numbers between 0 and 100 with up to two decimals.
+  // Unlike strtol(), this doesn't need a NUL terminated string.
+  auto ptr = s.data(), end = ptr + s.size();
+  int l = 0;
+  ptr = std::from_chars(ptr, end, l).ptr;
+  l *= 100;
+  if (ptr < end && *ptr == '.' && ++ptr < end &&
+      *ptr >= '0' && *ptr <= '9') {
+    l += 10*(*ptr++ - '0');
+    if (ptr < end && *ptr >= '0' && *ptr <= '9') {
+      l += *ptr - '0';
+    }
+  }
+  return std::max(0, std::min(10000, l));
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <string_view>
+
+
+// A single line of output from the Lutron repeater, split into its fields.
+// Each line is parsed exactly once, as soon as it has been read from the
+// socket, and then handed to all interested parties. Parsing doesn't copy
+// any data. "raw", "args", and "value" point into the receive buffer, and
+// they are only valid until the callback that received the message returns.
+//
+//   ~OUTPUT,<id>,<action>,<value>
+//   ~DEVICE,<id>,<component>,<action>[,<value>]
+//   ~TIMECLOCK,<id>,<action>,<value>
+//   ~SYSTEM,<action>,<value>
+//   ~ERROR,<action>
+//
+// Numeric fields that are missing or malformed are set to -1. "level" is
+// the value converted to a fixed point number with two decimals, and
+// clamped to the range 0..10000. This is the same representation that we
+// use for dimmer levels everywhere else.
+struct LutronMessage {
+  enum Kind {
+    NONE,      // empty line, or a notification without any data
+    PROMPT,    // the "GNET> " prompt
+    OUTPUT,
+    DEVICE,
+    TIMECLOCK,
+    SYSTEM,
+    ERROR,
+    OTHER      // anything else, including the login handshake
+  };
+
+  Kind kind = NONE;
+  int id = -1;
+  int component = -1;
+  int action = -1;
+  int level = -1;
+  std::string_view raw;    // the entire line
+  std::string_view args;   // everything after the first comma
+  std::string_view value;  // everything after the last numeric field
+
+  static LutronMessage parse(std::string_view line);
+  static int toLevel(std::string_view s);
+};
@@ -0,0 +1,206 @@
+#include <stdlib.h>
+
+#include <algorithm>
+#include <memory>
+
+#include "lutronpool.h"
+#include "util.h"
+
+
+LutronPool::LutronPool(Event& event,
+                       const std::string& gateway,
+                       const std::string& username,
+                       const std::string& passwd,
+                       unsigned sessions,
+                       bool standby)
+  : input_(nullptr), shardInit_(nullptr), event_(event),
+    standbyInit_(nullptr), closed_(nullptr) {
+  DBG("LutronPool(" << sessions << " sessions)");
+  for (unsigned i = 0; i < std::max(sessions, 1u); ++i) {
+    sessions_.push_back(
+      std::make_unique<Lutron>(event, gateway, username, passwd));
+    auto& session = *sessions_.back();
+    session.oninput([this, i](const LutronMessage& msg) {
+      if (!i && msg.kind != LutronMessage::NONE) {
+        lastInput_ = Util::millis64();
+      }
+      if (input_) {
+        input_(msg);
+      }
+    });
+    if (i) {
+      session.oninit([this, &session](auto cb) {
+        if (shardInit_) {
+          shardInit_(session, cb);
+        } else {
+          cb();
+        }
+      });
+    }
+  }
+  sessions_[0]->onclosed([this]() {
+    if (closed_) {
+      closed_();
+    }
+    promote();
+  });
+  if (standby) {
+    // The standby session only keeps track of which outputs changed. Its
+    // input is never forwarded, as the first session reports the same
+    // events.
+    standby_ = std::make_unique<Lutron>(event, gateway, username, passwd);
+    standby_->oninit([this](auto cb) {
+      if (standbyInit_) {
+        standbyInit_(*standby_, cb);
+      } else {
+        cb();
+      }
+    });
+    standby_->oninput([this](const LutronMessage& msg) {
+      if (msg.kind == LutronMessage::OUTPUT && msg.id > 0) {
+        changed_[msg.id] = Util::millis64();
+      }
+    });
+    keepStandby();
+  }
+}
+
+LutronPool::~LutronPool() {
+  DBG("~LutronPool()");
+  event_.removeTimeout(standbyCheck_);
+}
+
+LutronPool& LutronPool::pipeline(unsigned depth) {
+  for (auto& session : sessions_) {
+    session->pipeline(depth);
+  }
+  if (standby_) {
+    standby_->pipeline(depth);
+  }
+  return *this;
+}
+
+LutronPool& LutronPool::fastLogin(bool on) {
+  for (auto& session : sessions_) {
+    session->fastLogin(on);
+  }
+  if (standby_) {
+    standby_->fastLogin(on);
+  }
+  return *this;
+}
+
+void LutronPool::command(Lutron::Priority prio, const std::string& cmd,
+                         std::function<void (const std::string& res)> cb,
+                         std::function<void (void)> err) {
+  if (!cmd.empty() || sessions_.size() == 1) {
+    route(cmd).command(prio, cmd, std::move(cb), std::move(err));
+    return;
+  }
+
+  // An empty command has to wait for all the sessions. Once they have all
+  // reached the barrier, invoke exactly one of the callbacks. Only the
+  // first session decides whether the barrier failed. If one of the other
+  // sessions dropped its connection, its commands have already reported
+  // their errors, and they no longer hold up anything.
+  struct Barrier {
+    size_t outstanding;
+    bool failed;
+    std::function<void (const std::string& res)> cb;
+    std::function<void (void)> err;
+  };
+  auto barrier = std::make_shared<Barrier>(
+    Barrier{sessions_.size(), false, std::move(cb), std::move(err)});
+  const auto done = [barrier]() {
+    if (--barrier->outstanding) {
+      return;
+    }
+    if (!barrier->failed && barrier->cb) {
+      barrier->cb("");
+    } else if (barrier->failed && barrier->err) {
+      barrier->err();
+    }
+  };
+  for (auto& session : sessions_) {
+    const bool first = &session == &sessions_[0];
+    session->command(prio, "", [done](auto) { done(); },
+                     [barrier, done, first]() {
+                       barrier->failed |= first;
+                       done(); });
+  }
+}
+
+void LutronPool::closeSock() {
+  for (auto& session : sessions_) {
+    session->closeSock();
+  }
+}
+
+bool LutronPool::commandPending() {
+  return std::any_of(sessions_.begin(), sessions_.end(),
+                     [](auto& session) { return session->commandPending(); });
+}
+
+std::string LutronPool::report() const {
+  if (sessions_.size() == 1) {
+    return sessions_[0]->report();
+  }
+  std::string ret;
+  for (size_t i = 0; i < sessions_.size(); ++i) {
+    ret += "lutron session #" + std::to_string(i) + "\n" +
+           sessions_[i]->report();
+  }
+  return ret;
+}
+
+void LutronPool::promote() {
+  // The first session just closed. If the standby session is ready, it
+  // takes over right away. Outputs that changed while the first session
+  // might no longer have been receiving anything need to be queried again.
+  // Everything else is still up to date. The list of these outputs goes
+  // along with the connection. If the adopted connection fails before it
+  // is initialized, the next regular login does a full refresh instead.
+  if (!standby_) {
+    return;
+  }
+  const auto since = lastInput_ - std::min(lastInput_, GAP_MARGIN);
+  std::vector<int> changed;
+  for (const auto& [ id, when ] : changed_) {
+    if (when >= since) {
+      changed.push_back(id);
+    }
+  }
+  if (!standby_->handOver(*sessions_[0], std::move(changed))) {
+    return;
+  }
+  DBG("Promoted standby session");
+  changed_.clear();
+  sessions_[0]->ping();
+  standby_->ping();
+}
+
+void LutronPool::keepStandby() {
+  // Once connected, the standby session keeps its connection alive by
+  // itself. But if it ever closes, or if it took over for the first
+  // session, open a new connection in the background.
+  if (!standby_->isConnected() && !standby_->commandPending()) {
+    standby_->ping();
+  }
+  standbyCheck_ = event_.addTimeout(STANDBY_CHECK, STANDBY_CHECK/5,
+                                    [this]() { keepStandby(); });
+}
+
+Lutron& LutronPool::route(const std::string& cmd) {
+  // Commands look like "#OUTPUT,<id>,..." or "?DEVICE,<id>,...". Pick the
+  // session from the integration id, so that all commands for the same
+  // device stay in order. Everything else goes to the first session.
+  if (sessions_.size() > 1 && (cmd[0] == '#' || cmd[0] == '?') &&
+      (!cmd.compare(1, 7, "OUTPUT,") || !cmd.compare(1, 7, "DEVICE,"))) {
+    char *endPtr;
+    const long id = strtol(cmd.c_str() + 8, &endPtr, 10);
+    if (endPtr != cmd.c_str() + 8 && id > 0) {
+      return *sessions_[id % sessions_.size()];
+    }
+  }
+  return *sessions_[0];
+}
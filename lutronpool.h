@@ -0,0 +1,100 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "callback.h"
+#include "event.h"
+#include "lutron.h"
+
+
+// The main repeater accepts several integration sessions at the same time.
+// "LutronPool" logs into more than one of them, and spreads the commands
+// across all sessions. This helps with large bursts of queries, such as
+// the ones we send after reconnecting.
+// The first session is special. It is the only one that should have
+// monitoring enabled, and it is the one that reports unsolicited events,
+// connection state, and the address of the repeater. All other sessions
+// are initialized by the "onshardinit()" callback, which should turn off
+// all monitoring. Otherwise, the same events would be reported repeatedly.
+// Commands that refer to an integration id always go to the same session,
+// so that they execute in the order in which they were issued. Commands
+// without an id go to the first session. Empty commands are barriers, and
+// they wait for all sessions.
+// Optionally, there also is a standby session. It logs in ahead of time,
+// and then sits idle. When the first session closes, the standby session
+// immediately hands over its connection, and a new standby session starts
+// in the background. The standby session only watches for output changes.
+// After a failover, "takeFailover()" reports the outputs that changed
+// since the first session last heard from the repeater.
+class LutronPool {
+ public:
+  LutronPool(Event& event,
+             const std::string& gateway = "",
+             const std::string& username = "",
+             const std::string& passwd = "",
+             unsigned sessions = 1,
+             bool standby = false);
+  ~LutronPool();
+  LutronPool& oninit(Callback<void (std::function<void ()> cb)> init) {
+    sessions_[0]->oninit(std::move(init)); return *this; }
+  LutronPool& onshardinit(
+    std::function<void (Lutron& session, std::function<void ()> cb)> init) {
+    shardInit_ = std::move(init); return *this; }
+  LutronPool& oninput(Callback<void (const LutronMessage& msg)> input) {
+    input_ = std::move(input); return *this; }
+  LutronPool& onstandbyinit(
+    std::function<void (Lutron& session, std::function<void ()> cb)> init) {
+    standbyInit_ = std::move(init); return *this; }
+  LutronPool& onclosed(std::function<void ()> closed) {
+    closed_ = std::move(closed); return *this; }
+  LutronPool& pipeline(unsigned depth);
+  LutronPool& fastLogin(bool on);
+
+  void command(const std::string& cmd,
+               std::function<void (const std::string& res)> cb = [](auto){},
+               std::function<void (void)> err = nullptr) {
+    command(Lutron::NORMAL, cmd, std::move(cb), std::move(err)); }
+  void command(Lutron::Priority prio, const std::string& cmd,
+               std::function<void (const std::string& res)> cb = [](auto){},
+               std::function<void (void)> err = nullptr);
+  void ping(std::function<void (void)> cb = nullptr) {
+    sessions_[0]->ping(std::move(cb)); }
+  void closeSock();
+  bool getConnectedAddr(struct sockaddr& addr, socklen_t& len) {
+    return sessions_[0]->getConnectedAddr(addr, len); }
+  bool isConnected() { return sessions_[0]->isConnected(); }
+  bool commandPending();
+  void initStillWorking() { sessions_[0]->initStillWorking(); }
+  std::string report() const;
+  std::optional<std::vector<int>> takeFailover() {
+    return sessions_[0]->takeFailover(); }
+
+ private:
+  const unsigned STANDBY_CHECK = 5000;
+  const uint64_t GAP_MARGIN = 1000;
+
+  Lutron& route(const std::string& cmd);
+  void promote();
+  void keepStandby();
+
+  Callback<void (const LutronMessage& msg)> input_;
+  std::function<void (Lutron& session, std::function<void ()> cb)> shardInit_;
+  std::vector<std::unique_ptr<Lutron>> sessions_;
+  Event& event_;
+  std::function<void (Lutron& session, std::function<void ()> cb)>
+    standbyInit_;
+  std::function<void ()> closed_;
+  std::unique_ptr<Lutron> standby_;
+  Event::Handle standbyCheck_;
+  std::map<int, uint64_t> changed_;
+  uint64_t lastInput_ = 0;
+};
@@ -1,6 +1,9 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <math.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/signalfd.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -14,6 +17,7 @@ using json = nlohmann::json;
 
 #include "dmx.h"
 #include "event.h"
+#include "pool.h"
 #include "radiora2.h"
 #include "relay.h"
 #include "util.h"
@@ -56,10 +60,10 @@ static void setDMX(DMX& dmx, const json& dimmer, int level, bool fade) {
 }
 
 static void readLine(RadioRA2& ra2, DMX& dmx, Relay& relay,
-                     const std::string& line, const std::string& context,
+                     const LutronMessage& msg, std::string_view context,
                      bool fade) {
-  DBG("readLine(\"" << line << "\", \"" << context << "\")");
-  if (Util::starts_with(line, "~OUTPUT,")) {
+  DBG("readLine(\"" << msg.raw << "\", \"" << context << "\")");
+  if (msg.kind == LutronMessage::OUTPUT) {
     // When an output device changes levels, we expect a line of the form
     // "~OUTPUT,<dev>,1,<level>". If this was a dummy device that stands in for
     // a DMX load, the user can specify the DMX info in the device name.
@@ -68,32 +72,27 @@ static void readLine(RadioRA2& ra2, DMX& dmx, Relay& relay,
     // The additional information needed is provided to us in the "context".
     // A ":" after the device name includes the JSON string that we
     // subsequently need to pass to setDMX().
-    auto comma = strchr(&line[8], ',');
-    if (!memcmp(",1,", comma, 3)) {
+    if (msg.action == 1) {
       // Check whether the "context" references a DMX load.
       auto args = context.find(':');
       if (args != std::string::npos) {
         // Lutron outputs the level as a number in the range 0..100 with two
-        // decimals precision. Convert it to an integer in the range 0..10000.
-        int level = 100*atoi(comma + 3);
-        auto decimal = strchr(comma + 3, '.');
-        if (decimal && decimal[1] >= '0' && decimal[1] <= '9') {
-          level += 10*(decimal[1] - '0');
-          if (decimal[2] >= '0' && decimal[2] <= '9') {
-            level += decimal[2] - '0';
-          }
-        }
-        if (context[args + 1] == '[') {
+        // decimals precision. The parser already converted it to an integer
+        // in the range 0..10000.
+        const int level = std::max(msg.level, 0);
+        if (context.substr(args + 1).starts_with('[')) {
           DBG("Found in-line DMX info");
-          setDMX(dmx, json::parse("[" + context.substr(args + 1) + "]"),
-                 std::min(std::max(0, level), 10000), fade);
+          setDMX(dmx,
+                 json::parse(fmt::format("[{}]", context.substr(args + 1))),
+                 level, fade);
         } else if (initialized) {
           // Some dimmers are supposed to be darker at night and brighter
           // during the day. A ":<low>/<high>/<from>-<to>" parameter can
           // override the Lutron defaults.
+          const std::string params(context.substr(args + 1));
           char *endptr;
           errno = 0;
-          auto low  = strtol(&context[args + 1], &endptr, 0);
+          auto low  = strtol(params.c_str(), &endptr, 0);
           auto hi   = strtol(*endptr ? endptr + 1 : "", &endptr, 0);
           auto from = strtol(*endptr ? endptr + 1 : "", &endptr, 0);
           auto to   = strtol(*endptr ? endptr + 1 : "", &endptr, 0);
@@ -104,7 +103,7 @@ static void readLine(RadioRA2& ra2, DMX& dmx, Relay& relay,
             int now = Util::timeOfDay();
             if ((now >= from && now < to) == (to > from)) {
               static std::map<int, int> suppress;
-              int id = atoi(std::string(line, 8, comma-&line[8]).c_str());
+              const int id = msg.id;
               const auto it = suppress.find(id);
               if (it == suppress.end() || Util::millis() - it->second > 2000) {
                 ra2.command(fmt::format("#OUTPUT,{},1,{}.00", id, hi));
@@ -115,9 +114,9 @@ static void readLine(RadioRA2& ra2, DMX& dmx, Relay& relay,
         }
       }
     }
-  } else if (Util::starts_with(line, "~DEVICE,") &&
-             Util::ends_with(line, ",3")) {
-    const auto dev = atoi(&line[8]);
+  } else if (msg.kind == LutronMessage::DEVICE && msg.action == 3 &&
+             msg.value.empty()) {
+    const auto dev = msg.id;
     // Pico remotes aren't output devices, but we can track their buttons and
     // make them behave like virtual key events for a keypad. Again, this
     // information can be encoded using the Pico label.
@@ -129,7 +128,7 @@ static void readLine(RadioRA2& ra2, DMX& dmx, Relay& relay,
     if (args != std::string::npos) {
       switch (ra2.deviceType(dev)) {
       case RadioRA2::DEV_PICO_KEYPAD: {
-        auto json = json::parse("[" + context.substr(args + 1) + "]");
+        auto json = json::parse(fmt::format("[{}]", context.substr(args + 1)));
         switch (json.size()) {
         case 1: // This button controls an output and behaves like "TOGGLE"
                 // directive in a "site.json" file.
@@ -139,8 +138,10 @@ static void readLine(RadioRA2& ra2, DMX& dmx, Relay& relay,
                 // and behaves like the "DEVICE" directive in a "site.json" file.
           const int otherKp = json[0].get<int>();
           const int otherBt = json[1].get<int>();
-          ra2.command(fmt::format("#DEVICE,{},{},3", otherKp, otherBt));
-          ra2.command(fmt::format("#DEVICE,{},{},4", otherKp, otherBt));
+          ra2.command(Lutron::INTERACTIVE,
+                      fmt::format("#DEVICE,{},{},3", otherKp, otherBt));
+          ra2.command(Lutron::INTERACTIVE,
+                      fmt::format("#DEVICE,{},{},4", otherKp, otherBt));
           break; }
         default:
           break;
@@ -148,7 +149,7 @@ static void readLine(RadioRA2& ra2, DMX& dmx, Relay& relay,
         break; }
       case RadioRA2::DEV_SEETOUCH_KEYPAD:
       case RadioRA2::DEV_HYBRID_SEETOUCH_KEYPAD: {
-        std::string cond = Util::trim(context.substr(args + 1));
+        std::string cond = Util::trim(std::string(context.substr(args + 1)));
         const bool sense = !(cond.size() > 0 && cond[0] == '!');
         if (!sense) {
           cond.erase(0, 1);
@@ -174,22 +175,62 @@ static void readLine(RadioRA2& ra2, DMX& dmx, Relay& relay,
   }
 }
 
-static void runScript(RadioRA2& ra2, const std::string& script) {
+static void runScript(Event& event, Pool& scripts, RadioRA2& ra2,
+                      const std::string& script) {
+  // Scripts can take a long time to run. Execute them on a worker thread and
+  // forward each line of output to the event loop as soon as it arrives.
+  // They have a pool with a single thread to themselves. That way, they
+  // run one at a time and in order, and they can't hold up other users of
+  // the shared pool.
+  // We can't use popen(), as the event loop could already be changing the
+  // environment for the next script by the time the worker gets to run.
+  // Instead, take a snapshot of the environment and spawn the shell directly.
   ra2.updateEnvironment();
-  FILE *fp = popen(script.c_str(), "r");
-  char *line = nullptr;
-  size_t len;
-  while (fp && (len = 0, getline(&line, &len, fp)) >= 0) {
-    ra2.command(Util::trim(line));
-    free(line);
-    line = nullptr;
+  std::vector<std::string> env;
+  for (char **e = environ; *e; ++e) {
+    env.push_back(*e);
   }
-  free(line);
-  pclose(fp);
+  scripts.run([&event, &ra2, script, env = std::move(env)]() {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC)) {
+      return;
+    }
+    std::vector<char *> envp;
+    for (const auto& e : env) {
+      envp.push_back((char *)e.c_str());
+    }
+    envp.push_back(nullptr);
+    const char *argv[] = { "sh", "-c", script.c_str(), nullptr };
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], 1);
+    pid_t pid;
+    const bool spawned = !posix_spawn(&pid, "/bin/sh", &actions, nullptr,
+                                      (char **)argv, envp.data());
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+    FILE *fp = fdopen(fds[0], "r");
+    char *line = nullptr;
+    size_t len;
+    while (fp && (len = 0, getline(&line, &len, fp)) >= 0) {
+      event.post([&ra2, cmd = Util::trim(line)]() { ra2.command(cmd); });
+      free(line);
+      line = nullptr;
+    }
+    free(line);
+    if (fp) {
+      fclose(fp);
+    } else {
+      close(fds[0]);
+    }
+    if (spawned) {
+      waitpid(pid, nullptr, 0);
+    }
+  }, []() { });
 }
 
-static void augmentConfig(const json& site, RadioRA2& ra2, DMX& dmx,
-                          Relay& relay) {
+static void augmentConfig(const json& site, Event& event, Pool& scripts,
+                          RadioRA2& ra2, DMX& dmx, Relay& relay) {
   // Out of the box, our code does not implement any policy and won't really
   // change the behavior of the Lutron device. But given a "site.json"
   // configuration file, it can integrate non-Lutron devices into the
@@ -217,7 +258,8 @@ static void augmentConfig(const json& site, RadioRA2& ra2, DMX& dmx,
     const auto& watch = site["WATCH"];
     for (const auto& [id_, script] : watch.items()) {
       if (id_ == "TIMECLOCK") {
-        ra2.monitorTimeclock([&ra2, &script](const std::string& s) {
+        ra2.monitorTimeclock([&event, &scripts, &ra2, &script](
+                               const std::string& s) {
             unsetenv("KEYPAD");
             unsetenv("BUTTON");
             unsetenv("ON");
@@ -227,11 +269,12 @@ static void augmentConfig(const json& site, RadioRA2& ra2, DMX& dmx,
             unsetenv("LEVEL");
             unsetenv("level");
             setenv("TIMECLOCK", s.c_str(), 1);
-            runScript(ra2, script);
+            runScript(event, scripts, ra2, script);
           });
       } else {
         const auto id = atoi(id_.c_str());
-        ra2.monitorOutput(id, [id, &ra2, &script](int level) {
+        ra2.monitorOutput(id, [id, &event, &scripts, &ra2, &script](
+                                int level) {
             unsetenv("KEYPAD");
             unsetenv("BUTTON");
             unsetenv("ON");
@@ -242,7 +285,7 @@ static void augmentConfig(const json& site, RadioRA2& ra2, DMX& dmx,
             setenv("LEVEL",
                    fmt::format("{}.{:02}", level/100, level%100).c_str(), 1);
             setenv("level", fmt::format("{}", level).c_str(), 1);
-            runScript(ra2, script);
+            runScript(event, scripts, ra2, script);
           });
       }
     }
@@ -298,7 +341,7 @@ static void augmentConfig(const json& site, RadioRA2& ra2, DMX& dmx,
                 ra2.addOutput(
                   fmt::format("{}{}", RadioRA2::ALIAS, out.get<int>()),
                   [&, out](int level, auto) {
-                    ra2.command(fmt::format(
+                    ra2.command(Lutron::INTERACTIVE, fmt::format(
                       "#OUTPUT,{},1,{}.{:02}",
                       out.get<int>(), level/100, level%100));
                   }), 100, true);
@@ -312,8 +355,10 @@ static void augmentConfig(const json& site, RadioRA2& ra2, DMX& dmx,
               atoi(kp.c_str()), atoi(bt.c_str()),
               ra2.addOutput(fmt::format("DEV:{}/{}", otherKp, otherBt),
                 [&, otherKp, otherBt](auto, auto) {
-                  ra2.command(fmt::format("#DEVICE,{},{},3",otherKp,otherBt));
-                  ra2.command(fmt::format("#DEVICE,{},{},4",otherKp,otherBt));
+                  ra2.command(Lutron::INTERACTIVE,
+                    fmt::format("#DEVICE,{},{},3", otherKp, otherBt));
+                  ra2.command(Lutron::INTERACTIVE,
+                    fmt::format("#DEVICE,{},{},4", otherKp, otherBt));
                 }), 0);
           } else if (at == "SCRIPT") {
             // Sometimes, none of the built-in rules can do the job. Branch out
@@ -322,7 +367,8 @@ static void augmentConfig(const json& site, RadioRA2& ra2, DMX& dmx,
             if (!script.empty()) {
               ra2.addButtonListener(
                 atoi(kp.c_str()), atoi(bt.c_str()),
-                [script, &ra2](int kp, int bt, bool on, bool isLong, int num) {
+                [script, &event, &scripts, &ra2](int kp, int bt, bool on,
+                                                 bool isLong, int num) {
                   unsetenv("TIMECLOCK");
                   unsetenv("OUTPUT");
                   unsetenv("LEVEL");
@@ -333,7 +379,7 @@ static void augmentConfig(const json& site, RadioRA2& ra2, DMX& dmx,
                   else      unsetenv("LONG");
                   if (num) setenv("NUMTAPS", fmt::format("{}", num).c_str(), 1);
                   else   unsetenv("NUMTAPS");
-                  runScript(ra2, script);
+                  runScript(event, scripts, ra2, script);
                 });
             }
           } else if (at == "RELAY" && site.contains("GPIO")) {
@@ -440,6 +486,29 @@ static void dmxRemoteServer(Event& event) {
 #endif
 }
 
+static void dumpStatsOnSignal(Event& event,
+                              const std::function<std::string ()>& more) {
+  // Sending SIGUSR1 to the server process dumps latency statistics for the
+  // event loop and for the commands sent to the Lutron repeater. This helps
+  // with finding callbacks that block for too long, and with tuning the
+  // command queue. The signal has to be blocked before any threads start.
+  // So, the Lutron statistics are filled in later through "more()".
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGUSR1);
+  if (sigprocmask(SIG_BLOCK, &mask, nullptr)) {
+    return;
+  }
+  const int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  event.addPollFd(fd, POLLIN, [&event, &more, fd](auto) {
+    signalfd_siginfo info;
+    while (read(fd, &info, sizeof(info)) == sizeof(info)) { }
+    const auto report = event.report() + (more ? more() : "");
+    if (write(2, report.c_str(), report.size()) < 0) { }
+    return true;
+  });
+}
+
 static std::vector<int> keypadOrder(const json& site, const RadioRA2& ra2) {
   // The "KEYPAD ORDER" parameter is optional and sets a prefered display
   // order for the keypads in the web UI.
@@ -482,7 +551,10 @@ static void server() {
   // Create all the different objects that make up our server and connect
   // them to each other. Then enter the event loop.
   Event event;
+  Pool scripts(event, 1);
   dmxRemoteServer(event); // For debugging purposes only
+  std::function<std::string ()> lutronStats;
+  dumpStatsOnSignal(event, lutronStats);
 
   DBG("Starting...");
   DMX dmx(
@@ -493,10 +565,14 @@ static void server() {
   RadioRA2 ra2(
     event, site.contains("REPEATER") ? site["REPEATER"].get<std::string>() : "",
     site.contains("USER") ? site["USER"].get<std::string>() : "",
-    site.contains("PASSWORD") ? site["PASSWORD"].get<std::string>() : "");
-  ra2.oninit([&]() { augmentConfig(site, ra2, dmx, relay); initialized = true;})
-     .oninput([&](const std::string& line, const std::string&context,bool fade){
-                readLine(ra2, dmx, relay, line, context, fade); })
+    site.contains("PASSWORD") ? site["PASSWORD"].get<std::string>() : "",
+    site.contains("SESSIONS") ? site["SESSIONS"].get<int>() : 1,
+    site.contains("STANDBY") && site["STANDBY"].get<bool>());
+  ra2.oninit([&]() { augmentConfig(site, event, scripts, ra2, dmx, relay);
+                     initialized = true; })
+     .oninput([&](const LutronMessage& msg, std::string_view context,
+                  bool fade) {
+                readLine(ra2, dmx, relay, msg, context, fade); })
      .onledstate([&](int kp, int led, bool state, int level) {
                    updateUI(ws, event, kp, led, state, level); })
      // Communicate with parent process. This allows the watchdog
@@ -506,11 +582,13 @@ static void server() {
      .onheartbeat([](){ if (childFd[1] >= 0 && write(childFd[1], "", 1));})
      .onschemainvalid([](){ if (childFd[1] < 0 || !write(childFd[1], "\1", 1)) {
            DBG("Stale cached data"); _exit(1);}});
+  lutronStats = [&]() { return ra2.report(); };
 
   WS ws_(&event,
          site.contains("HTTP PORT") ? site["HTTP PORT"].get<int>() : 8080);
   ws_.onkeypadreq([&]() { return ra2.getKeypads(keypadOrder(site, ra2)); })
-     .oncommand([&](const std::string& s) { ra2.command(s); });
+     .oncommand([&](const std::string& s) {
+       ra2.command(Lutron::INTERACTIVE, s); });
   ws = &ws_;
   event.loop();
 }
@@ -538,7 +616,7 @@ int main(int argc, char *argv[]) {
       close(childFd[1]);
       Event event;
       bool restart = false;
-      void *tmo = nullptr;
+      Event::Handle tmo;
       const auto resetTmo = [&]() {
         event.removeTimeout(tmo);
         tmo = event.addTimeout(120*1000, [&]() {
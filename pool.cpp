@@ -0,0 +1,69 @@
+#include "pool.h"
+#include "util.h"
+
+
+Pool::Pool(Event& event, unsigned maxThreads)
+  : event_(event), maxThreads_(std::max(1u, maxThreads)) {
+}
+
+Pool::~Pool() {
+  // Let the workers drain the queue of jobs, then wait for them to exit.
+  // Their results are delivered by the event loop as usual.
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    done_ = true;
+  }
+  cond_.notify_all();
+  for (auto& thread : threads_) {
+    thread.join();
+  }
+}
+
+void Pool::submit(Callback<void ()> work, uintptr_t serial) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    jobs_.push_back(Job{ serial, std::move(work) });
+    // Start another thread, if all existing threads are busy and we haven't
+    // reached our limit yet.
+    if (!idle_ && threads_.size() < maxThreads_) {
+      DBG("Starting worker thread #" << threads_.size() + 1);
+      threads_.emplace_back([this]() { worker(); });
+    }
+  }
+  cond_.notify_one();
+}
+
+void Pool::worker() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    // Find the first job that isn't blocked by an earlier job with the same
+    // serial key. The queue is short, so a linear scan is fine.
+    auto it = jobs_.begin();
+    while (it != jobs_.end() && it->serial && busy_.count(it->serial)) {
+      ++it;
+    }
+    if (it == jobs_.end()) {
+      if (done_ && jobs_.empty()) {
+        return;
+      }
+      ++idle_;
+      cond_.wait(lock);
+      --idle_;
+      continue;
+    }
+    Job job = std::move(*it);
+    jobs_.erase(it);
+    if (job.serial) {
+      busy_.insert(job.serial);
+    }
+    lock.unlock();
+    job.work();
+    job.work = nullptr;
+    lock.lock();
+    if (job.serial) {
+      // Jobs that were waiting for this one can now run.
+      busy_.erase(job.serial);
+      cond_.notify_all();
+    }
+  }
+}
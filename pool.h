@@ -0,0 +1,140 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <source_location>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "callback.h"
+#include "event.h"
+#include "task.h"
+
+
+// A small, bounded pool of worker threads for operations that would
+// otherwise block the event loop (e.g. DNS lookups, parsing large files, or
+// slow device I/O). Work is submitted from the event loop's thread, and the
+// continuation gets posted back to the same thread once the work is done.
+// Threads are only started when needed, so that programs that never use
+// the pool don't pay for it.
+class Pool {
+ public:
+  Pool(Event& event, unsigned maxThreads = 4);
+  ~Pool();
+
+  // Runs "work" on a worker thread, then passes its result to "done" on the
+  // event loop's thread. Jobs that share the same non-zero "serial" key never
+  // run concurrently and always execute in the order they were submitted.
+  template <class Work, class Done>
+  void run(Work work, Done done, uintptr_t serial = 0,
+           std::source_location loc = std::source_location::current()) {
+    using R = std::invoke_result_t<Work&>;
+    event_.retain();
+    // The continuation only refers to the event loop, as results can still
+    // be delivered after the pool has been destroyed.
+    submit([&event = event_, work = std::move(work), done = std::move(done),
+            loc]() mutable {
+      if constexpr (std::is_void_v<R>) {
+        work();
+        event.post([&event, done = std::move(done)]() mutable {
+          event.release();
+          done(); }, loc);
+      } else {
+        event.post([&event, done = std::move(done), res = work()]() mutable {
+          event.release();
+          done(std::move(res)); }, loc);
+      }
+    }, serial);
+  }
+
+  // Coroutine version of run(). "co_await pool.async(work)" suspends the
+  // task until "work" has completed on a worker thread, and then returns
+  // its result. If the task gets cancelled in the meantime, the result is
+  // silently discarded. So, it should clean up after itself (e.g. by using
+  // a smart pointer).
+  template <class Work> class Async;
+  template <class Work>
+  Async<Work> async(Work work, uintptr_t serial = 0,
+                    std::source_location loc=std::source_location::current()) {
+    return Async<Work>(*this, std::move(work), serial, loc);
+  }
+
+ private:
+  struct Job {
+    uintptr_t serial;
+    Callback<void ()> work;
+  };
+
+  void submit(Callback<void ()> work, uintptr_t serial);
+  void worker();
+
+  Event& event_;
+  const unsigned maxThreads_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::deque<Job> jobs_;
+  std::set<uintptr_t> busy_;
+  std::vector<std::thread> threads_;
+  unsigned idle_ = 0;
+  bool done_ = false;
+};
+
+template <class Work>
+class Pool::Async {
+ public:
+  using R = std::invoke_result_t<Work&>;
+
+  Async(Pool& pool, Work work, uintptr_t serial, std::source_location loc)
+    : pool_(pool), work_(std::move(work)), serial_(serial), loc_(loc),
+      state_(std::make_shared<State>()) { }
+  Async(const Async&) = delete;
+  ~Async() { state_->cancelled = true; }
+
+  bool await_ready() { return false; }
+  template <class P>
+  void await_suspend(std::coroutine_handle<P> coro) {
+    state_->promise = &coro.promise();
+    state_->coro = coro;
+    if constexpr (std::is_void_v<R>) {
+      pool_.run(std::move(work_), [state = state_]() {
+        if (!state->cancelled) {
+          state->result.emplace(true);
+          TaskPromise::resume(state->promise, state->coro);
+        } }, serial_, loc_);
+    } else {
+      pool_.run(std::move(work_), [state = state_](R res) {
+        if (!state->cancelled) {
+          state->result.emplace(std::move(res));
+          TaskPromise::resume(state->promise, state->coro);
+        } }, serial_, loc_);
+    }
+  }
+  R await_resume() {
+    if constexpr (!std::is_void_v<R>) {
+      return std::move(*state_->result);
+    }
+  }
+
+ private:
+  // The continuation can run after the awaiter is gone, so the state that
+  // it shares with the awaiter has to be reference counted.
+  struct State {
+    std::optional<std::conditional_t<std::is_void_v<R>, bool, R>> result;
+    TaskPromise *promise = nullptr;
+    std::coroutine_handle<> coro;
+    bool cancelled = false;
+  };
+
+  Pool& pool_;
+  Work work_;
+  uintptr_t serial_;
+  std::source_location loc_;
+  std::shared_ptr<State> state_;
+};
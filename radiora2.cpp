@@ -11,21 +11,23 @@
 #include <sstream>
 
 #include "lutron.h"
+#include "pool.h"
 #include "radiora2.h"
 #include "util.h"
 
 
 RadioRA2::RadioRA2(Event& event, const std::string& gateway,
-                   const std::string& username, const std::string& password)
+                   const std::string& username, const std::string& password,
+                   unsigned sessions, bool standby)
   : event_(event),
-    lutron_(event, gateway, username, password),
+    lutron_(event, gateway, username, password, sessions, standby),
     initialized_(false),
     init_(),
     input_(nullptr),
     ledState_(nullptr),
     hb_(nullptr),
     schemaInvalid_(nullptr),
-    recompute_(0),
+    recompute_(),
     reconnect_(SHORT_REOPEN_TMO),
     checkStarted_(0),
     checkFinished_(0),
@@ -33,9 +35,20 @@ RadioRA2::RadioRA2(Event& event, const std::string& gateway,
     schemaSock_(-1),
     timeclockMonitor_([](auto){}) {
   setlocale(LC_NUMERIC, "C");
+  // Refreshing the state of all outputs and LEDs takes hundreds of
+  // queries. Keep several of them in flight at a time. This also sends all
+  // the "#MONITORING" commands back to back, when the connection opens.
+  // Logging in doesn't wait for each prompt, unless the repeater turns out
+  // not to support that.
   lutron_.oninit([this](auto cb) { init(cb); })
-         .oninput([this](const std::string& line) { readLine(line); })
-         .onclosed([this]() { closed(); });
+         .onshardinit([this](auto& session, auto cb) {
+           initShard(session, cb); })
+         .onstandbyinit([this](auto& session, auto cb) {
+           initStandby(session, cb); })
+         .oninput([this](const LutronMessage& msg) { readLine(msg); })
+         .onclosed([this]() { closed(); })
+         .pipeline(PIPELINE)
+         .fastLogin(true);
 
   // The health check not only makes sure that we re-establish a connection
   // whenever it fails, but it also leaves a persistent object that keeps the
@@ -67,6 +80,8 @@ void RadioRA2::healthCheck() {
     } else if (checkFinished_ &&
                (now - checkFinished_) > ALIVE_INTERVAL) {
       checkStarted_ = now;
+      DBG("Callbacks stored inline: " << CallbackStats::inlined <<
+          ", heap allocated: " << CallbackStats::allocated);
       lutron_.ping([this]() {
         checkFinished_ = Util::millis();
         checkStarted_ = 0; });
@@ -78,29 +93,32 @@ void RadioRA2::healthCheck() {
       for (const auto& [ _, dev ] : devices_) {
         for (const auto& [ _, btn ] : dev.components) {
           if (btn.uncertain) {
-            command(fmt::format("#DEVICE,{},{},9,{}",
+            command(Lutron::BACKGROUND,
+                    fmt::format("#DEVICE,{},{},9,{}",
                                 dev.id, btn.led, btn.ledState ? 1 : 0));
           }
         }
       }
     }
   }
-  event_.addTimeout(reconnect_, [this]() { healthCheck(); });
+  // Allow the health check to run a little early, but never late.
+  event_.addTimeout(reconnect_ - reconnect_/5, reconnect_/5,
+                    [this]() { healthCheck(); });
 }
 
-void RadioRA2::readLine(const std::string& line) {
+void RadioRA2::readLine(const LutronMessage& msg) {
   if (hb_) {
     hb_();
   }
-  if (!line.size()) {
+  if (msg.kind == LutronMessage::NONE || msg.kind == LutronMessage::PROMPT) {
     return;
   }
-  DBGc(2, "Read line: \"" << line << "\"");
+  DBGc(2, "Read line: \"" << msg.raw << "\"");
   bool suppressed = false;
-  std::string context;
+  std::string_view context;
   // Received an update about a device. We are primarily interested in LEDs
   // and in light fixtures.
-  if (Util::starts_with(line, "~DEVICE,")) {
+  if (msg.kind == LutronMessage::DEVICE) {
     // We find out about LEDs with a line of the form
     //
     //   ~DEVICE,${IntegrationID},${ComponentNumber},9,${State}
@@ -113,17 +131,16 @@ void RadioRA2::readLine(const std::string& line) {
     //   ~DEVICE,${IntegrationID},${ComponentNumber},[3, 4]
     //
     // The former is a button down event, and the latter a button up.
-    char *endPtr;
     // Find keypad that matches the ${IntegrationID}.
-    const auto& dev = devices_.find((int)strtol(line.c_str() + 8, &endPtr, 10));
-    if (dev != devices_.end() && *endPtr++ == ',') {
-      int l = (int)strtol(endPtr, &endPtr, 10);
+    const auto& dev = devices_.find(msg.id);
+    if (dev != devices_.end() && msg.component >= 0) {
       auto& keypad = dev->second;
-      if (keypad.components.find(l) != keypad.components.end()) {
+      if (keypad.components.find(msg.component) != keypad.components.end()) {
         // This is a button and not an LED
-        if (!strcmp(endPtr, ",3") || !strcmp(endPtr, ",4")) {
-          auto& button = keypad.components[l];
-          buttonPressed(keypad, button, endPtr[1] == '4');
+        if ((msg.action == ACTION_PRESS || msg.action == ACTION_RELEASE) &&
+            msg.value.empty()) {
+          auto& button = keypad.components[msg.component];
+          buttonPressed(keypad, button, msg.action == ACTION_RELEASE);
           context = button.name;
         }
       } else {
@@ -133,38 +150,35 @@ void RadioRA2::readLine(const std::string& line) {
         const auto& led = std::find_if(keypad.components.begin(),
                                        keypad.components.end(),
                                        [&](auto& t) -> bool {
-                                         return t.second.led == l;
+                                         return t.second.led == msg.component;
                                        });
         // If the rest of the command identifies a new LED state, update our
         // internal copy. If we only received "255", assume that the LED is
         // probably off. And that's the default state that the object's
         // constructor left it in. So, nothing to do here.
-        if (led != keypad.components.end() && *endPtr++ == ',' &&
-            *endPtr++ == (ACTION_LEDSTATE + '0') && *endPtr++ == ',') {
+        if (led != keypad.components.end() &&
+            msg.action == ACTION_LEDSTATE && !msg.value.empty()) {
           context = led->second.name;
-          led->second.uncertain = (*endPtr != '0' && *endPtr != '1')||endPtr[1];
+          const bool on = msg.value == "1";
+          led->second.uncertain = !on && msg.value != "0";
           if (!led->second.uncertain) {
             if (ledState_ &&
                 (keypad.type == DEV_SEETOUCH_KEYPAD ||
                  keypad.type == DEV_HYBRID_SEETOUCH_KEYPAD)) {
               const int level = getLevelForButton(led->second.assignments);
-              ledState_(keypad.id, led->second.id,
-                        !!(*endPtr == '1' || (*endPtr != '0' && level)),
-                        level);
+              ledState_(keypad.id, led->second.id, on, level);
             }
-            led->second.ledState = *endPtr == '1';
+            led->second.ledState = on;
           }
         }
       }
     }
-  } else if (Util::starts_with(line, "~OUTPUT,")) {
+  } else if (msg.kind == LutronMessage::OUTPUT) {
     // We find out about light fixtures with a line of the form
     //
     //   ~OUTPUT,${IntegrationID},1,${DimmerLevel}
     //
-    char *endPtr;
-    // Find keypad that matches the ${IntegrationID}.
-    int id = (int)strtol(line.c_str() + 8, &endPtr, 10);
+    const int id = msg.id;
 
     // While we are gradually fading DMX dimmers in response to the user
     // holding down the dimmer button, we don't respond to Lutron updating
@@ -172,9 +186,8 @@ void RadioRA2::readLine(const std::string& line) {
     suppressed = suppressDummyDimmer_.find(id) != suppressDummyDimmer_.end();
     if (!suppressed) {
       const auto& out = outputs_.find(id);
-      if (out != outputs_.end() &&
-          *endPtr++ == ',' && *endPtr++ == '1' && *endPtr++ == ',') {
-        const auto newLevel = strToLevel(endPtr);
+      if (out != outputs_.end() && msg.action == 1) {
+        const auto newLevel = std::max(msg.level, 0);
         const auto it = releaseDummyDimmer_.find(id);
         if (it != releaseDummyDimmer_.end() && Util::millis() < it->second &&
             out->second.level != newLevel) {
@@ -197,10 +210,20 @@ void RadioRA2::readLine(const std::string& line) {
           // Check if there is any aliased output. This allows us to take over
           // the implementation of an output that is *also* natively handled by
           // the Lutron controller.
-          const std::string& alias = fmt::format("{}{}", ALIAS, id);
-          const std::string& dmxalias = fmt::format("{}{}", DMXALIAS, id);
+          char buf[16];
+          const std::string_view num(
+            buf, fmt::format_to_n(buf, sizeof(buf), "{}", id).size);
+          const auto isAlias = [&](const std::string& name) {
+            // Same as comparing to "RRA2:<id>" and "DMX:<id>", but without
+            // building any new strings.
+            return name.ends_with(num) &&
+              ((name.size() == ALIAS.size() + num.size() &&
+                name.starts_with(ALIAS)) ||
+               (name.size() == DMXALIAS.size() + num.size() &&
+                name.starts_with(DMXALIAS)));
+          };
           for (auto& [name, level, cb] : namedOutput_) {
-            if (name == alias || name == dmxalias) {
+            if (isAlias(name)) {
               if (level != out->second.level && cb) {
                 event_.runLater([=]() { cb(out->second.level, true); });
               }
@@ -211,17 +234,19 @@ void RadioRA2::readLine(const std::string& line) {
         }
       }
     }
-  } else if (Util::starts_with(line, "~TIMECLOCK,")) {
-    timeclockMonitor_(std::string(line, 11));
-  } else if (Util::starts_with(line, "~SYSTEM,1,")) {
+  } else if (msg.kind == LutronMessage::TIMECLOCK) {
+    timeclockMonitor_(std::string(msg.args));
+  } else if (msg.kind == LutronMessage::SYSTEM && msg.action == 1) {
     // When the controller tells us the system time, compare it to our own
     // understanding of time. If there is a significant difference, we can
     // adjust the time as needed.
     unsigned char h, m, s;
-    if (sscanf(line.c_str() + 10, "%2hhu:%2hhu:%2hhu%*c", &h, &m, &s) != 3) {
+    char buf[16] = { };
+    msg.value.copy(buf, sizeof(buf) - 1);
+    if (sscanf(buf, "%2hhu:%2hhu:%2hhu%*c", &h, &m, &s) != 3) {
       DBG("Cannot parse time string");
     } else {
-      time_t ti = time(NULL);
+      time_t ti = Util::time();
       struct tm tm;
       localtime_r(&ti, &tm);
       unsigned d = ((s + 60*(m + 60*(unsigned)h)) + 86400 -
@@ -238,13 +263,14 @@ void RadioRA2::readLine(const std::string& line) {
   // A short while after the last update, we recompute all LEDs.
   if (recompute_ || !lutron_.commandPending()) {
     event_.removeTimeout(recompute_);
-    recompute_ = event_.addTimeout(200, [this]() {
-      recompute_ = nullptr;
+    recompute_ = event_.addTimeout(200, 50, [this]() {
+      recompute_ = {};
       recomputeLEDs();
     });
+    event_.setPriority(recompute_, Event::BULK);
   }
   if (input_ && !suppressed) {
-    input_(line, Util::trim(context), true);
+    input_(msg, Util::trimView(context), true);
   }
 }
 
@@ -269,6 +295,26 @@ void RadioRA2::init(std::function<void (void)> cb) {
     command(fmt::format("#MONITORING,{},1", ev));
   }
 
+  // If the standby session just took over, we have been connected all
+  // along. Only the outputs that changed in the meantime need refreshing.
+  // There also is no need to check the schema again.
+  const auto changed = lutron_.takeFailover();
+  if (changed && initialized_) {
+    DBG("Refreshing " << changed->size() << " outputs after failover");
+    for (const int id : *changed) {
+      if (outputs_.count(id)) {
+        command(Lutron::BACKGROUND, fmt::format("?OUTPUT,{},1", id),
+                [this](auto) { lutron_.initStillWorking(); });
+      }
+    }
+    command(Lutron::BACKGROUND, "", [cb](auto) {
+      if (cb) {
+        cb();
+      }
+    });
+    return;
+  }
+
   if (!devices_.size() && !outputs_.size()) {
     // Getting the schema takes a really long time. We should only ever do
     // so once and then cache the result even if we needed to reset the
@@ -301,10 +347,10 @@ void RadioRA2::init(std::function<void (void)> cb) {
         // If this is the first time that we have seen any automation schema,
         // there will be init_ handlers that need to be notified. Remove them
         // afterwards.
-        const auto init = std::move(init_);
-        for (const auto& o : init) {
+        auto init = std::move(init_);
+        for (auto& o : init) {
           if (o) {
-            event_.runLater(o);
+            event_.runLater(std::move(o));
           }
         }
         if (cb) {
@@ -321,6 +367,39 @@ void RadioRA2::init(std::function<void (void)> cb) {
   }
 }
 
+void RadioRA2::initShard(Lutron& session, std::function<void (void)> cb) {
+  // Additional sessions only ever answer our queries. Turn off all the
+  // notifications that the repeater enables by default, so that we don't
+  // see the same events more than once. Replies and prompts have to stay
+  // on, as we couldn't match up commands with their responses otherwise.
+  if (session.isConnected()) {
+    static const MonitorType events[] = {
+      MONITOR_DIAGNOSTICS, MONITOR_EVENT, MONITOR_BUTTON, MONITOR_LED,
+      MONITOR_ZONE, MONITOR_OCCUPANCY, MONITOR_PHOTOSENSOR, MONITOR_SCENE,
+      MONITOR_SYSVAR, MONITOR_OCCUPANCYGRP, MONITOR_DEVICELOCK,
+      MONITOR_SEQUENCE, MONITOR_HVAC, MONITOR_MODE, MONITOR_SHADEGRP,
+      MONITOR_PARTWALL, MONITOR_TEMPERATURE };
+    for (const auto& ev : events) {
+      session.command(fmt::format("#MONITORING,{},2", ev));
+    }
+  }
+  if (cb) {
+    cb();
+  }
+}
+
+void RadioRA2::initStandby(Lutron& session, std::function<void (void)> cb) {
+  // The standby session watches for output changes, so that we know what
+  // to refresh, if it ever has to take over. Nothing else is needed until
+  // then. Once it takes over, "init()" turns on the remaining notifications.
+  if (session.isConnected()) {
+    session.command(fmt::format("#MONITORING,{},1", MONITOR_ZONE));
+  }
+  if (cb) {
+    cb();
+  }
+}
+
 void RadioRA2::closed() {
   DBG("Connection closed");
   if (schemaSock_ >= 0) {
@@ -388,8 +467,10 @@ void RadioRA2::getSchema(const sockaddr& addr, socklen_t len,
       DBG("Unexpected failure to write to socket");
       goto err;
     }
-    // All data is read asynchronously from the event loop.
-    event_.addPollFd(schemaSock_, POLLIN,
+    // All data is read asynchronously from the event loop. Downloading the
+    // schema isn't urgent, and it shouldn't get in the way of anything that
+    // the user can observe.
+    event_.setPriority(event_.addPollFd(schemaSock_, POLLIN,
       [this, cb, schema = std::string()](auto) mutable {
       char buf[1100];
       for (;;) {
@@ -414,35 +495,53 @@ void RadioRA2::getSchema(const sockaddr& addr, socklen_t len,
           DBG("Read " << schema.size() << " bytes of schema information");
           close(schemaSock_);
           schemaSock_ = -1;
-          pugi::xml_document xml;
-          if (!schema.size() ||
-              !xml.load_buffer(schema.c_str(), schema.size())) {
-            // If anything went wrong, we close the other (!) socket to
-            // the Lutron device. This resets everything and there will
-            // be a retry in a short while.
-            lutron_.closeSock();
-          } else {
-            // The XML data is extremely unwieldy. It contains more information
-            // than we really need. And it also organizes the data in a way
-            // that makes it hard to  manipulate. Extract only what we need
-            // and populate our internal data structures.
-            if (extractSchemaInfo(xml)) {
+          // Parsing more than 100kB of XML data takes a noticeable amount of
+          // time on small devices. Do so on a worker thread.
+          struct Schema {
+            std::unique_ptr<pugi::xml_document> xml;
+            std::map<int, Device> devices;
+            std::map<int, Output> outputs;
+          };
+          event_.pool().run([schema = std::move(schema)]() {
+            Schema res{ std::make_unique<pugi::xml_document>() };
+            if (!schema.size() ||
+                !res.xml->load_buffer(schema.c_str(), schema.size())) {
+              res.xml.reset();
+            } else {
+              // The XML data is extremely unwieldy. It contains more
+              // information than we really need. And it also organizes the
+              // data in a way that makes it hard to  manipulate. Extract
+              // only what we need.
+              parseSchema(*res.xml, res.devices, res.outputs);
+            }
+            return res;
+          }, [this, cb](Schema&& res) {
+            if (!res.xml) {
+              // If anything went wrong, we close the other (!) socket to
+              // the Lutron device. This resets everything and there will
+              // be a retry in a short while.
+              lutron_.closeSock();
+            } else if (updateSchema(std::move(res.devices),
+                                    std::move(res.outputs))) {
               DBG("Cached schema is invalid; updating cache with new data");
               // While we could save the raw data returned from the device,
               // we instead pretty-print it. That can help when debugging a
-              // site's configuration.
-              if (!xml.save_file(".lutron.xml", "  ")) {
-                if (!cb && schemaInvalid_) {
+              // site's configuration. Writing the file happens in the
+              // background, too.
+              event_.pool().run([xml = std::move(res.xml)]() {
+                return xml->save_file(".lutron.xml", "  ");
+              }, [this, speculative = !cb](bool ok) {
+                if (!ok && speculative && schemaInvalid_) {
                   schemaInvalid_();
                 }
-              }
+              });
             } else {
               DBG("Cached data is unchanged");
             }
-          }
-          if (cb) {
-            cb();
-          }
+            if (cb) {
+              cb();
+            }
+          });
           return false;
         } else if (errno == EINPROGRESS || errno == EWOULDBLOCK) {
           // Return to event loop and keep reading when more data arrives.
@@ -459,7 +558,7 @@ void RadioRA2::getSchema(const sockaddr& addr, socklen_t len,
           return false;
         }
       }
-    });
+    }), Event::BULK);
     return true;
   };
   if (connect(schemaSock_, &addr, len) >= 0) {
@@ -468,7 +567,8 @@ void RadioRA2::getSchema(const sockaddr& addr, socklen_t len,
     readSchema(nullptr);
   } else {
     if (errno == EINPROGRESS || errno == EWOULDBLOCK) {
-      event_.addPollFd(schemaSock_, POLLOUT, readSchema);
+      event_.setPriority(event_.addPollFd(schemaSock_, POLLOUT, readSchema),
+                         Event::BULK);
     } else {
       goto err;
     }
@@ -490,6 +590,29 @@ int RadioRA2::strToLevel(const char *ptr) {
 }
 
 bool RadioRA2::extractSchemaInfo(pugi::xml_document& xml) {
+  std::map<int, Device> devices;
+  std::map<int, Output> outputs;
+  parseSchema(xml, devices, outputs);
+  return updateSchema(std::move(devices), std::move(outputs));
+}
+
+bool RadioRA2::updateSchema(std::map<int, Device>&& devices,
+                            std::map<int, Output>&& outputs) {
+  // Returns true, if the schema differs from our cached copy.
+  if (devices_ == devices && outputs_ == outputs) {
+    return false;
+  } else {
+    devices_ = std::move(devices);
+    outputs_ = std::move(outputs);
+    return true;
+  }
+}
+
+void RadioRA2::parseSchema(const pugi::xml_document& xml,
+                           std::map<int, Device>& devices,
+                           std::map<int, Output>& outputs) {
+  // This is a static method, as it runs on a worker thread. It must not
+  // touch any of our member variables.
   // There is a lot more data in the XML file than what we actually need.
   // Only extract the important information and store it an a much more
   // manageable internal data structure.
@@ -531,7 +654,6 @@ bool RadioRA2::extractSchemaInfo(pugi::xml_document& xml) {
   };
 
   // Iterate over all devices (i.e. keypads, repeaters, motion sensors, ...)
-  std::map<int, Device> devices;
   const auto& devs = xml.select_nodes("//Device");
   for (const auto& device : devs) {
     Device dev{
@@ -584,21 +706,12 @@ bool RadioRA2::extractSchemaInfo(pugi::xml_document& xml) {
   }
 
   // Iterate over all outputs (i.e. light fixtures)
-  std::map<int, Output> outputs;
   const auto& outs = xml.select_nodes("//Output");
   for (const auto& output : outs) {
     Output out(output.node().attribute("IntegrationID").as_int(-1),
                output.node().attribute("Name").value());
     outputs[out.id] = out;
   }
-
-  if (devices_ == devices && outputs_ == outputs) {
-    return false;
-  } else {
-    devices_ = std::move(devices);
-    outputs_ = std::move(outputs);
-    return true;
-  }
 }
 
 void RadioRA2::refreshCurrentState(std::function<void ()> cb) {
@@ -606,9 +719,11 @@ void RadioRA2::refreshCurrentState(std::function<void ()> cb) {
   // therefore have to submit a sequence of "Lutron::command()"s
   // and then invoke "Lutron::initStillWorking()" from the callbacks of that
   // function.
+  // All of these commands go into the background lane. If the user presses
+  // a button in the meantime, it doesn't have to wait for us to finish.
   for (const auto& out : outputs_) {
     // Iterate over all light fixtures and query their state.
-    command(fmt::format("?OUTPUT,{},1", out.second.id),
+    command(Lutron::BACKGROUND, fmt::format("?OUTPUT,{},1", out.second.id),
             [this](auto) { lutron_.initStillWorking(); });
   }
 
@@ -618,11 +733,11 @@ void RadioRA2::refreshCurrentState(std::function<void ()> cb) {
   // intialization is quite slow because of all the communication involved.
   // Speculatively initialize things as fast as we can, and then fix things
   // up asynchronously as needed.
-  command("", [cb, this](auto) {
+  command(Lutron::BACKGROUND, "", [cb, this](auto) {
     if (cb) {
       cb();
     }
-    event_.addTimeout(2000, [this]() {
+    event_.setPriority(event_.addTimeout(2000, [this]() {
       for (auto& dev : devices_) {
         for (auto& comp : dev.second.components) {
           if (comp.second.led < 0) {
@@ -638,14 +753,15 @@ void RadioRA2::refreshCurrentState(std::function<void ()> cb) {
             ledState_(dev.second.id, comp.second.id, false, level);
           }
           comp.second.ledState = 0;
-          command(fmt::format("?DEVICE,{},{},{}",
+          command(Lutron::BACKGROUND,
+                  fmt::format("?DEVICE,{},{},{}",
                               dev.second.id,
                               comp.second.led,
                               ACTION_LEDSTATE),
                   [this](auto) { lutron_.initStillWorking(); });
         }
       }
-    });
+    }), Event::BULK);
   });
 }
 
@@ -746,7 +862,7 @@ void RadioRA2::recomputeLEDs() {
             ledState_(device.id, component.id, ledState,
                       getLevelForButton(component.assignments));
           }
-          command(fmt::format("#DEVICE,{},{},9,{}",
+          command(Lutron::BACKGROUND, fmt::format("#DEVICE,{},{},9,{}",
             device.id, component.led, ledState ? 1 : 0));
         }
       }
@@ -765,12 +881,12 @@ void RadioRA2::addButtonListener(int kp, int bt,
   }
 }
 
-void RadioRA2::monitorTimeclock(std::function<void (const std::string&)> cb) {
-  timeclockMonitor_ = cb;
+void RadioRA2::monitorTimeclock(Callback<void (const std::string&)> cb) {
+  timeclockMonitor_ = std::move(cb);
 }
 
-void RadioRA2::monitorOutput(int id, std::function<void (int level)> cb) {
-  outputMonitor_[id] = cb;
+void RadioRA2::monitorOutput(int id, Callback<void (int level)> cb) {
+  outputMonitor_[id] = std::move(cb);
 }
 
 int RadioRA2::addOutput(const std::string name,
@@ -831,12 +947,12 @@ void RadioRA2::toggleOutput(int out) {
   if (output != outputs_.end()) {
     auto& level = output->second.level;
     level = level ? 0 : 10000;
-    command(fmt::format("#OUTPUT,{},1,{}.{:02}",
-                        out, level/100, level%100));
+    command(Lutron::INTERACTIVE, fmt::format("#OUTPUT,{},1,{}.{:02}",
+                                             out, level/100, level%100));
   }
 }
 
-void RadioRA2::command(const std::string& cmd,
+void RadioRA2::command(Lutron::Priority prio, const std::string& cmd,
                        std::function<void (const std::string& res)> cb,
                        std::function<void (void)> err) {
   if (Util::starts_with(cmd, "#DEVICE,")) {
@@ -863,7 +979,7 @@ void RadioRA2::command(const std::string& cmd,
       }
     }
   }
-  lutron_.command(cmd, cb, err);
+  lutron_.command(prio, cmd, cb, err);
 }
 
 std::string RadioRA2::getKeypads(const std::vector<int>& order) {
@@ -1057,8 +1173,8 @@ void RadioRA2::setDMXorLutron(int id, int level, bool fade, bool suppress,
       // NoUpdate must not be set on the very final call, as that call both
       // flushes our cached state to the Lutron system and removes the
       // suppression.
-      command(fmt::format("#OUTPUT,{},1,{}.{:02}",
-                          id, level/100, level%100),
+      command(Lutron::INTERACTIVE,
+              fmt::format("#OUTPUT,{},1,{}.{:02}", id, level/100, level%100),
               suppress ? [this, id](auto) { suppressLutronDimmer(id, false); }
                        : (std::function<void (const std::string&)>)nullptr);
     }
@@ -1066,9 +1182,12 @@ void RadioRA2::setDMXorLutron(int id, int level, bool fade, bool suppress,
       out.level = level;
       broadcastDimmerChanges(id);
       if (input_) {
-        input_(fmt::format("~OUTPUT,{},1,{}.{:02}",
-                           id, level/100, level%100),
-               Util::trim(out.name), fade);
+        char buf[40];
+        const auto len = fmt::format_to_n(buf, sizeof(buf),
+                                          "~OUTPUT,{},1,{}.{:02}",
+                                          id, level/100, level%100).size;
+        input_(LutronMessage::parse({ buf, std::min(len, sizeof(buf)) }),
+               Util::trimView(out.name), fade);
       }
     }
   }
@@ -1349,7 +1468,7 @@ void RadioRA2::buttonPressed(Device& keypad, Component& button,
         }
       }
       if (keypad.startingLevels.size()) {
-        command("", [&](auto) { dimSmooth(keypad); });
+        command(Lutron::INTERACTIVE, "", [&](auto) { dimSmooth(keypad); });
       }
     }
     break; }
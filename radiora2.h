@@ -7,10 +7,14 @@
 #include <pugixml.hpp>
 #include <set>
 #include <string>
+#include <string_view>
 #include <vector>
 
+#include "callback.h"
 #include "event.h"
 #include "lutron.h"
+#include "lutronmessage.h"
+#include "lutronpool.h"
 
 
 class RadioRA2 {
@@ -30,23 +34,26 @@ class RadioRA2 {
   RadioRA2(Event& event,
            const std::string& gateway = "",
            const std::string& username = "",
-           const std::string& password = "");
+           const std::string& password = "",
+           unsigned sessions = 1,
+           bool standby = false);
   ~RadioRA2();
-  RadioRA2& oninit(std::function<void ()> init) {
-    init_.push_back(init); return *this; }
-  RadioRA2& oninput(std::function<void (const std::string& line,
-                                        const std::string& context,
-                                        bool fade)> input) {
-    input_ = input; return *this; }
-  RadioRA2& onledstate(std::function<void (int, int, bool, int)> ledState) {
-    ledState_ = ledState; return *this; }
-  RadioRA2& onheartbeat(std::function<void ()> hb) { hb_ = hb; return *this; }
-  RadioRA2& onschemainvalid(std::function<void ()> schemaInvalid) {
-    schemaInvalid_ = schemaInvalid; return *this; }
+  RadioRA2& oninit(Callback<void ()> init) {
+    init_.push_back(std::move(init)); return *this; }
+  RadioRA2& oninput(Callback<void (const LutronMessage& msg,
+                                   std::string_view context,
+                                   bool fade)> input) {
+    input_ = std::move(input); return *this; }
+  RadioRA2& onledstate(Callback<void (int, int, bool, int)> ledState) {
+    ledState_ = std::move(ledState); return *this; }
+  RadioRA2& onheartbeat(Callback<void ()> hb) {
+    hb_ = std::move(hb); return *this; }
+  RadioRA2& onschemainvalid(Callback<void ()> schemaInvalid) {
+    schemaInvalid_ = std::move(schemaInvalid); return *this; }
   void addButtonListener(int kp, int bt,
         std::function<void (int kp, int bt, bool on, bool isLong, int num)> cb);
-  void monitorTimeclock(std::function<void (const std::string& tc)> cb);
-  void monitorOutput(int id, std::function<void (int level)> cb);
+  void monitorTimeclock(Callback<void (const std::string& tc)> cb);
+  void monitorOutput(int id, Callback<void (int level)> cb);
   int addOutput(const std::string name, std::function<void (int, bool)> cb);
   void addToButton(int kp, int bt, int id, int level, bool makeToggle = false);
   void toggleOutput(int out);
@@ -55,6 +62,10 @@ class RadioRA2 {
     return dev != devices_.end() ? dev->second.type : DEV_UNKNOWN;
   }
   void command(const std::string& cmd,
+               std::function<void (const std::string& res)> cb = nullptr,
+               std::function<void (void)> err = nullptr) {
+    command(Lutron::NORMAL, cmd, std::move(cb), std::move(err)); }
+  void command(Lutron::Priority prio, const std::string& cmd,
                std::function<void (const std::string& res)> cb = nullptr,
                std::function<void (void)> err = nullptr);
   int getKeypad(const std::string& label) const {
@@ -64,6 +75,7 @@ class RadioRA2 {
   }
   std::string getKeypads(const std::vector<int>& order);
   void updateEnvironment();
+  std::string report() const { return lutron_.report(); }
 
  private:
   const unsigned int SHORT_REOPEN_TMO =  5000;
@@ -75,6 +87,7 @@ class RadioRA2 {
   const unsigned int LONGDOUBLETAP    =  2500;
   const unsigned int DIMLEVELS        =    15;
   const unsigned int DIMRATE          =    25; // 25% change per second
+  const unsigned int PIPELINE         =     8; // commands in flight
 
 
   enum ActionType {
@@ -268,12 +281,19 @@ class RadioRA2 {
   };
 
   void healthCheck();
-  void readLine(const std::string& line);
+  void readLine(const LutronMessage& msg);
   void init(std::function<void (void)> cb);
+  void initShard(Lutron& session, std::function<void (void)> cb);
+  void initStandby(Lutron& session, std::function<void (void)> cb);
   void closed();
   void getSchema(const sockaddr& addr, socklen_t len, std::function<void ()>cb);
   static int strToLevel(const char *ptr);
   bool extractSchemaInfo(pugi::xml_document& xml_);
+  static void parseSchema(const pugi::xml_document& xml,
+                          std::map<int, Device>& devices,
+                          std::map<int, Output>& outputs);
+  bool updateSchema(std::map<int, Device>&& devices,
+                    std::map<int, Output>&& outputs);
   void refreshCurrentState(std::function<void ()> cb);
   int getCurrentLevel(int id);
   int getLevelForButton(const std::vector<Assignment>& assignments);
@@ -286,14 +306,14 @@ class RadioRA2 {
   void dimSmooth(Device& keypad);
 
   Event& event_;
-  Lutron lutron_;
+  LutronPool lutron_;
   bool initialized_;
-  std::vector<std::function<void ()>> init_;
-  std::function<void (const std::string&, const std::string&, bool)> input_;
-  std::function<void (int, int, bool, int)> ledState_;
-  std::function<void ()> hb_;
-  std::function<void ()> schemaInvalid_;
-  void *recompute_;
+  std::vector<Callback<void ()>> init_;
+  Callback<void (const LutronMessage&, std::string_view, bool)> input_;
+  Callback<void (int, int, bool, int)> ledState_;
+  Callback<void ()> hb_;
+  Callback<void ()> schemaInvalid_;
+  Event::Handle recompute_;
   unsigned int reconnect_;
   unsigned int checkStarted_;
   unsigned int checkFinished_;
@@ -304,6 +324,6 @@ class RadioRA2 {
   std::vector<NamedOutput> namedOutput_;
   std::set<int> suppressDummyDimmer_;
   std::map<int, unsigned> releaseDummyDimmer_;
-  std::function<void (const std::string&)> timeclockMonitor_;
-  std::map<int, std::function<void (int)>> outputMonitor_;
+  Callback<void (const std::string&)> timeclockMonitor_;
+  std::map<int, Callback<void (int)>> outputMonitor_;
 };
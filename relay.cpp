@@ -103,6 +103,8 @@ void Relay::set(int pin, bool state, int bias) {
     // Check whether this is a virtual pin on the I2C bus.
     const auto i2c = i2c_.find(pin);
     if (i2c != i2c_.end()) {
+      // I2C transfers stay synchronous. Reads then always observe earlier
+      // writes, and the event loop never has to wait for a worker thread.
       if (ioctl(handle, I2C_SLAVE, i2c->second[1]) >= 0) {
         i2c_smbus_write_byte_data(handle, i2c->second[2],
                                   state ? 1 << i2c->second[3] : 0);
@@ -179,18 +181,19 @@ void Relay::toggle(int pin, bool slow) {
   set(pin, true, GPIOHANDLE_REQUEST_BIAS_DISABLE);
 
   // The relay board now reads an "on" condition, but the keyfob is still "off"
-  event_.addTimeout(slow ? 1200 : 300, [this, pin]() {
+  // The length of the pulses matters. So, they have to be timed precisely.
+  event_.setPriority(event_.addTimeout(slow ? 1200 : 300, [this, pin]() {
     // Next, we also signal an "on" condition to the keyfob remote. The relay
     // board will treat this as "off".
     set(pin, false, GPIOHANDLE_REQUEST_BIAS_DISABLE);
 
     const auto i2c = this->i2c_.find(pin);
     if (i2c == this->i2c_.end())
-      event_.addTimeout(300, [this, pin]() {
+      event_.setPriority(event_.addTimeout(300, [this, pin]() {
         // Return pin to the "off" condition, by relying on the pull-down
         // resistor to do the right thing for both types of devices.
         get(pin, GPIOHANDLE_REQUEST_BIAS_PULL_DOWN);
-        }); });
+        }), Event::REALTIME); }), Event::REALTIME);
 }
 
 void Relay::i2c(int id, int bus, int dev, int addr, int bit) {
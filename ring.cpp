@@ -0,0 +1,156 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "ring.h"
+#include "util.h"
+
+
+std::unique_ptr<Ring> Ring::create(unsigned entries) {
+#if defined(__NR_io_uring_setup)
+  std::unique_ptr<Ring> ring(new Ring());
+  io_uring_params p = { };
+  ring->fd_ = syscall(__NR_io_uring_setup, entries, &p);
+  if (ring->fd_ < 0) {
+    DBG("io_uring is not available; using the regular I/O path");
+    return nullptr;
+  }
+
+  // Older kernels understand io_uring, but they don't support all of the
+  // operations that we need. Kernels that are too old to have a probe
+  // interface in the first place are also too old for our purposes.
+  const unsigned ops[] = { IORING_OP_WRITE, IORING_OP_TIMEOUT,
+                           IORING_OP_ASYNC_CANCEL };
+  std::unique_ptr<io_uring_probe, decltype(&free)> probe(
+    (io_uring_probe *)calloc(1, sizeof(io_uring_probe) +
+                                256*sizeof(io_uring_probe_op)), free);
+  if (syscall(__NR_io_uring_register, ring->fd_, IORING_REGISTER_PROBE,
+              probe.get(), 256) < 0) {
+    DBG("Kernel is too old for io_uring support");
+    return nullptr;
+  }
+  for (const auto op : ops) {
+    if (op > probe->last_op ||
+        !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+      DBG("Kernel doesn't support all io_uring operations that we need");
+      return nullptr;
+    }
+  }
+
+  // Map the submission queue, the completion queue, and the array of
+  // submission queue entries into our address space. Newer kernels allow
+  // for the two queues to share a single mapping.
+  ring->sqRingSize_ = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+  ring->cqRingSize_ = p.cq_off.cqes + p.cq_entries*sizeof(io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->sqRingSize_ = ring->cqRingSize_ =
+      std::max(ring->sqRingSize_, ring->cqRingSize_);
+  }
+  ring->sqRing_ = mmap(nullptr, ring->sqRingSize_, PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_POPULATE, ring->fd_,
+                       IORING_OFF_SQ_RING);
+  if (ring->sqRing_ == MAP_FAILED) {
+    ring->sqRing_ = nullptr;
+    return nullptr;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cqRing_ = ring->sqRing_;
+  } else {
+    ring->cqRing_ = mmap(nullptr, ring->cqRingSize_, PROT_READ|PROT_WRITE,
+                         MAP_SHARED|MAP_POPULATE, ring->fd_,
+                         IORING_OFF_CQ_RING);
+    if (ring->cqRing_ == MAP_FAILED) {
+      ring->cqRing_ = nullptr;
+      return nullptr;
+    }
+  }
+  ring->sqesSize_ = p.sq_entries*sizeof(io_uring_sqe);
+  ring->sqes_ = (io_uring_sqe *)mmap(nullptr, ring->sqesSize_,
+                                     PROT_READ|PROT_WRITE,
+                                     MAP_SHARED|MAP_POPULATE, ring->fd_,
+                                     IORING_OFF_SQES);
+  if (ring->sqes_ == MAP_FAILED) {
+    ring->sqes_ = nullptr;
+    return nullptr;
+  }
+  char *sq = (char *)ring->sqRing_, *cq = (char *)ring->cqRing_;
+  ring->sqHead_  = (unsigned *)(sq + p.sq_off.head);
+  ring->sqTail_  = (unsigned *)(sq + p.sq_off.tail);
+  ring->sqMask_  = (unsigned *)(sq + p.sq_off.ring_mask);
+  ring->sqArray_ = (unsigned *)(sq + p.sq_off.array);
+  ring->cqHead_  = (unsigned *)(cq + p.cq_off.head);
+  ring->cqTail_  = (unsigned *)(cq + p.cq_off.tail);
+  ring->cqMask_  = (unsigned *)(cq + p.cq_off.ring_mask);
+  ring->cqes_    = (io_uring_cqe *)(cq + p.cq_off.cqes);
+  DBG("Using io_uring for batched I/O");
+  return ring;
+#else
+  return nullptr;
+#endif
+}
+
+Ring::~Ring() {
+  if (sqes_) {
+    munmap(sqes_, sqesSize_);
+  }
+  if (cqRing_ && cqRing_ != sqRing_) {
+    munmap(cqRing_, cqRingSize_);
+  }
+  if (sqRing_) {
+    munmap(sqRing_, sqRingSize_);
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+}
+
+bool Ring::reserve(unsigned n) {
+  const auto space = [&]() {
+    return *sqMask_ + 1 - (*sqTail_ + queued_ -
+                           __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE)); };
+  if (space() < n) {
+    // The queue is full. Let the kernel consume what we have so far.
+    submit();
+  }
+  return space() >= n;
+}
+
+io_uring_sqe *Ring::get() {
+  if (!reserve(1)) {
+    return nullptr;
+  }
+  const unsigned mask = *sqMask_;
+  const unsigned tail = *sqTail_ + queued_;
+  ++queued_;
+  io_uring_sqe *sqe = &sqes_[tail & mask];
+  memset(sqe, 0, sizeof(*sqe));
+  sqArray_[tail & mask] = tail & mask;
+  return sqe;
+}
+
+int Ring::submit(unsigned wait) {
+#if defined(__NR_io_uring_enter)
+  // Publish all new entries with a single store, then tell the kernel.
+  const unsigned n = queued_;
+  if (n) {
+    __atomic_store_n(sqTail_, *sqTail_ + n, __ATOMIC_RELEASE);
+    queued_ = 0;
+  }
+  if (!n && !wait) {
+    return 0;
+  }
+  int rc;
+  do {
+    rc = syscall(__NR_io_uring_enter, fd_, n, wait,
+                 wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+  } while (rc < 0 && errno == EINTR);
+  return rc < 0 ? -errno : rc;
+#else
+  return -ENOSYS;
+#endif
+}
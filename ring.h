@@ -0,0 +1,61 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <stdint.h>
+
+#include <memory>
+
+
+// Minimal wrapper around the kernel's io_uring interface. It talks to the
+// kernel with raw system calls, so that we don't depend on liburing. Callers
+// fill in submission queue entries, which are all handed to the kernel with
+// a single system call when "submit()" gets called. Completions are picked
+// up by "reap()". The ring's file descriptor becomes readable whenever there
+// are any completions, which makes it easy to integrate with the event loop.
+class Ring {
+ public:
+  // Returns nullptr, if the kernel doesn't support io_uring, or if it is
+  // too old to support all the operations that we need.
+  static std::unique_ptr<Ring> create(unsigned entries = 64);
+  Ring(const Ring&) = delete;
+  Ring& operator=(const Ring&) = delete;
+  ~Ring();
+
+  int fd() const { return fd_; }
+
+  // Returns an empty submission queue entry. If the queue is full, it gets
+  // submitted first. The entry only goes to the kernel with the next call
+  // to "submit()". Linked entries must be submitted together. So, callers
+  // should "reserve()" enough space for all of them ahead of time.
+  bool reserve(unsigned n);
+  io_uring_sqe *get();
+  unsigned queued() const { return queued_; }
+
+  // Hands all queued entries to the kernel. Optionally waits until at least
+  // "wait" completions are available.
+  int submit(unsigned wait = 0);
+
+  // Invokes "f" for each available completion.
+  template <class F>
+  void reap(F f) {
+    unsigned head = *cqHead_;
+    while (head != __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE)) {
+      const io_uring_cqe cqe = cqes_[head & *cqMask_];
+      __atomic_store_n(cqHead_, ++head, __ATOMIC_RELEASE);
+      f(cqe);
+      head = *cqHead_;
+    }
+  }
+
+ private:
+  Ring() { }
+
+  int fd_ = -1;
+  void *sqRing_ = nullptr, *cqRing_ = nullptr;
+  size_t sqRingSize_ = 0, cqRingSize_ = 0, sqesSize_ = 0;
+  io_uring_sqe *sqes_ = nullptr;
+  io_uring_cqe *cqes_ = nullptr;
+  unsigned *sqHead_, *sqTail_, *sqMask_, *sqArray_;
+  unsigned *cqHead_, *cqTail_, *cqMask_;
+  unsigned queued_ = 0;
+};
@@ -54,14 +54,23 @@ void Serial::brk(int fd) {
   // Time between breaks should be at least 1204µs.
   const auto now = Util::micros();
   static std::remove_const<decltype(now)>::type last = 0;
-  if (last && (now - last) < 1204U) {
-    usleep(1204 - (now - last));
+  if (last && (now - last) < BREAK_INTERVAL) {
+    usleep(BREAK_INTERVAL - (now - last));
   }
   last = Util::micros();
   // Send a break that is at least 92µs long, and that is followed by a
   // MAB (make-after-break) of at least 12µs.
   ioctl(fd, TIOCSBRK, 0);
-  usleep(92);
+  usleep(BREAK_LENGTH);
   ioctl(fd, TIOCCBRK, 0);
-  usleep(12);
+  usleep(MAB_LENGTH);
+}
+
+void Serial::setBreak(int fd, bool on) {
+  if (on) {
+    ioctl(fd, TCSBRK, (void *)1);
+    ioctl(fd, TIOCSBRK, 0);
+  } else {
+    ioctl(fd, TIOCCBRK, 0);
+  }
 }
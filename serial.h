@@ -2,6 +2,17 @@
 
 class Serial {
  public:
+  // DMX timing requirements in microseconds. At 250,000 baud and with 8N2
+  // framing, each byte takes 44µs to transmit.
+  static const unsigned BREAK_INTERVAL = 1204;
+  static const unsigned BREAK_LENGTH = 92;
+  static const unsigned MAB_LENGTH = 12;
+  static const unsigned BYTE_TIME = 44;
+
   static int open(const char *s);
   static void brk(int fd);
+
+  // Asynchronous callers take care of the timing themselves, and only need
+  // to toggle the break condition. Turning it on drains the output first.
+  static void setBreak(int fd, bool on);
 };
@@ -0,0 +1,598 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <deque>
+#include <fmt/format.h>
+#include <map>
+#include <memory>
+#include <random>
+#include <set>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "event.h"
+#include "util.h"
+
+
+// Simulates a RadioRA2 main repeater, so that connection setup, pipelining,
+// schema handling, and reconnecting can be tested and benchmarked without
+// access to real hardware. Build it with "make sim_repeater". It serves
+//  - the telnet integration protocol on port 23,
+//  - the XML schema ("GET /DbXmlInfo.xml") on port 80, and
+//  - replies to multicast discovery requests on 224.0.37.42:2647.
+// These are the ports that the real device uses, and they usually require
+// elevated privileges. Use a different loopback address (e.g. "127.0.0.2")
+// to run the simulator next to other services, and point the "REPEATER"
+// setting in "site.json" at it.
+//
+// Options are given as "key=value" pairs. See "usage()" for the full list.
+// Latency, bursts of unsolicited events, and dropped connections can all be
+// configured. Noteworthy events are printed as one line of JSON each, which
+// makes it easy to measure startup time, command throughput, and the time
+// that it takes to reconnect.
+
+static struct {
+  std::string addr = "127.0.0.1";
+  int telnet = 23;
+  int http = 80;
+  std::string user = "lutron";
+  std::string password = "integration";
+  int outputs = 64;
+  int keypads = 16;
+  unsigned latency = 0;    // milliseconds before answering a command
+  unsigned chunk = 1024;   // bytes of schema data per write
+  unsigned drip = 20;      // milliseconds between chunks
+  unsigned size = 128;     // minimum size of the schema in kB
+  unsigned burst = 0;      // unsolicited events per burst
+  unsigned every = 1000;   // milliseconds between bursts
+  double drop = 0;         // probability that a command closes the connection
+  unsigned dropAfter = 0;  // close each connection after this many commands
+  bool discovery = true;
+} opts;
+
+// Monitoring types that are relevant to the simulation. The repeater only
+// reports events to sessions that have enabled the matching type.
+enum { MON_BUTTON = 3, MON_LED = 4, MON_ZONE = 5, MON_REPLY = 11,
+       MON_PROMPT = 12, MON_ALL = 255 };
+
+static const int BUTTONS = 6;
+static const int FIRST_LED = 81;
+
+static Event *event;
+static std::mt19937 rng;
+static const unsigned start = Util::millis();
+static std::map<int, int> levels;                // output -> 0..10000
+static std::map<int, std::map<int, int>> leds;   // keypad -> LED -> state
+static std::string schema;
+
+struct Session {
+  int fd;
+  unsigned id;
+  enum { USER, PASSWORD, READY } state = USER;
+  std::string in, out;
+  std::deque<std::pair<unsigned, std::string>> replies;
+  Event::Handle timer, writer;
+  std::set<int> monitoring = { MON_ZONE, MON_REPLY, MON_PROMPT };
+  unsigned accepted = Util::millis(), loggedIn = 0, commands = 0;
+};
+static std::map<int, std::unique_ptr<Session>> sessions;
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+    "Usage: %s [key=value ...]\n"
+    "  addr=127.0.0.1        address to listen on and to advertise\n"
+    "  telnet=23 http=80     ports for integration protocol and schema\n"
+    "  user=lutron password=integration\n"
+    "  outputs=64 keypads=16 size of the simulated installation\n"
+    "  latency=0             ms before answering each command\n"
+    "  chunk=1024 drip=20    schema is sent in chunks, every \"drip\" ms\n"
+    "  size=128              pad the schema to at least this many kB\n"
+    "  burst=0 every=1000    unsolicited events, and ms between bursts\n"
+    "  drop=0                probability that a command drops the session\n"
+    "  dropafter=0           drop each session after this many commands\n"
+    "  discovery=1           answer multicast discovery requests\n",
+    prog);
+}
+
+static unsigned elapsed() {
+  return Util::millis() - start;
+}
+
+static std::string level(int l) {
+  return fmt::format("{}.{:02}", l/100, l%100);
+}
+
+static int firstKeypad() {
+  // Integration id 1 is the main repeater, followed by all outputs, and
+  // then by all keypads.
+  return opts.outputs + 2;
+}
+
+static int assignedOutput(int kp, int bt) {
+  return 2 + ((kp - firstKeypad())*BUTTONS + bt - 1) % opts.outputs;
+}
+
+static std::string makeSchema() {
+  // The real schema has a lot more detail, but this is all the information
+  // that RadioRA2::parseSchema() looks at.
+  std::string xml =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\r\n"
+    "<Project><Areas><Area Name=\"Home\"><DeviceGroups>"
+    "<DeviceGroup Name=\"Equipment\"><Devices>"
+    "<Device Name=\"Main Repeater\" IntegrationID=\"1\" "
+    "DeviceType=\"MAIN_REPEATER\"/>\r\n";
+  for (int kp = firstKeypad(); kp < firstKeypad() + opts.keypads; ++kp) {
+    xml += fmt::format("<Device Name=\"Keypad {}\" IntegrationID=\"{}\" "
+                       "DeviceType=\"SEETOUCH_KEYPAD\"><Components>\r\n",
+                       kp, kp);
+    for (int bt = 1; bt <= BUTTONS; ++bt) {
+      const int model = kp*100 + bt;
+      xml += fmt::format(
+        "<Component ComponentNumber=\"{}\" ComponentType=\"BUTTON\">"
+        "<Button Engraving=\"Button {}\" ButtonType=\"Toggle\" LedLogic=\"1\" "
+        "ProgrammingModelID=\"{}\"><Actions><Action><Presets><Preset>"
+        "<PresetAssignments><PresetAssignment AssignmentType=\"2\">"
+        "<IntegrationID>{}</IntegrationID><Level>100</Level>"
+        "</PresetAssignment></PresetAssignments></Preset></Presets>"
+        "</Action></Actions></Button></Component>\r\n"
+        "<Component ComponentNumber=\"{}\" ComponentType=\"LED\">"
+        "<LED ProgrammingModelID=\"{}\"/></Component>\r\n",
+        bt, bt, model, assignedOutput(kp, bt), FIRST_LED + bt - 1, model);
+    }
+    xml += "</Components></Device>\r\n";
+  }
+  xml += "</Devices></DeviceGroup></DeviceGroups><Outputs>\r\n";
+  for (int out = 2; out < 2 + opts.outputs; ++out) {
+    xml += fmt::format("<Output Name=\"Light {}\" IntegrationID=\"{}\" "
+                       "OutputType=\"INC\"/>\r\n", out, out);
+  }
+  xml += "</Outputs></Area></Areas>";
+  // The real device sends about 128kB of data. Pad our schema with a
+  // comment, so that downloading it takes a similar amount of time.
+  if (xml.size() + 32 < opts.size*1024) {
+    xml += "<!--" + std::string(opts.size*1024 - xml.size() - 32, ' ') + "-->";
+  }
+  xml += "</Project>\r\n";
+  return xml;
+}
+
+static void flush(Session& s) {
+  // Write as much data as the socket accepts. If there is more, wait for
+  // the socket to become writable again. Errors are reported by the next
+  // read() on the same socket.
+  while (!s.out.empty()) {
+    const auto rc = write(s.fd, s.out.data(), s.out.size());
+    if (rc > 0) {
+      s.out.erase(0, rc);
+    } else if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      if (!s.writer) {
+        s.writer = event->addPollFd(s.fd, POLLOUT, [&s](auto) {
+          s.writer = {};
+          flush(s);
+          return false; });
+      }
+      return;
+    } else {
+      shutdown(s.fd, SHUT_RDWR);
+      s.out.clear();
+      return;
+    }
+  }
+}
+
+static void send(Session& s, std::string_view data) {
+  s.out += data;
+  flush(s);
+}
+
+static void drop(Session& s) {
+  const unsigned now = Util::millis();
+  const unsigned active = s.loggedIn ? now - s.loggedIn : 0;
+  printf("{\"event\":\"closed\",\"t\":%u,\"session\":%u,\"commands\":%u,"
+         "\"seconds\":%.3f,\"cmds_per_sec\":%.1f}\n",
+         elapsed(), s.id, s.commands, active/1000.0,
+         active ? s.commands*1000.0/active : 0.0);
+  fflush(stdout);
+  event->removeTimeout(s.timer);
+  event->removePollFd(s.fd);
+  close(s.fd);
+  sessions.erase(s.fd);
+}
+
+static void broadcast(int type, const std::string& line) {
+  for (auto& [ _, s ] : sessions) {
+    if (s->state == Session::READY && s->monitoring.count(type)) {
+      send(*s, line + "\r\n");
+    }
+  }
+}
+
+static void setLevel(int out, int l) {
+  levels[out] = std::max(0, std::min(10000, l));
+  broadcast(MON_ZONE, fmt::format("~OUTPUT,{},1,{}", out, level(levels[out])));
+}
+
+static void setLED(int kp, int led, int state) {
+  leds[kp][led] = state;
+  broadcast(MON_LED, fmt::format("~DEVICE,{},{},9,{}", kp, led, state));
+}
+
+static void sendReplies(Session& s) {
+  // Replies go out in order, once their latency has expired.
+  event->removeTimeout(s.timer);
+  s.timer = {};
+  const unsigned now = Util::millis();
+  while (!s.replies.empty() && (int)(s.replies.front().first - now) <= 0) {
+    send(s, s.replies.front().second);
+    s.replies.pop_front();
+  }
+  if (!s.replies.empty()) {
+    s.timer = event->addTimeout(s.replies.front().first - now,
+                                [&s]() { sendReplies(s); });
+  }
+}
+
+static void reply(Session& s, std::string text) {
+  if (!s.monitoring.count(MON_REPLY)) {
+    text.clear();
+  }
+  if (s.monitoring.count(MON_PROMPT)) {
+    text += "GNET> ";
+  }
+  s.replies.emplace_back(Util::millis() + opts.latency, std::move(text));
+  sendReplies(s);
+}
+
+static std::string execute(Session& s, const std::string& line) {
+  // Implements the subset of the integration protocol that we use, and
+  // returns the reply. Changes are broadcast to all sessions that monitor
+  // them, including the session that made the change.
+  std::vector<std::string> f;
+  for (size_t pos = 0;;) {
+    const auto comma = line.find(',', pos);
+    f.push_back(line.substr(pos, comma - pos));
+    if (comma == std::string::npos) {
+      break;
+    }
+    pos = comma + 1;
+  }
+  const auto arg = [&](size_t i) {
+    return i < f.size() ? atoi(f[i].c_str()) : -1; };
+  if (line.empty()) {
+    return "";
+  } else if (f[0] == "?OUTPUT" || f[0] == "#OUTPUT") {
+    const auto it = levels.find(arg(1));
+    if (it == levels.end()) {
+      return "~ERROR,2\r\n";
+    } else if (arg(2) != 1) {
+      return "~ERROR,3\r\n";
+    } else if (f[0][0] == '?') {
+      return fmt::format("~OUTPUT,{},1,{}\r\n", it->first, level(it->second));
+    } else if (f.size() < 4) {
+      return "~ERROR,1\r\n";
+    }
+    setLevel(it->first, (int)(atof(f[3].c_str())*100 + 0.5));
+    return "";
+  } else if (f[0] == "?DEVICE" || f[0] == "#DEVICE") {
+    const int kp = arg(1), comp = arg(2), action = arg(3);
+    const auto it = leds.find(kp);
+    if (it == leds.end()) {
+      return "~ERROR,2\r\n";
+    } else if (action == 9 && it->second.count(comp)) {
+      if (f[0][0] == '?') {
+        return fmt::format("~DEVICE,{},{},9,{}\r\n",
+                           kp, comp, it->second[comp]);
+      }
+      setLED(kp, comp, arg(4) ? 1 : 0);
+      return "";
+    } else if (f[0][0] == '#' && (action == 3 || action == 4) &&
+               comp >= 1 && comp <= BUTTONS) {
+      broadcast(MON_BUTTON, fmt::format("~DEVICE,{},{},{}", kp, comp, action));
+      if (action == 3) {
+        // Every button toggles its output, and the LED follows suit.
+        const int out = assignedOutput(kp, comp);
+        setLevel(out, levels[out] ? 0 : 10000);
+        setLED(kp, FIRST_LED + comp - 1, !!levels[out]);
+      }
+      return "";
+    }
+    return "~ERROR,3\r\n";
+  } else if (f[0] == "#MONITORING") {
+    static const int all[] = { 1, 2, 3, 4, 5, 6, 7, 8, 10, 11, 12, 13, 14,
+                               16, 17, 18, 23, 24, 27 };
+    const int type = arg(1);
+    for (const int t : all) {
+      if (type == t || type == MON_ALL) {
+        if (arg(2) == 1) {
+          s.monitoring.insert(t);
+        } else {
+          s.monitoring.erase(t);
+        }
+      }
+    }
+    return "";
+  } else if (f[0] == "?SYSTEM" && arg(1) == 1) {
+    const time_t t = time(nullptr);
+    struct tm tm;
+    localtime_r(&t, &tm);
+    return fmt::format("~SYSTEM,1,{:02}:{:02}:{:02}\r\n",
+                       tm.tm_hour, tm.tm_min, tm.tm_sec);
+  } else if (f[0] == "#SYSTEM") {
+    return "";
+  } else if (line[0] == '?' || line[0] == '#') {
+    return "~ERROR,6\r\n";
+  }
+  return "is an unknown command\r\n";
+}
+
+static void processLine(Session& s, const std::string& line) {
+  switch (s.state) {
+  case Session::USER:
+    if (line == opts.user) {
+      s.state = Session::PASSWORD;
+      send(s, "password: ");
+    } else {
+      send(s, "login: ");
+    }
+    break;
+  case Session::PASSWORD:
+    if (line == opts.password) {
+      s.state = Session::READY;
+      s.loggedIn = Util::millis();
+      printf("{\"event\":\"login\",\"t\":%u,\"session\":%u,\"ms\":%u}\n",
+             elapsed(), s.id, s.loggedIn - s.accepted);
+      fflush(stdout);
+      send(s, "\r\nGNET> ");
+    } else {
+      s.state = Session::USER;
+      send(s, "bad login\r\nlogin: ");
+    }
+    break;
+  case Session::READY: {
+    ++s.commands;
+    std::uniform_real_distribution<double> dist(0, 1);
+    if ((opts.dropAfter && s.commands >= opts.dropAfter) ||
+        (opts.drop > 0 && dist(rng) < opts.drop)) {
+      // Simulate a network problem. The command never gets a reply.
+      shutdown(s.fd, SHUT_RDWR);
+      break;
+    }
+    reply(s, execute(s, line));
+    break; }
+  }
+}
+
+static int listenOn(int port) {
+  sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+  const int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                        IPPROTO_TCP);
+  if (fd < 0 || !inet_aton(opts.addr.c_str(), &addr.sin_addr) ||
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const int[]){1}, sizeof(int))||
+      bind(fd, (sockaddr *)&addr, sizeof(addr)) || listen(fd, 16)) {
+    fprintf(stderr, "Cannot listen on %s:%d: %s\n",
+            opts.addr.c_str(), port, strerror(errno));
+    exit(1);
+  }
+  return fd;
+}
+
+static void acceptTelnet(int listener) {
+  static unsigned ids = 0;
+  for (;;) {
+    const int fd = accept4(listener, nullptr, nullptr,
+                           SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      return;
+    }
+    // Broadcasts and replies go out as separate small writes. Nagle's
+    // algorithm would hold them back, and distort the measured latencies.
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const int[]){1}, sizeof(int));
+    auto& s = *(sessions[fd] = std::make_unique<Session>());
+    s.fd = fd;
+    s.id = ++ids;
+    printf("{\"event\":\"accepted\",\"t\":%u,\"session\":%u}\n",
+           elapsed(), s.id);
+    fflush(stdout);
+    send(s, "login: ");
+    event->addPollFd(fd, POLLIN, [&s](auto) {
+      char buf[4096];
+      const auto rc = read(s.fd, buf, sizeof(buf));
+      if (rc <= 0) {
+        if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+          return true;
+        }
+        drop(s);
+        return false;
+      }
+      s.in.append(buf, rc);
+      for (size_t nl; (nl = s.in.find('\n')) != std::string::npos; ) {
+        auto line = s.in.substr(0, nl);
+        s.in.erase(0, nl + 1);
+        if (!line.empty() && line.back() == '\r') {
+          line.pop_back();
+        }
+        processLine(s, line);
+      }
+      return true;
+    });
+  }
+}
+
+static void acceptHttp(int listener) {
+  for (;;) {
+    const int fd = accept4(listener, nullptr, nullptr,
+                           SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      return;
+    }
+    // Wait for the request, then slowly drip the response. The real device
+    // is surprisingly slow at this.
+    event->addPollFd(fd, POLLIN, [fd, req = std::string()](auto) mutable {
+      char buf[1024];
+      const auto rc = read(fd, buf, sizeof(buf));
+      if (rc > 0) {
+        req.append(buf, rc);
+        if (req.find("\r\n\r\n") == std::string::npos) {
+          return true;
+        }
+      } else if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return true;
+      }
+      event->removePollFd(fd);
+      if (rc <= 0 || !Util::starts_with(req, "GET /DbXmlInfo.xml ")) {
+        const char NOTFOUND[] = "HTTP/1.0 404 Not Found\r\n\r\n";
+        (void)!write(fd, NOTFOUND, sizeof(NOTFOUND) - 1);
+        close(fd);
+        return false;
+      }
+      auto resp = std::make_shared<std::string>(
+        "HTTP/1.1 200 OK\r\nContent-Type: text/xml\r\n\r\n" + schema);
+      auto pos = std::make_shared<size_t>(0);
+      const unsigned begin = Util::millis();
+      const auto next = Util::rec([=](auto&& next) -> void {
+        const auto n = std::min((size_t)opts.chunk, resp->size() - *pos);
+        const auto rc = write(fd, resp->data() + *pos, n);
+        if (rc > 0) {
+          *pos += rc;
+        } else if (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+          *pos = resp->size();
+        }
+        if (*pos < resp->size()) {
+          event->addTimeout(opts.drip, next);
+          return;
+        }
+        printf("{\"event\":\"schema\",\"t\":%u,\"bytes\":%zu,\"ms\":%u}\n",
+               elapsed(), resp->size(), Util::millis() - begin);
+        fflush(stdout);
+        close(fd);
+      });
+      next();
+      return false;
+    });
+  }
+}
+
+static void discovery() {
+  // Answer "<LUTRON=1>" requests on the multicast address. The reply looks
+  // like XML, but uses a quirky format with zero-padded IP addresses.
+  const auto mcast=(const sockaddr_in){AF_INET,htons(2647),htonl(0xE000252A)};
+  const auto membr=(const ip_mreq){htonl(0xE000252A)};
+  const int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                        IPPROTO_UDP);
+  if (fd < 0 ||
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const int[]){1}, sizeof(int))||
+      bind(fd, (const sockaddr *)&mcast, sizeof(mcast)) ||
+      setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membr, sizeof(membr))) {
+    fprintf(stderr, "Multicast discovery is unavailable: %s\n",
+            strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return;
+  }
+  in_addr addr;
+  inet_aton(opts.addr.c_str(), &addr);
+  const uint32_t a = ntohl(addr.s_addr);
+  const auto resp = fmt::format(
+    "<LUTRON=2><PRODFAMILY=RadioRA2><PRODTYPE=MainRepeater><CODEVER=12.0.0>"
+    "<IPADDR={:03}.{:03}.{:03}.{:03}><MACADDR=00:0f:e7:00:00:01></LUTRON>",
+    a >> 24, (a >> 16) & 0xFF, (a >> 8) & 0xFF, a & 0xFF);
+  event->addPollFd(fd, POLLIN, [=](auto) {
+    char buf[1500];
+    for (ssize_t rc; (rc = read(fd, buf, sizeof(buf))) > 0; ) {
+      if (std::string_view(buf, rc).starts_with("<LUTRON=1>")) {
+        sendto(fd, resp.data(), resp.size(), 0, (const sockaddr *)&mcast,
+               sizeof(mcast));
+        printf("{\"event\":\"discovery\",\"t\":%u}\n", elapsed());
+        fflush(stdout);
+      }
+    }
+    return true;
+  });
+}
+
+static void bursts() {
+  // Unsolicited events arrive whenever something changes in the house.
+  // They can show up at any time, even in between replies to commands.
+  std::uniform_int_distribution<int> out(2, opts.outputs + 1);
+  std::uniform_int_distribution<int> lvl(0, 100);
+  for (unsigned i = 0; i < opts.burst; ++i) {
+    setLevel(out(rng), lvl(rng)*100);
+  }
+  event->addTimeout(opts.every, bursts);
+}
+
+int main(int argc, char *argv[]) {
+  for (int i = 1; i < argc; ++i) {
+    const char *eq = strchr(argv[i], '=');
+    if (!eq) {
+      usage(argv[0]);
+      return 1;
+    }
+    const std::string key(argv[i], eq - argv[i]);
+    const char *val = eq + 1;
+    if (key == "addr") opts.addr = val;
+    else if (key == "telnet") opts.telnet = atoi(val);
+    else if (key == "http") opts.http = atoi(val);
+    else if (key == "user") opts.user = val;
+    else if (key == "password") opts.password = val;
+    else if (key == "outputs") opts.outputs = std::max(1, atoi(val));
+    else if (key == "keypads") opts.keypads = std::max(0, atoi(val));
+    else if (key == "latency") opts.latency = atoi(val);
+    else if (key == "chunk") opts.chunk = std::max(1, atoi(val));
+    else if (key == "drip") opts.drip = atoi(val);
+    else if (key == "size") opts.size = atoi(val);
+    else if (key == "burst") opts.burst = atoi(val);
+    else if (key == "every") opts.every = std::max(1, atoi(val));
+    else if (key == "drop") opts.drop = atof(val);
+    else if (key == "dropafter") opts.dropAfter = atoi(val);
+    else if (key == "discovery") opts.discovery = atoi(val);
+    else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  // Initialize the state of the simulated installation.
+  for (int out = 2; out < 2 + opts.outputs; ++out) {
+    levels[out] = 0;
+  }
+  for (int kp = firstKeypad(); kp < firstKeypad() + opts.keypads; ++kp) {
+    for (int bt = 1; bt <= BUTTONS; ++bt) {
+      leds[kp][FIRST_LED + bt - 1] = 0;
+    }
+  }
+  schema = makeSchema();
+
+  Event ev;
+  event = &ev;
+  const int telnet = listenOn(opts.telnet);
+  const int http = listenOn(opts.http);
+  ev.addPollFd(telnet, POLLIN, [=](auto) {
+    acceptTelnet(telnet); return true; });
+  ev.addPollFd(http, POLLIN, [=](auto) { acceptHttp(http); return true; });
+  if (opts.discovery) {
+    discovery();
+  }
+  if (opts.burst) {
+    ev.addTimeout(opts.every, bursts);
+  }
+  printf("{\"event\":\"ready\",\"t\":%u,\"addr\":\"%s\",\"telnet\":%d,"
+         "\"http\":%d,\"outputs\":%d,\"keypads\":%d,\"schema\":%zu}\n",
+         elapsed(), opts.addr.c_str(), opts.telnet, opts.http,
+         opts.outputs, opts.keypads, schema.size());
+  fflush(stdout);
+  ev.loop();
+  return 0;
+}
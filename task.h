@@ -0,0 +1,394 @@
+#pragma once
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <coroutine>
+#include <optional>
+#include <source_location>
+#include <string>
+#include <utility>
+
+#include "event.h"
+
+
+// Coroutine support for the event loop. A function that returns a "Task"
+// can "co_await" timeouts, file descriptors, signals, and other tasks. This
+// makes it possible to write sequential-looking code for what would
+// otherwise be a long chain of nested callbacks. All of the state lives in a
+// single coroutine frame. And when a task gets cancelled, the frame is
+// destroyed, which unwinds all local objects with their normal destructors.
+// Awaitables remove their registrations from the event loop when that
+// happens.
+//
+// Tasks are lazy. A task that is awaited by another task starts running
+// when it is awaited. The outermost task has to be started explicitly by
+// calling "start()", and it runs until its first suspension point before
+// "start()" returns. The owner of the outermost task can "cancel()" it at
+// any time. That includes calls from code that is executed by the task
+// itself. In that case, the frame stays alive until the task suspends
+// next, and the task should return as soon as possible.
+//
+// N.B. GCC 12 has a few bugs that silently miscompile coroutines. It
+// destroys aggregate temporaries (this includes lambdas) that are passed as
+// arguments in a "co_await" expression twice. Always bind them to a local
+// variable first. And it generates a coroutine that never runs, if the
+// coroutine contains "co_return co_await ...". Store the result in a local
+// variable instead.
+class TaskPromise {
+ public:
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  auto final_suspend() noexcept {
+    // When a task completes, it transfers control straight back to the
+    // task that has been waiting for it, if any.
+    struct Final {
+      bool await_ready() noexcept { return false; }
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<>) noexcept {
+        return continuation ? continuation : std::noop_coroutine(); }
+      void await_resume() noexcept { }
+      std::coroutine_handle<> continuation;
+    };
+    return Final{ continuation_ };
+  }
+  void unhandled_exception() { abort(); }
+
+  // Awaitables must resume suspended coroutines by calling this method. It
+  // keeps track of whether the task is currently running, which allows for
+  // deferring cancellation until it is safe to destroy the frame.
+  static void resume(TaskPromise *promise, std::coroutine_handle<> handle) {
+    TaskPromise *root = promise->root_;
+    ++root->active_;
+    handle.resume();
+    if (!--root->active_ && root->cancelled_) {
+      root->self_.destroy();
+    }
+  }
+
+ protected:
+  template <class T> friend class Task;
+
+  std::coroutine_handle<> self_;
+  std::coroutine_handle<> continuation_;
+  TaskPromise *root_ = this;
+  unsigned active_ = 0;
+  bool cancelled_ = false;
+};
+
+template <class T = void>
+class Task {
+ public:
+  class promise_type;
+  using Handle = std::coroutine_handle<promise_type>;
+
+  Task() { }
+  Task(Task&& o) : handle_(std::exchange(o.handle_, nullptr)) { }
+  Task& operator=(Task&& o) {
+    if (this != &o) {
+      cancel();
+      handle_ = std::exchange(o.handle_, nullptr);
+    }
+    return *this;
+  }
+  ~Task() { cancel(); }
+
+  explicit operator bool() const { return !!handle_; }
+  bool done() const { return !handle_ || handle_.done(); }
+
+  // Runs the outermost task until it suspends for the first time.
+  void start() {
+    if (handle_ && !handle_.done()) {
+      TaskPromise::resume(&handle_.promise(), handle_);
+    }
+  }
+
+  // Destroys the coroutine frame, and thus all of its local objects. If the
+  // task is running right now, this has to wait until it suspends.
+  void cancel() {
+    if (!handle_) {
+      return;
+    }
+    auto& promise = handle_.promise();
+    if (!handle_.done() && promise.root_ == &promise && promise.active_) {
+      promise.cancelled_ = true;
+    } else {
+      handle_.destroy();
+    }
+    handle_ = nullptr;
+  }
+
+  // Awaiting a task starts it, and resumes the caller once it completes.
+  // The nested task inherits the caller's outermost task, which is used
+  // for keeping track of cancellation.
+  class Awaiter {
+   public:
+    explicit Awaiter(Handle handle) : handle_(handle) { }
+    bool await_ready() noexcept { return !handle_ || handle_.done(); }
+    template <class P>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> caller) {
+      auto& promise = handle_.promise();
+      promise.continuation_ = caller;
+      promise.root_ = static_cast<TaskPromise&>(caller.promise()).root_;
+      return handle_;
+    }
+    T await_resume() {
+      if constexpr (!std::is_void_v<T>) {
+        return std::move(*handle_.promise().value_);
+      }
+    }
+
+   private:
+    Handle handle_;
+  };
+  Awaiter operator co_await() && noexcept { return Awaiter(handle_); }
+
+ private:
+  explicit Task(Handle handle) : handle_(handle) { }
+
+  Handle handle_;
+};
+
+template <class T>
+class Task<T>::promise_type : public TaskPromise {
+ public:
+  Task get_return_object() {
+    self_ = Handle::from_promise(*this);
+    return Task(Handle::from_promise(*this));
+  }
+  template <class V>
+  void return_value(V&& value) { value_.emplace(std::forward<V>(value)); }
+
+ private:
+  friend class Task;
+  std::optional<T> value_;
+};
+
+template <>
+class Task<void>::promise_type : public TaskPromise {
+ public:
+  Task get_return_object() {
+    self_ = Handle::from_promise(*this);
+    return Task(Handle::from_promise(*this));
+  }
+  void return_void() { }
+};
+
+// A level-less condition that tasks can wait on. "notify()" resumes all
+// tasks that are currently waiting. If nobody is waiting, the notification
+// is lost. So, callers should always check their actual condition first.
+// Waiting can optionally time out, in which case "co_await" returns false.
+class Signal {
+ private:
+  class Waiter;
+
+ public:
+  Signal() { }
+  Signal(const Signal&) = delete;
+  Signal& operator=(const Signal&) = delete;
+  ~Signal() {
+    for (Waiter *list : { waiters_, pending_ }) {
+      for (Waiter *w = list; w; w = w->next_) {
+        w->signal_ = nullptr;
+      }
+    }
+  }
+
+  void notify() {
+    // Tasks that get resumed can immediately wait again. So, move all
+    // current waiters to a separate list first. If a task notifies us
+    // recursively, its waiters are simply added to that list.
+    Waiter *list = std::exchange(waiters_, nullptr);
+    if (!list) {
+      return;
+    } else if (pending_) {
+      Waiter *tail = list;
+      while (tail->next_) {
+        tail = tail->next_;
+      }
+      tail->next_ = pending_;
+      pending_->prev_ = tail;
+      pending_ = list;
+      return;
+    }
+    pending_ = list;
+    while (Waiter *w = pending_) {
+      w->unlink();
+      w->wake(true);
+    }
+  }
+
+  Waiter operator co_await() { return Waiter(this, nullptr, -1, {}); }
+  Waiter wait(Event& event, unsigned tmo,
+              std::source_location loc = std::source_location::current()) {
+    return Waiter(this, &event, (int)tmo, loc);
+  }
+
+ private:
+  class Waiter {
+   public:
+    Waiter(Signal *signal, Event *event, int tmo, std::source_location loc)
+      : signal_(signal), event_(event), tmo_(tmo), loc_(loc) { }
+    Waiter(const Waiter&) = delete;
+    ~Waiter() {
+      unlink();
+      if (timeout_) {
+        event_->removeTimeout(timeout_);
+      }
+    }
+
+    bool await_ready() { return false; }
+    template <class P>
+    void await_suspend(std::coroutine_handle<P> handle) {
+      promise_ = &handle.promise();
+      handle_ = handle;
+      if ((next_ = signal_->waiters_) != nullptr) {
+        next_->prev_ = this;
+      }
+      signal_->waiters_ = this;
+      if (event_ && tmo_ >= 0) {
+        timeout_ = event_->addTimeout(tmo_, [this]() {
+          timeout_ = {};
+          unlink();
+          wake(false); }, loc_);
+      }
+    }
+    bool await_resume() { return notified_; }
+
+   private:
+    friend class Signal;
+
+    void unlink() {
+      if (!signal_ || !handle_) {
+        return;
+      }
+      // Waiters are either on the main list, or on the list of waiters
+      // that are about to be woken up by "notify()".
+      if (prev_) {
+        prev_->next_ = next_;
+      } else if (signal_->pending_ == this) {
+        signal_->pending_ = next_;
+      } else {
+        signal_->waiters_ = next_;
+      }
+      if (next_) {
+        next_->prev_ = prev_;
+      }
+      prev_ = next_ = nullptr;
+      signal_ = nullptr;
+    }
+
+    void wake(bool notified) {
+      notified_ = notified;
+      if (timeout_) {
+        event_->removeTimeout(timeout_);
+        timeout_ = {};
+      }
+      TaskPromise::resume(promise_, handle_);
+    }
+
+    Signal *signal_;
+    Event *event_;
+    int tmo_;
+    std::source_location loc_;
+    Event::Handle timeout_;
+    TaskPromise *promise_ = nullptr;
+    std::coroutine_handle<> handle_;
+    Waiter *prev_ = nullptr, *next_ = nullptr;
+    bool notified_ = false;
+  };
+
+  Waiter *waiters_ = nullptr;
+  Waiter *pending_ = nullptr;
+};
+
+// Resumes the awaiting task after a delay.
+class Event::Sleep {
+ public:
+  Sleep(Event& event, unsigned ms, std::source_location loc)
+    : event_(event), ms_(ms), loc_(loc) { }
+  Sleep(const Sleep&) = delete;
+  ~Sleep() {
+    if (handle_) {
+      event_.removeTimeout(handle_);
+    }
+  }
+
+  bool await_ready() { return false; }
+  template <class P>
+  void await_suspend(std::coroutine_handle<P> coro) {
+    handle_ = event_.addTimeout(ms_, [this, coro, p = &coro.promise()]() {
+      handle_ = {};
+      TaskPromise::resume(p, coro); }, loc_);
+  }
+  void await_resume() { }
+
+ private:
+  Event& event_;
+  unsigned ms_;
+  std::source_location loc_;
+  Event::Handle handle_;
+};
+
+// Resumes the awaiting task when a file descriptor becomes ready, or when
+// the optional timeout expires. Returns the "revents", or zero on timeout.
+class Event::Ready {
+ public:
+  Ready(Event& event, int fd, short events, int tmo, std::source_location loc)
+    : event_(event), fd_(fd), events_(events), tmo_(tmo), loc_(loc) { }
+  Ready(const Ready&) = delete;
+  ~Ready() { clear(); }
+
+  bool await_ready() { return false; }
+  template <class P>
+  void await_suspend(std::coroutine_handle<P> coro) {
+    TaskPromise *p = &coro.promise();
+    poll_ = event_.addPollFd(fd_, events_, [this, coro, p](pollfd *pfd) {
+      // Remove the registration before resuming, as the task could
+      // immediately wait for the same file descriptor again.
+      revents_ = pfd ? pfd->revents : events_;
+      clear();
+      TaskPromise::resume(p, coro);
+      return false; }, Event::LEVEL, loc_);
+    if (tmo_ >= 0) {
+      timeout_ = event_.addTimeout(tmo_, [this, coro, p]() {
+        timeout_ = {};
+        clear();
+        TaskPromise::resume(p, coro); }, loc_);
+    }
+  }
+  short await_resume() { return revents_; }
+
+ private:
+  void clear() {
+    if (poll_) {
+      event_.removePollFd(poll_);
+      poll_ = {};
+    }
+    if (timeout_) {
+      event_.removeTimeout(timeout_);
+      timeout_ = {};
+    }
+  }
+
+  Event& event_;
+  int fd_;
+  short events_, revents_ = 0;
+  int tmo_;
+  std::source_location loc_;
+  Event::Handle poll_, timeout_;
+};
+
+inline Event::Sleep Event::sleep(unsigned ms, std::source_location loc) {
+  return Sleep(*this, ms, loc);
+}
+
+inline Event::Ready Event::readable(int fd, int tmo,
+                                    std::source_location loc) {
+  return Ready(*this, fd, POLLIN, tmo, loc);
+}
+
+inline Event::Ready Event::writable(int fd, int tmo,
+                                    std::source_location loc) {
+  return Ready(*this, fd, POLLOUT, tmo, loc);
+}
@@ -2,21 +2,56 @@
 
 #include "util.h"
 
+// Worker threads read the clock, too. The pointer is only ever changed
+// while the program is still single-threaded, though.
+static Util::SimulatedClock *simulated;
+
+Util::SimulatedClock::SimulatedClock(time_t wall, uint64_t micros)
+  : now_(micros), wall_(wall) {
+  simulated = this;
+}
+
+Util::SimulatedClock::~SimulatedClock() {
+  if (simulated == this) {
+    simulated = nullptr;
+  }
+}
+
+Util::SimulatedClock *Util::simulatedClock() {
+  return simulated;
+}
+
 unsigned int Util::millis() {
-  struct timespec spec;
-  clock_gettime(CLOCK_MONOTONIC, &spec);
-  return(spec.tv_sec*1000 + spec.tv_nsec / 1000000);
+  return (unsigned int)millis64();
 }
 
 unsigned int Util::micros() {
+  return (unsigned int)micros64();
+}
+
+uint64_t Util::millis64() {
+  // The 32bit version of millis() wraps around after about 49 days. That's
+  // fine for measuring short intervals, but the event loop needs a clock
+  // that can be compared without having to worry about overflows.
+  return micros64() / 1000;
+}
+
+uint64_t Util::micros64() {
+  if (simulated) {
+    return simulated->now();
+  }
   struct timespec spec;
   clock_gettime(CLOCK_MONOTONIC, &spec);
-  return(spec.tv_sec*1000000 + spec.tv_nsec / 1000);
+  return (uint64_t)spec.tv_sec*1000000 + spec.tv_nsec / 1000;
 }
 
 unsigned int Util::timeOfDay() {
-  time_t t = time(NULL);
+  time_t t = time();
   struct tm tm = { 0 };
   localtime_r(&t, &tm);
   return tm.tm_hour*100 + tm.tm_min;
 }
+
+time_t Util::time() {
+  return simulated ? simulated->wall() : ::time(NULL);
+}
@@ -1,9 +1,13 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
 #include <cctype>
 #include <functional>
+#include <stdint.h>
 #include <string>
+#include <string_view>
+#include <time.h>
 
 #if defined(NDEBUG)
 #define DBG(x)     do { } while (0)
@@ -29,7 +33,38 @@ extern "C" {
 namespace Util {
   unsigned int millis();
   unsigned int micros();
+  uint64_t millis64();
+  uint64_t micros64();
   unsigned int timeOfDay();
+  time_t time();
+
+  // All time measurements go through the functions above. Normally, they
+  // read the system's clocks. But tests and benchmarks can install a
+  // simulated clock instead, which only advances when told to. The event
+  // loop notices this and, rather than sleeping, skips straight to the next
+  // deadline whenever it would otherwise be idle. That runs time-dependent
+  // code much faster than real time, and it makes the results independent
+  // of how busy the machine is. The clock must be installed before any
+  // "Event" object gets created, and it is uninstalled when it goes away.
+  class SimulatedClock {
+   public:
+    SimulatedClock(time_t wall = 0, uint64_t micros = 0);
+    SimulatedClock(const SimulatedClock&) = delete;
+    ~SimulatedClock();
+    uint64_t now() const { return now_.load(std::memory_order_relaxed); }
+    time_t wall() const { return wall_ + (time_t)(now() / 1000000); }
+    void advance(uint64_t us) { now_.fetch_add(us, std::memory_order_relaxed); }
+    void advanceTo(uint64_t us) {
+      if (us > now()) {
+        now_.store(us, std::memory_order_relaxed);
+      }
+    }
+
+   private:
+    std::atomic<uint64_t> now_;
+    const time_t wall_;
+  };
+  SimulatedClock *simulatedClock();
 
   inline std::string trim(const std::string& s) {
     auto wsfront = std::find_if_not(s.begin(), s.end(),
@@ -39,6 +74,14 @@ namespace Util {
     return (wsback <= wsfront ? std::string() : std::string(wsfront, wsback));
   }
 
+  inline std::string_view trimView(std::string_view s) {
+    const auto front = s.find_first_not_of(" \t\n\v\f\r");
+    if (front == std::string_view::npos) {
+      return { };
+    }
+    return s.substr(front, s.find_last_not_of(" \t\n\v\f\r") - front + 1);
+  }
+
 
   inline bool starts_with(const std::string& s, const std::string starts) {
     return !s.rfind(starts, 0);
@@ -0,0 +1,182 @@
+#include <errno.h>
+#include <poll.h>
+#include <sys/uio.h>
+
+#include "util.h"
+#include "writer.h"
+
+
+Writer::Writer(Event& event, size_t highWater)
+  : event_(event), fd_(-1), highWater_(highWater), pending_(0), offset_(0),
+    scheduled_(false), failed_(false), generation_(0), err_(nullptr) {
+}
+
+Writer::~Writer() {
+  detach();
+}
+
+void Writer::attach(int fd) {
+  // Forget everything about the old file descriptor. Callbacks that are
+  // still scheduled for it check the generation and then do nothing. That
+  // includes a pending flush, so the next write has to schedule a new one.
+  ++generation_;
+  if (poll_) {
+    event_.removePollFd(poll_);
+    poll_ = {};
+  }
+  if (io_) {
+    event_.cancelIo(io_);
+    io_ = {};
+  }
+  queue_.clear();
+  pending_ = offset_ = 0;
+  scheduled_ = failed_ = false;
+  fd_ = fd;
+  progress_.notify();
+}
+
+bool Writer::write(std::string data) {
+  if (!ok()) {
+    return false;
+  }
+  if (!data.empty()) {
+    pending_ += data.size();
+    queue_.push_back(std::move(data));
+    schedule();
+  }
+  return true;
+}
+
+Task<bool> Writer::room() {
+  while (ok() && full()) {
+    co_await progress_;
+  }
+  co_return ok();
+}
+
+void Writer::schedule() {
+  // Wait until the current callbacks have finished queueing their data.
+  // Then send all of it at once. If we are already waiting for the file
+  // descriptor to become writable, or for io_uring to complete an earlier
+  // write, there is nothing else to do.
+  if (scheduled_ || poll_ || io_) {
+    return;
+  }
+  scheduled_ = true;
+  event_.runLater([this, generation = generation_]() {
+    if (generation == generation_) {
+      scheduled_ = false;
+      flush();
+    }
+  });
+}
+
+void Writer::flush() {
+  const auto generation = generation_;
+  if (event_.hasRing() || writeSome()) {
+    if (poll_) {
+      event_.removePollFd(poll_);
+      poll_ = {};
+    }
+    if (event_.hasRing()) {
+      submit();
+    }
+  } else {
+    waitWritable();
+  }
+  if (failed_ && err_) {
+    event_.runLater([this, generation]() {
+      if (generation == generation_ && err_) {
+        err_();
+      }
+    });
+  }
+  // Waking up a waiting task can re-enter the writer (e.g. to detach it).
+  // So, this has to be the very last thing that we do.
+  progress_.notify();
+}
+
+void Writer::submit() {
+  // With io_uring, the kernel writes a copy of everything that is queued.
+  // The queue itself only shrinks once the write has completed. Data that
+  // gets queued in the meantime goes out with the next submission.
+  if (queue_.empty() || failed_) {
+    return;
+  }
+  std::string data;
+  data.reserve(pending_);
+  for (const auto& s : queue_) {
+    data.append(s, data.empty() ? offset_ : 0);
+  }
+  io_ = event_.submitWrite(fd_, std::move(data), [this](int res) {
+    io_ = {};
+    if (res > 0) {
+      consume(res);
+    } else if (res == -EAGAIN) {
+      waitWritable();
+      return;
+    } else {
+      DBG("io_uring write failed: " << -res);
+      fail();
+    }
+    flush(); });
+  if (!io_) {
+    // The ring is out of space. Try again on the next iteration of the loop.
+    waitWritable();
+  }
+}
+
+void Writer::waitWritable() {
+  if (!poll_) {
+    poll_ = event_.addPollFd(fd_, POLLOUT, [this](auto) {
+      flush();
+      return true; });
+  }
+}
+
+bool Writer::writeSome() {
+  // Returns true, once there is nothing more to do. This either means that
+  // all data has been written, or that the file descriptor has failed.
+  static const int IOVS = 64;
+  while (!queue_.empty()) {
+    struct iovec iov[IOVS];
+    int n = 0;
+    for (auto it = queue_.begin(); it != queue_.end() && n < IOVS; ++it) {
+      const size_t skip = n ? 0 : offset_;
+      iov[n++] = { it->data() + skip, it->size() - skip };
+    }
+    ssize_t rc = writev(fd_, iov, n);
+    if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return false;
+    } else if (rc < 0 && errno == EINTR) {
+      continue;
+    } else if (rc <= 0) {
+      DBG("writev() failed: " << errno);
+      fail();
+      return true;
+    }
+    consume(rc);
+  }
+  return true;
+}
+
+void Writer::consume(size_t len) {
+  // Drops data from the front of the queue, after it has been written.
+  pending_ -= len;
+  while (len > 0) {
+    const size_t left = queue_.front().size() - offset_;
+    if (len < left) {
+      offset_ += len;
+      break;
+    }
+    len -= left;
+    offset_ = 0;
+    queue_.pop_front();
+  }
+}
+
+void Writer::fail() {
+  failed_ = true;
+  queue_.clear();
+  pending_ = offset_ = 0;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <deque>
+#include <functional>
+#include <string>
+
+#include "event.h"
+#include "task.h"
+
+
+// Buffered output for a non-blocking file descriptor that is managed by
+// "Event". Callers append data to the queue, and it goes out with a single
+// "writev()" as soon as the file descriptor is writable. Everything that
+// gets queued while the event loop runs the same set of callbacks is
+// flushed together. Partial writes keep going, whenever the kernel can
+// accept more data. If io_uring is available, writes go through the ring.
+// The amount of unwritten data is not limited. But once it exceeds the
+// high-water mark, "full()" returns true, and "co_await room()" waits
+// until the queue has drained below that mark again.
+// If the file descriptor fails, all queued data is discarded, and the
+// "onerror()" callback runs from the event loop. The writer never closes
+// the file descriptor itself.
+class Writer {
+ public:
+  Writer(Event& event, size_t highWater = 64*1024);
+  ~Writer();
+  Writer(const Writer&) = delete;
+  Writer& operator=(const Writer&) = delete;
+  Writer& onerror(std::function<void ()> err) {
+    err_ = std::move(err); return *this; }
+  Writer& highWater(size_t highWater) {
+    highWater_ = highWater; return *this; }
+
+  // Starts writing to a new file descriptor, or stops writing altogether,
+  // if "fd" is negative. Any data that is still queued for the old file
+  // descriptor gets discarded.
+  void attach(int fd);
+  void detach() { attach(-1); }
+  bool write(std::string data);
+  size_t pending() const { return pending_; }
+  bool full() const { return pending_ >= highWater_; }
+  bool ok() const { return fd_ >= 0 && !failed_; }
+  Task<bool> room();
+
+ private:
+  void schedule();
+  void flush();
+  void submit();
+  void waitWritable();
+  bool writeSome();
+  void consume(size_t len);
+  void fail();
+
+  Event& event_;
+  int fd_;
+  size_t highWater_, pending_, offset_;
+  bool scheduled_, failed_;
+  unsigned generation_;
+  std::deque<std::string> queue_;
+  Event::Handle poll_, io_;
+  Signal progress_;
+  std::function<void ()> err_;
+};
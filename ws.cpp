@@ -98,8 +98,10 @@ WS::WS(Event* event, int port)
       // Need to add a timeout to make poll() exit early and for the
       // event loop to call into this handler again. That will end up
       // periodically calling "lws_service_adjust_timeout()". But the
-      // actual timeout handler can have an empty callback.
-      event_->addTimeout(newTmo, [](){});
+      // actual timeout handler can have an empty callback. libwebsockets
+      // timers aren't time critical, so they can be batched with others.
+      event_->setPriority(event_->addTimeout(newTmo, newTmo/8, [](){}),
+                          Event::BULK);
     }
   });
 
@@ -134,11 +136,11 @@ int WS::accept(lws *wsi) {
   // event loop. Call back into libwebsocket, whenever new data arrives.
   WS *ws = *(WS **)lws_evlib_wsi_to_evlib_pt(wsi);
   int fd = lws_get_socket_fd(wsi);
-  ws->event_->addPollFd(fd, POLLIN,
+  ws->event_->setPriority(ws->event_->addPollFd(fd, POLLIN,
     [ctx = ws->ctx_](pollfd *pfd) {
       lws_service_fd(ctx, pfd);
       return true;
-    });
+    }), Event::BULK);
   return 0;
 }
 
@@ -154,18 +156,20 @@ void WS::io(lws *wsi, unsigned flags) {
   }
   if (flags & LWS_EV_START) {
     if (flags & LWS_EV_READ) {
-      ws->event_->addPollFd(lws_get_socket_fd(wsi), POLLIN,
-        [ctx = ws->ctx_](pollfd *pfd) {
-          lws_service_fd(ctx, pfd);
-          return true;
-        });
+      ws->event_->setPriority(
+        ws->event_->addPollFd(lws_get_socket_fd(wsi), POLLIN,
+          [ctx = ws->ctx_](pollfd *pfd) {
+            lws_service_fd(ctx, pfd);
+            return true;
+          }), Event::BULK);
     }
     if (flags & LWS_EV_WRITE) {
-      ws->event_->addPollFd(lws_get_socket_fd(wsi), POLLOUT,
-        [ctx = ws->ctx_](pollfd *pfd) {
-          lws_service_fd(ctx, pfd);
-          return true;
-        });
+      ws->event_->setPriority(
+        ws->event_->addPollFd(lws_get_socket_fd(wsi), POLLOUT,
+          [ctx = ws->ctx_](pollfd *pfd) {
+            lws_service_fd(ctx, pfd);
+            return true;
+          }), Event::BULK);
     }
   }
 }
@@ -25,7 +25,7 @@ class WS {
   Event *event_;
   std::function<const std::string ()> keypadReq_;
   std::function<void (const std::string&)> cmd_;
-  void *loop_;
+  Event::Handle loop_;
   lws_context *ctx_;
   lws_protocols protocols_[4];
   lws_protocol_vhost_options headers_[5];